@@ -6,10 +6,113 @@
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
 #include <HTTPClient.h>
+#include <esp_app_format.h>
 #include <esp_ota_ops.h>
 #include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <esp_timer.h>
 
+#include <atomic> // std::atomic
+
+#include "UpdateOTAConfig.hpp"
 #include "UpdateOTAInterface.hpp"
+#include "UpdateOTARollout.hpp"
+#include "UpdateOTASignature.hpp"
+#include "UpdateOTATrace.hpp"
+#include "UpdateOTAVersion.hpp"
+
+#if UPDATE_OTA_BUNDLE
+#include "UpdateOTABundle.hpp"
+#endif
+#if UPDATE_OTA_SPARSE
+#include "UpdateOTASparse.hpp"
+#endif
+#if UPDATE_OTA_BUNDLE || UPDATE_OTA_SPARSE
+#include "UpdateOTAPartitionWriter.hpp"
+#endif
+#if UPDATE_OTA_BACKGROUND_STAGING
+#include "UpdateOTAStagingRecord.hpp"
+#endif
+
+#if UPDATE_OTA_MULTICAST
+#include <WiFiUdp.h>
+#include "UpdateOTAFountainDecoder.hpp"
+#endif
+#if UPDATE_OTA_FILE_SYNC
+#include <FS.h>
+#include "UpdateOTAFileManifest.hpp"
+#endif
+#if UPDATE_OTA_PIPELINE
+#include "UpdateOTABlockRing.hpp"
+#endif
+
+#define FILE_SYNC_MANIFEST "/.ota_manifest" // Where syncFileSystem() keeps the manifest of the last complete sync.
+#define FILE_SYNC_TEMP_SUFFIX ".tmp"        // Suffix of files being downloaded by syncFileSystem().
+#define FILE_SYNC_BACKUP_SUFFIX ".bak"      // Suffix of old files kept while syncFileSystem() swaps them.
+#define MAX_TARGETS (8)                     // Maximum number of targets of a multi-partition session.
+#define QOS_YIELD_INTERVAL_MS (50)          // Longest time an update runs without sleeping for a tick.
+#define PIPELINE_SLOTS (3)                  // Blocks buffered between the network and the flash stage.
+#define PIPELINE_STACK_SIZE (4096)          // Stack of the flash stage task.
+#define STAGING_SAVE_INTERVAL (16)          // Blocks staged between two saves of the staging state.
+#define ETAG_MAX (72)                       // Longest ETag kept for conditional requests, including the terminator.
+#define MANIFEST_MAX_SIZE (512)             // Largest version manifest read by getUpdateManifest(), including the terminator.
+
+/**
+ * @brief TLS settings used for every HTTPS session opened by UpdateOTA
+ *
+ * Cipher suites, max-fragment-length and the mbedTLS record buffer sizes are fixed when
+ * mbedTLS is compiled (CONFIG_MBEDTLS_* in sdkconfig), WiFiClientSecure does not expose them
+ * at runtime. What can be tuned per session is the trust anchor, which decides whether an
+ * ECDSA P-256 chain can be accepted, and the timeouts.
+ */
+struct UpdateOTATlsProfile
+{
+    const char *caCert;            ///< PEM root certificate used to verify the server, nullptr for insecure mode
+    uint32_t handshakeTimeoutSec;  ///< Maximum time for the TLS handshake in seconds
+    uint32_t streamTimeoutMs;      ///< Timeout for reading the input stream in milliseconds
+    uint32_t httpTimeoutMs;        ///< Timeout for the HTTP request in milliseconds
+};
+
+/**
+ * @brief Mirror selection settings used by startUpdate() with several URLs
+ */
+struct UpdateOTAMirrorPolicy
+{
+    uint32_t rankingTtlMs;       ///< How long the measured mirror ranking is reused
+    uint32_t minThroughput;      ///< Switch to the next mirror below this throughput in bytes per second
+    uint32_t throughputWindowMs; ///< Window over which the throughput is measured
+};
+
+/**
+ * @brief Retry settings for transient failures of startUpdate()
+ */
+struct UpdateOTARetryPolicy
+{
+    uint8_t maxAttempts;  ///< Total number of attempts, 1 disables retries
+    uint32_t baseDelayMs; ///< Backoff cap of the first retry, doubled on each retry
+    uint32_t maxDelayMs;  ///< Maximum backoff cap, longer Retry-After values end the retries
+};
+
+/**
+ * @brief Bandwidth and CPU limits of a running update, see UpdateOTA::setQosPolicy()
+ */
+struct UpdateOTAQosPolicy
+{
+    uint32_t maxBytesPerSec;  ///< Token bucket rate, zero for no bandwidth cap
+    uint32_t burstBytes;      ///< Token bucket depth, bytes that may pass at full speed
+    uint8_t dutyCyclePercent; ///< Share of the time spent on the update, 100 to never pause
+};
+
+/**
+ * @brief One partition of a multi-partition update session
+ */
+struct UpdateOTATarget
+{
+    const char *uRL;                 ///< Image URL, targets on the same host share one connection
+    esp_partition_type_t type;       ///< ESP_PARTITION_TYPE_APP for the next OTA slot, or ESP_PARTITION_TYPE_DATA
+    esp_partition_subtype_t subtype; ///< Data subtype, ESP_PARTITION_SUBTYPE_ANY to match by label only
+    const char *label;               ///< Label from partitions.csv, nullptr to match by type and subtype
+};
 
 /**
  * @brief Class for handling Over-The-Air (OTA) updates
@@ -42,25 +145,80 @@ public:
      *      UpdateOTAError::NO_PARTITION_AVAILABLE  - If there is no available partition for update
      *      UpdateOTAError::UPDATE_PROGRESS_ERROR   - If there is an error in the update progress
      *      UpdateOTAError::PARTITION_NOT_BOOTABLE  - If the selected partition is not bootable
+     *      UpdateOTAError::SIGNATURE_INVALID       - If the image signature is missing or does not match
+     *      UpdateOTAError::CONNECTION_FAILED       - If the connection failed
+     *      UpdateOTAError::SERVER_BUSY             - If the server is overloaded
+     *      UpdateOTAError::SERVER_ERROR            - If the server failed
      */
     UpdateOTAError startUpdate(const char *uRL, bool isFirmware) override;
 
+    /**
+     * @brief Start the OTA update process from the fastest of several mirrors of the same image
+     *
+     * Mirrors are probed with a one byte ranged read and ranked by latency, the ranking of the
+     * same list is cached for UpdateOTAMirrorPolicy::rankingTtlMs. When the throughput drops below
+     * UpdateOTAMirrorPolicy::minThroughput, or the stream stalls, the download continues from
+     * the next mirror with a Range request.
+     * @param uRLs The URLs of the mirrors
+     * @param count Number of mirrors, at most MAX_MIRRORS
+     * @param isFirmware Flag indicating whether the update is for firmware
+     * @return UpdateOTAError indicating the success or failure of the OTA update process, same options as
+     *      startUpdate(const char *, bool), and UpdateOTAError::BAD_REQUEST if the mirror count is invalid
+     */
+    UpdateOTAError startUpdate(const char *const *uRLs, uint8_t count, bool isFirmware) override;
+
     /**
      * @brief Get the version number from the specified URL and store it in the provided buffer
      * @param uRL The URL to get the version number from
      * @param buffer Buffer to store the version number
-     * @param bufferSize Size of the buffer
+     * @param bufferSize Size of the buffer, including the terminator
      * @return UpdateOTAError indicating the success or failure of the operation, Options:-
-     *      UpdateOTAError::SUCCESS         - If the version number was retrieved successfully
-     *      UpdateOTAError::NO_INTERNET     - If there is no internet connection
-     *      UpdateOTAError::PAGE_NOT_FOUND  - If the page is not found
-     *      UpdateOTAError::UNAUTHORIZED    - If there is an unauthorized access error
-     *      UpdateOTAError::BAD_REQUEST     - If there is a bad request error
-     *      UpdateOTAError::NO_ENOUGH_SPACE - If there is insufficient space for the update
-     *      UpdateOTAError::UNKNOWN         - If there is an unknown error
+     *      UpdateOTAError::SUCCESS             - If the version number was retrieved successfully
+     *      UpdateOTAError::NO_INTERNET         - If there is no internet connection
+     *      UpdateOTAError::PAGE_NOT_FOUND      - If the page is not found
+     *      UpdateOTAError::UNAUTHORIZED        - If there is an unauthorized access error
+     *      UpdateOTAError::BAD_REQUEST         - If there is a bad request error or no buffer
+     *      UpdateOTAError::NO_ENOUGH_SPACE     - If the version, chunked or not, does not fit the buffer
+     *      UpdateOTAError::CONNECTION_FAILED   - If the connection failed or the body was cut off
+     *      UpdateOTAError::UNKNOWN             - If there is an unknown error
      */
     UpdateOTAError getVersionNumber(const char *uRL, char *buffer, uint8_t bufferSize) override;
 
+    /**
+     * @brief Get and parse the version manifest from the specified URL
+     *
+     * The manifest is the version file, optionally followed by "rollout=", "window=" and "start="
+     * lines that spread the update of the fleet over a window, see UpdateOTARollout.
+     * @param uRL The URL of the manifest
+     * @param manifest Output manifest
+     * @return UpdateOTAError indicating the success or failure of the operation, same options as
+     *      getVersionNumber(), UpdateOTAError::NO_ENOUGH_SPACE if the manifest is larger than
+     *      MANIFEST_MAX_SIZE - 1 bytes, and UpdateOTAError::UNKNOWN if the manifest has no version
+     */
+    UpdateOTAError getUpdateManifest(const char *uRL, UpdateOTAManifest *manifest) override;
+
+    /**
+     * @brief Check if the rollout slot of this device has arrived
+     *
+     * The slot is derived from the MAC address and the rollout id. It counts from the manifest
+     * start when the system clock is set, otherwise from the first check of this rollout.
+     * @param manifest Manifest returned by getUpdateManifest()
+     * @return true if startUpdate() may be called now
+     */
+    bool isRolloutDue(const UpdateOTAManifest &manifest) override;
+
+    /**
+     * @brief Compare the version published at the specified URL with the running firmware
+     *
+     * Both versions are parsed as semantic versions, so "v5.1" equals "5.1.0" and "5.2.0-rc.1"
+     * is older than "5.2.0". The running version is esp_app_desc_t::version of this image.
+     * @param uRL The URL of the version file or manifest
+     * @param order Output order of the published version
+     * @return UpdateOTAError indicating the success or failure of the operation, same options as
+     *      getUpdateManifest(), and UpdateOTAError::UNKNOWN if a version is no semantic version
+     */
+    UpdateOTAError checkForUpdate(const char *uRL, UpdateOTAVersionOrder *order) override;
+
     /**
      * @brief Convert an update OTA error to a human-readable string and store it in the provided buffer
      * @param error The update OTA error
@@ -69,17 +227,553 @@ public:
      */
     void errorToString(UpdateOTAError error, char *buffer, uint8_t bufferSize) override;
 
+    /**
+     * @brief Get the detailed outcome of the last startUpdate() or getVersionNumber()
+     * @return The result, valid until the next operation
+     */
+    const UpdateOTAResult &getLastResult() override;
+
+    /**
+     * @brief Confirm or roll back a freshly updated image, call it early in setup()
+     *
+     * When the running image is pending verification, healthCheck is polled every
+     * HEALTH_CHECK_INTERVAL_MS until it succeeds, then the image is marked valid. If the deadline
+     * passes first, the image is marked invalid and the device reboots into the previous one.
+     * The Arduino core validates images on its own unless the sketch defines
+     * `bool verifyRollbackLater() { return true; }`.
+     * @param healthCheck Returns true once the new firmware works (connected, peripherals up, ...)
+     * @param deadlineMs Time allowed for the health check before rolling back
+     * @return UpdateOTAError indicating the success or failure of the operation, Options:-
+     *      UpdateOTAError::SUCCESS             - If the image was confirmed or did not need validation
+     *      UpdateOTAError::VALIDATION_FAILED   - If the health check failed and no image to roll back to exists
+     */
+    UpdateOTAError validateBootedImage(std::function<bool()> healthCheck, uint32_t deadlineMs) override;
+
+    /**
+     * @brief Get the time from boot until the image was confirmed by validateBootedImage()
+     * @return Time in milliseconds, zero if no validation took place
+     */
+    uint32_t getValidationTimeMs();
+
+    /**
+     * @brief Check whether a staged firmware waits for activation
+     * @return true if the boot partition differs from the running one
+     */
+    bool hasStagedUpdate() override;
+
+    /**
+     * @brief Reboot into the staged firmware now
+     * @return UpdateOTAError::NO_STAGED_UPDATE if nothing is staged, does not return otherwise
+     */
+    UpdateOTAError activateStagedUpdate() override;
+
+    /**
+     * @brief Schedule the activation of the staged firmware, see handleActivation()
+     *
+     * Use a maintenance window start or a fleet wide timestamp as notBeforeEpoch, the time
+     * condition waits for a valid clock (SNTP). Both conditions must hold.
+     * @param notBeforeEpoch Earliest activation time (Unix time), zero for no time condition
+     * @param isIdle Returns true when the device may reboot, nullptr to ignore
+     */
+    void scheduleActivation(uint32_t notBeforeEpoch, std::function<bool()> isIdle = nullptr) override;
+
+    /**
+     * @brief Activate the staged firmware once the scheduled conditions hold, call it from loop()
+     */
+    void handleActivation() override;
+
+    /**
+     * @brief Stage firmware updates instead of rebooting into them
+     *
+     * startUpdate() then downloads, verifies and sets the boot partition, and returns
+     * UpdateOTAError::SUCCESS. The new firmware runs after activateStagedUpdate(),
+     * handleActivation() or the next reboot.
+     * @param stageOnly true to stage, false to reboot right away (default)
+     */
+    void setStageOnly(bool stageOnly);
+
+    /**
+     * @brief Verify every block written by startUpdate() by reading it back from flash
+     *
+     * The CRC32 (ROM routine) of each received block is compared with the flash content through
+     * a memory mapping. The check of a block runs after the next block was read, while the
+     * network stack already receives the following data. Mismatched sectors are listed in
+     * getLastResult() and fail the update with UpdateOTAError::FLASH_ERROR.
+     * @param verifyWrites true to verify, false to trust the flash writes (default)
+     */
+    void setVerifyWrites(bool verifyWrites);
+
+    /**
+     * @brief Allow a firmware update to the version that is already running
+     *
+     * The first block of a firmware is checked before the rest of the slot is touched: image
+     * magic, chip, project name and version. A firmware with the running version is rejected
+     * with UpdateOTAError::INVALID_IMAGE unless reinstalling is allowed.
+     * @param allowReinstall true to accept the running version, false to reject it (default)
+     */
+    void setAllowReinstall(bool allowReinstall);
+
+    /**
+     * @brief Check for a newer firmware and download it with a single request
+     *
+     * A firmware startUpdate() sends the running version in "X-Firmware-Version" and the entity
+     * tag of the running image in "If-None-Match". The server answers 304, or the image with its
+     * version in "X-Firmware-Version": when that version is not newer, the connection is closed
+     * before the body and startUpdate() returns UpdateOTAError::NO_UPDATE_AVAILABLE. With a
+     * signing key the signature is fetched after the image over the same connection.
+     * @param conditional true for one request, false to download unconditionally (default)
+     */
+    void setConditionalDownload(bool conditional);
+
+    /**
+     * @brief Limit the bandwidth and CPU time taken by updates
+     *
+     * After each block the update sleeps until the token bucket holds enough tokens and for as
+     * long as the duty cycle requires, and at least every QOS_YIELD_INTERVAL_MS for one tick so
+     * lower priority tasks run and the task watchdog is fed. Safe to call from another task
+     * while an update is in progress, the next block uses the new policy.
+     * @param policy The QoS policy
+     */
+    void setQosPolicy(const UpdateOTAQosPolicy &policy);
+
+#if UPDATE_OTA_PIPELINE
+    /**
+     * @brief Run the network and the flash stage of startUpdate() on separate cores
+     *
+     * The calling task receives and decrypts blocks into a ring of PIPELINE_SLOTS buffers, a task
+     * pinned to the other core hashes, erases and writes them. The stages are connected by a
+     * lock-free single-producer/single-consumer queue. Costs PIPELINE_SLOTS * BLOCK_SIZE_P bytes
+     * of heap during the update, without them the update runs in one task. Slow mirrors are not
+     * replaced in this mode, stalled ones are. The load of each stage is reported in getLastResult().
+     * @param pipeline true for two stages, false for one task (default)
+     */
+    void setPipelineMode(bool pipeline);
+#endif
+
+#if UPDATE_OTA_BACKGROUND_STAGING
+    /**
+     * @brief Start pulling a firmware into the inactive OTA slot in the background
+     *
+     * Each handleBackgroundStaging() call takes only the data that already arrived and writes a
+     * block once it is complete, within the QoS policy, so loop() is not blocked by the
+     * network. It uses its own block buffer and slot state. Its state is kept in NVS: after a reboot or pauseBackgroundStaging() the download
+     * resumes at the last saved block with a Range request, If-Range with the ETag restarts it
+     * when the image changed on the server. Once complete, the image is verified (with a signing
+     * key, by reading it back from flash) and set as boot partition without rebooting, so
+     * hasStagedUpdate() turns true and activateStagedUpdate() switches without network.
+     * A foreground update of any app partition cancels the staging.
+     * @param uRL URL of the firmware, shorter than STAGING_URL_MAX
+     * @return UpdateOTAError indicating the success or failure of the operation, Options:-
+     *      UpdateOTAError::SUCCESS                 - If the staging was started
+     *      UpdateOTAError::BAD_REQUEST             - If the URL is too long
+     *      UpdateOTAError::NO_PARTITION_AVAILABLE  - If there is no OTA slot or it holds a staged firmware
+     *      UpdateOTAError::SIGNATURE_INVALID       - If a plain HTTP URL is given without signing key
+     */
+    UpdateOTAError startBackgroundStaging(const char *uRL);
+
+    /**
+     * @brief Pause the background staging at the current block, also across reboots
+     */
+    void pauseBackgroundStaging();
+
+    /**
+     * @brief Resume a paused background staging
+     */
+    void resumeBackgroundStaging();
+
+    /**
+     * @brief Stop the background staging and forget its state
+     */
+    void cancelBackgroundStaging();
+
+    /**
+     * @brief Advance the background staging with the data received so far, call it from loop()
+     *
+     * Only opening the session (connection and request) waits for the network. Transient failures are retried with the backoff of the retry policy, without limit.
+     * @return UpdateOTAError::SUCCESS while staging or idle, otherwise the error that ended the staging
+     */
+    UpdateOTAError handleBackgroundStaging();
+
+    /**
+     * @brief Get the progress of the background staging
+     * @param completed Output for the bytes staged
+     * @param total Output for the image length, zero before the first response
+     * @return true if a staging is active
+     */
+    bool getBackgroundStaging(uint32_t *completed, uint32_t *total);
+#endif
+
+    /**
+     * @brief Log the binary trace of the last update, see UpdateOTATrace
+     *
+     * Call it after booting into a new firmware to see how the update that installed it went:
+     * phases, per-block timings, errors, and the reboot gap between RESTART and BOOT.
+     */
+    void printTrace();
+
+    /**
+     * @brief Mark the end of the useful work before an update restarts the device
+     *
+     * Call it where the application stops serving, e.g. before startUpdate() or
+     * activateStagedUpdate(). Without it the shutdown phase of getDowntime() is zero.
+     */
+    void markServiceStopped();
+
+    /**
+     * @brief Mark that the application serves again, call it once per boot when initialized
+     */
+    void markServiceReady();
+
+    /**
+     * @brief Get the service downtime of the update that installed the running firmware
+     *
+     * Measured on a clock that keeps running across the reboot: shutdown (markServiceStopped()
+     * to restart), boot (reset, bootloader and image verification up to the app start) and
+     * init (app start to markServiceReady()). Needs UPDATE_OTA_TRACE.
+     * @param downtime Output downtime
+     * @return false if no update reboot followed by markServiceReady() is recorded
+     */
+    bool getDowntime(UpdateOTADowntime *downtime);
+
+    /**
+     * @brief Erase the next sector of the inactive OTA slot, call it from loop() while idle
+     *
+     * Each call erases one BLOCK_SIZE_P sector and keeps the blank watermark of the slot in NVS,
+     * a later startUpdate() skips the erase of every block below it. Nothing is erased while
+     * the running firmware is pending verification or a staged firmware waits in the slot,
+     * since the slot then holds the image to roll back to or to activate.
+     * @return true while sectors remain to be erased
+     */
+    bool preEraseStep();
+
+    /**
+     * @brief Set the retry policy of startUpdate()
+     *
+     * Transient failures are retried with exponential backoff and full jitter, a Retry-After
+     * sent with HTTP 429/503 is honoured. Interrupted downloads resume after the last block
+     * written to flash.
+     * @param policy The retry policy
+     */
+    void setRetryPolicy(const UpdateOTARetryPolicy &policy);
+
+#if UPDATE_OTA_MULTICAST
+    /**
+     * @brief Receive an image broadcast as fountain coded UDP multicast packets
+     *
+     * Blocks are decoded and written to the partition from selectPartition() as soon as enough
+     * symbols arrived, lost packets are covered by the repair symbols of the sender
+     * (tools/ota_multicast.py). Any host on the network can send to the group, so a signing key
+     * is required: the signature is carried in the stream and checked on the image in flash
+     * before activation.
+     * @param group Multicast group address
+     * @param port UDP port
+     * @param isFirmware Flag indicating whether the update is for firmware
+     * @param timeoutMs Abort when no block was completed for this long
+     * @return UpdateOTAError indicating the success or failure of the OTA update process, Options:-
+     *      UpdateOTAError::SUCCESS                 - If the OTA update process completed successfully
+     *      UpdateOTAError::NO_INTERNET             - If there is no network or the group cannot be joined
+     *      UpdateOTAError::NO_ENOUGH_SPACE         - If the image or the decoder does not fit
+     *      UpdateOTAError::NO_PARTITION_AVAILABLE  - If there is no available partition for update
+     *      UpdateOTAError::UPDATE_PROGRESS_ERROR   - If the transfer stalled
+     *      UpdateOTAError::PARTITION_NOT_BOOTABLE  - If the selected partition is not bootable
+     *      UpdateOTAError::SIGNATURE_INVALID       - If no signing key is set, or the signature is missing or does not match
+     *      UpdateOTAError::INVALID_IMAGE           - If the first block is no firmware for this device, see setAllowReinstall()
+     *      UpdateOTAError::FLASH_ERROR             - If erasing, writing or reading the partition failed
+     */
+    UpdateOTAError startMulticastUpdate(IPAddress group, uint16_t port, bool isFirmware, uint32_t timeoutMs = 60000);
+#endif
+
+    /**
+     * @brief Update several partitions in one session with a single boot switch
+     *
+     * The app target is streamed first, then the data targets in the given order. Consecutive
+     * targets on the same scheme, host and port share a kept-alive connection, a new origin opens a
+     * new session. Each image is verified as soon as it is written (with a signing key, against its
+     * "<URL>.sig"), the boot partition is switched only after all targets succeeded.
+     * Data partitions have no spare slot: they are erased and written in place while the current
+     * firmware runs, so they must not be mounted during the session. A session that fails after
+     * the app leaves the running firmware in place, but a data partition may already hold the new
+     * image, or a blank header if its signature did not match. Re-run the session until it
+     * succeeds before mounting the data partitions again.
+     * @param targets Partitions to update, at most one ESP_PARTITION_TYPE_APP target
+     * @param count Number of targets, at most MAX_TARGETS
+     * @return UpdateOTAError indicating the success or failure of the session, Options:-
+     *      UpdateOTAError::SUCCESS                 - If all targets were written (firmware restarts unless staged)
+     *      UpdateOTAError::BAD_REQUEST             - If the target list is invalid or has more than one app target
+     *      UpdateOTAError::NO_INTERNET             - If there is no internet connection
+     *      UpdateOTAError::NO_PARTITION_AVAILABLE  - If a target partition does not exist or is in use
+     *      UpdateOTAError::NO_ENOUGH_SPACE         - If an image is larger than its partition
+     *      UpdateOTAError::UPDATE_PROGRESS_ERROR   - If a transfer was cut short
+     *      UpdateOTAError::SIGNATURE_INVALID       - If an image signature is missing or does not match
+     *      UpdateOTAError::PARTITION_NOT_BOOTABLE  - If the app partition is not bootable
+     */
+    UpdateOTAError startUpdate(const UpdateOTATarget *targets, uint8_t count);
+
+#if UPDATE_OTA_BUNDLE
+    /**
+     * @brief Update several partitions from one bundle download
+     *
+     * The bundle index (see UpdateOTABundle.hpp, built by tools/ota_bundle.py) is parsed as it
+     * arrives and every payload is streamed straight into its partition, without temporary
+     * storage or further requests. The first block of the app payload is checked with the image
+     * header rules of startUpdate() before it is written. With a signing key "<URL>.sig" signs
+     * the whole bundle and can only be checked once everything is written. The boot partition is
+     * switched only if it matches.
+     * Data partitions have no spare slot and are overwritten in place. A bundle that fails after a
+     * data payload keeps the running firmware but leaves that partition new or partly written, and
+     * one that fails the signature check leaves it blank: its first sector is erased so the
+     * unverified data is not mounted. Re-run the update before mounting it again. tools/ota_bundle.py
+     * puts the app payload first, so an app rejected by its header leaves the data untouched.
+     * @param uRL URL of the bundle
+     * @return UpdateOTAError indicating the success or failure of the update, Options:-
+     *      UpdateOTAError::SUCCESS                 - If all payloads were written (firmware restarts unless staged)
+     *      UpdateOTAError::BAD_REQUEST             - If the bundle index is invalid or has more than one app entry
+     *      UpdateOTAError::NO_INTERNET             - If there is no internet connection
+     *      UpdateOTAError::NO_PARTITION_AVAILABLE  - If a payload partition does not exist or is in use
+     *      UpdateOTAError::NO_ENOUGH_SPACE         - If a payload is larger than its partition
+     *      UpdateOTAError::UPDATE_PROGRESS_ERROR   - If the transfer or a flash write failed
+     *      UpdateOTAError::SIGNATURE_INVALID       - If the bundle signature is missing or does not match
+     *      UpdateOTAError::PARTITION_NOT_BOOTABLE  - If the app partition is not bootable
+     *      UpdateOTAError::INVALID_IMAGE           - If the app payload is no firmware for this device, see setAllowReinstall()
+     */
+    UpdateOTAError startBundleUpdate(const char *uRL);
+#endif
+
+#if UPDATE_OTA_SPARSE
+    /**
+     * @brief Update from a sparse image that carries only the non-blank extents
+     *
+     * The extents (see UpdateOTASparse.hpp, built by tools/ota_sparse.py) are written as they
+     * arrive, the ranges between them are erased but neither downloaded nor written. With a
+     * signing key "<URL>.sig" is the signature of the expanded image, the same file that signs
+     * the plain image.
+     * @param uRL URL of the sparse image
+     * @param isFirmware Flag indicating whether the update is for firmware
+     * @return UpdateOTAError indicating the success or failure of the update, Options:-
+     *      UpdateOTAError::SUCCESS                 - If the update was completed (data partitions only, firmware restarts unless staged)
+     *      UpdateOTAError::BAD_REQUEST             - If the sparse image is malformed
+     *      UpdateOTAError::NO_INTERNET             - If there is no internet connection
+     *      UpdateOTAError::NO_PARTITION_AVAILABLE  - If there is no available partition for update
+     *      UpdateOTAError::NO_ENOUGH_SPACE         - If the expanded image is larger than the partition
+     *      UpdateOTAError::UPDATE_PROGRESS_ERROR   - If the transfer or a flash write failed
+     *      UpdateOTAError::SIGNATURE_INVALID       - If the image signature is missing or does not match
+     *      UpdateOTAError::PARTITION_NOT_BOOTABLE  - If the selected partition is not bootable
+     *      UpdateOTAError::INVALID_IMAGE           - If the image header is no firmware for this device, see setAllowReinstall()
+     */
+    UpdateOTAError startSparseUpdate(const char *uRL, bool isFirmware);
+#endif
+
+#if UPDATE_OTA_FILE_SYNC
+    /**
+     * @brief Bring a mounted SPIFFS/LittleFS filesystem in line with a file manifest
+     *
+     * Only files whose size or SHA-256 differ from the manifest (see UpdateOTAFileManifest) are
+     * downloaded from baseURL + path, each into a temporary file that replaces the old one once
+     * its hash matched. Files listed by the manifest of the last complete sync (kept as
+     * FILE_SYNC_MANIFEST) and missing from the new one are deleted; files the application created
+     * itself are never touched, and the first sync deletes nothing. The filesystem stays mounted.
+     * LittleFS renames over the old file in one step; SPIFFS cannot, so the old file is kept as
+     * "<path>.bak" until the new one is in place and the next sync restores it if power was lost
+     * in between. Either way the next sync finds every file old or new and continues.
+     * With a signing key the manifest must carry a valid "<manifestURL>.sig".
+     * @param fs Mounted filesystem (SPIFFS, LittleFS)
+     * @param manifestURL URL of the manifest
+     * @param baseURL URL the manifest paths are relative to
+     * @return UpdateOTAError indicating the success or failure of the sync, Options:-
+     *      UpdateOTAError::SUCCESS                 - If the filesystem matches the manifest
+     *      UpdateOTAError::BAD_REQUEST             - If the manifest or base URL is missing
+     *      UpdateOTAError::NO_INTERNET             - If there is no internet connection
+     *      UpdateOTAError::NO_ENOUGH_SPACE         - If a file cannot be written or replaced
+     *      UpdateOTAError::UPDATE_PROGRESS_ERROR   - If a download was cut short or its hash does not match
+     *      UpdateOTAError::SIGNATURE_INVALID       - If the manifest signature is missing or does not match
+     *      Errors of the HTTP request (PAGE_NOT_FOUND, CONNECTION_FAILED, ...)
+     */
+    UpdateOTAError syncFileSystem(fs::FS &fs, const char *manifestURL, const char *baseURL);
+#endif
+
+    /**
+     * @brief Set the TLS profile used for the next sessions
+     * @param profile The TLS profile, the certificate string must outlive this instance
+     */
+    void setTlsProfile(const UpdateOTATlsProfile &profile);
+
+    /**
+     * @brief Set the public key used to verify detached image signatures
+     *
+     * When a key is set, startUpdate() fetches "<URL>.sig" (SHA-256 signed with RSA or ECDSA),
+     * hashes the image while it is streamed and refuses to activate it on mismatch.
+     * ".sig" is appended to the path, before any query or fragment: "fw.bin?X-Amz-..." is signed by
+     * "fw.bin.sig?X-Amz-...", so a presigned URL must carry the parameters valid for the signature too.
+     * Plain "http://" sources are only accepted when a key is set.
+     * @param publicKeyPem PEM encoded public key, nullptr to disable verification
+     * @return true if the key was parsed successfully
+     */
+    bool setSigningKey(const char *publicKeyPem);
+
+    /**
+     * @brief Set the mirror selection policy
+     * @param policy The mirror policy
+     */
+    void setMirrorPolicy(const UpdateOTAMirrorPolicy &policy);
+
+    static const char CA_DIGICERT_GLOBAL_ROOT_G2[]; ///< RSA root certificate (default)
+    static const char CA_USERTRUST_ECC[];           ///< ECC root certificate for ECDSA server chains
+
 private:
+    /**
+     * @brief Verify, record (with its pending ETag) and activate an image that was fully written to _newPartition
+     * @param imageLength Length of the image in bytes
+     * @param verifySignature Flag indicating whether the signature hash was fed with the image
+     * @return UpdateOTAError indicating the success or failure of the operation, Options:-
+     *      UpdateOTAError::SUCCESS                 - If the update was completed (data partitions only, firmware restarts)
+     *      UpdateOTAError::SIGNATURE_INVALID       - If the image signature does not match
+     *      UpdateOTAError::PARTITION_NOT_BOOTABLE  - If the selected partition is not bootable
+     */
+    UpdateOTAError finishUpdate(uint32_t imageLength, bool verifySignature);
+
+    /**
+     * @brief Verify and record an image that was fully written to _newPartition
+     * @param imageLength Length of the image in bytes
+     * @param verifySignature Flag indicating whether the signature hash was fed with the image
+     * @return UpdateOTAError::SUCCESS, or UpdateOTAError::SIGNATURE_INVALID if the signature does not match
+     */
+    UpdateOTAError verifyImage(uint32_t imageLength, bool verifySignature);
+
+    /**
+     * @brief Switch the boot partition to _newPartition and reboot unless staging
+     * @return UpdateOTAError::SUCCESS when staged, or UpdateOTAError::PARTITION_NOT_BOOTABLE
+     */
+    UpdateOTAError activateImage();
+
+    /**
+     * @brief Find the partition of an update target
+     * @param target Target to resolve
+     * @return The partition, nullptr if none matches or it is the running one
+     */
+    const esp_partition_t *findTargetPartition(const UpdateOTATarget &target);
+
+#if UPDATE_OTA_MULTICAST
+    /**
+     * @brief Receive multicast symbols until the whole image was decoded into _newPartition
+     * @param udp Socket joined to the multicast group
+     * @param decoder Fountain decoder
+     * @param timeoutMs Abort when no block was completed for this long
+     * @param imageLength Output for the length of the image
+     * @return UpdateOTAError indicating the success or failure of the operation, Options:-
+     *      UpdateOTAError::SUCCESS                 - If the image was received completely
+     *      UpdateOTAError::NO_ENOUGH_SPACE         - If the image does not fit
+     *      UpdateOTAError::UPDATE_PROGRESS_ERROR   - If the transfer stalled
+     *      UpdateOTAError::FLASH_ERROR             - If a block could not be erased or written
+     */
+    UpdateOTAError receiveMulticastImage(WiFiUDP &udp, UpdateOTAFountainDecoder &decoder, uint32_t timeoutMs, uint32_t *imageLength);
+#endif
+
+    /**
+     * @brief Create the network clients for a new session, releasing the previous ones
+     */
+    void beginSession();
+
+    /**
+     * @brief Close the connection and release the network clients and their TLS buffers
+     */
+    void endSession();
+
+    /**
+     * @brief Check whether two URLs share scheme, host and port, so a session can serve both
+     * @param uRL The first URL
+     * @param otherURL The second URL
+     * @return true if the URLs have the same origin
+     */
+    static bool isSameOrigin(const char *uRL, const char *otherURL);
+
+    /**
+     * @brief Download the detached signature of the image at _uRL, _uRL is left unchanged
+     * @return UpdateOTAError indicating the success or failure of the operation, Options:-
+     *      UpdateOTAError::SUCCESS             - If the signature was retrieved successfully
+     *      UpdateOTAError::SIGNATURE_INVALID   - If the signature is missing or too large
+     *      Any error returned by processGetRequest()
+     */
+    UpdateOTAError fetchSignature();
+
+    /**
+     * @brief Download a small text body, chunked or not, into a buffer
+     * @param uRL The URL of the text
+     * @param buffer Output buffer, always terminated
+     * @param bufferSize Size of the buffer, including the terminator
+     * @return UpdateOTAError indicating the success or failure of the operation, Options:-
+     *      UpdateOTAError::SUCCESS             - If the whole body was read
+     *      UpdateOTAError::NO_ENOUGH_SPACE     - If the body does not fit the buffer
+     *      UpdateOTAError::CONNECTION_FAILED   - If the body was cut off
+     *      Any error returned by processGetRequest()
+     */
+    UpdateOTAError fetchText(const char *uRL, char *buffer, size_t bufferSize);
+
     /**
      * @brief Process a GET request for the update version
+     * @param range Optional value of the Range header, e.g. "bytes=0-0"
+     * @param ifRange Optional value of the If-Range header, the ETag the range refers to
+     * @param conditional true to send the running version and image tag, see setConditionalDownload()
      * @return UpdateOTAError indicating the success or failure of the request, Options:-
      *      UpdateOTAError::SUCCESS         - If the request was successful
      *      UpdateOTAError::PAGE_NOT_FOUND  - If the page is not found
      *      UpdateOTAError::UNAUTHORIZED    - If there is an unauthorized access error
      *      UpdateOTAError::BAD_REQUEST     - If there is a bad request error
+     *      UpdateOTAError::CONNECTION_FAILED - If the connection failed
+     *      UpdateOTAError::SERVER_BUSY     - If the server is overloaded
+     *      UpdateOTAError::SERVER_ERROR    - If the server failed
      *      UpdateOTAError::UNKNOWN         - If there is an unknown error
      */
-    UpdateOTAError processGetRequest();
+    UpdateOTAError processGetRequest(const char *range = nullptr, const char *ifRange = nullptr, bool conditional = false);
+
+    /**
+     * @brief Compare the version announced in the response headers with the running firmware
+     * @return UpdateOTAError::NO_UPDATE_AVAILABLE if the announced version is not newer, otherwise SUCCESS
+     */
+    UpdateOTAError checkAnnouncedVersion();
+
+    /**
+     * @brief Download the image from the mirrors into the partition, resuming at _bytesCompleted
+     * @param uRLs The URLs of the mirrors
+     * @param count Number of mirrors
+     * @param verifySignature Flag indicating whether the signature must be fetched and hashed
+     * @return UpdateOTAError indicating the success or failure of the download, Options:-
+     *      UpdateOTAError::SUCCESS                 - If the image was written completely
+     *      UpdateOTAError::NO_ENOUGH_SPACE         - If there is insufficient space for the update
+     *      UpdateOTAError::NO_PARTITION_AVAILABLE  - If there is no available partition for update
+     *      UpdateOTAError::UPDATE_PROGRESS_ERROR   - If the transfer was interrupted
+     *      Any error returned by processGetRequest() or fetchSignature()
+     */
+    UpdateOTAError downloadImage(const char *const *uRLs, uint8_t count, bool verifySignature);
+
+    /**
+     * @brief Store an error in the last result and classify it
+     * @param error The error
+     * @return The same error
+     */
+    UpdateOTAError recordResult(UpdateOTAError error);
+
+    /**
+     * @brief Compute the delay before the next attempt
+     * @param attempt Number of the attempt that failed, starting at 1
+     * @return Delay in milliseconds
+     */
+    uint32_t retryDelayMs(uint8_t attempt);
+
+    /**
+     * @brief Probe the mirrors and rank them by latency, unless a fresh ranking of the same list exists
+     * @param uRLs The URLs of the mirrors
+     * @param count Number of mirrors
+     */
+    void rankMirrors(const char *const *uRLs, uint8_t count);
+
+    /**
+     * @brief Continue the current image from the next ranked mirror
+     * @param offset Offset to resume at, block aligned
+     * @return UpdateOTAError indicating the success or failure of the operation, Options:-
+     *      UpdateOTAError::SUCCESS                 - If a mirror resumed the stream at offset
+     *      UpdateOTAError::UPDATE_PROGRESS_ERROR   - If no mirror is left
+     */
+    UpdateOTAError switchMirror(size_t offset);
 
     /**
      * @brief Update the firmware
@@ -98,23 +792,54 @@ private:
      * @brief Reset the specified range of the partition
      * @param offset Offset of the partition
      * @param length Length of the partition
+     * @return ESP_OK on success
      */
-    void resetPartitionRange(size_t offset, size_t length);
+    esp_err_t resetPartitionRange(size_t offset, size_t length);
 
     /**
      * @brief Write the block buffer to the partition
      * @param offset Offset to write to
      * @param length Length of the block buffer
+     * @return ESP_OK on success
      */
-    void writeBlockBufferToPartition(size_t offset, size_t length);
+    esp_err_t writeBlockBufferToPartition(size_t offset, size_t length);
+
+    /**
+     * @brief Compare a written block with the CRC32 of the data received for it
+     * @param offset Offset of the block
+     * @param length Length of the block
+     * @param crc CRC32 of the received data
+     * @return false if the flash content differs, the sector is recorded in _lastResult
+     */
+    bool verifyBlock(size_t offset, size_t length, uint32_t crc);
 
     /**
      * @brief Read a block from the client to the buffer
      * @param offset Offset to read from
      * @param length Length of the block to read
+     * @param buffer Buffer to read into
      * @return Size of the block read
      */
-    size_t readBlockFromClientToBuffer(size_t offset, size_t length);
+    size_t readBlockFromClientToBuffer(size_t offset, size_t length, char *buffer);
+
+#if UPDATE_OTA_PIPELINE
+    /**
+     * @brief Network stage of updateFirmware() in pipeline mode, the flash stage runs in flashStage()
+     * @return UpdateOTAError indicating the success or failure of the transfer
+     */
+    UpdateOTAError updateFirmwarePipelined();
+
+    /**
+     * @brief Flash stage of the pipeline: hash, erase, write and verify the queued blocks
+     */
+    void flashStage();
+
+    /**
+     * @brief FreeRTOS entry of the flash stage task
+     * @param updateOTA The UpdateOTA instance
+     */
+    static void flashStageTask(void *updateOTA);
+#endif
 
     /**
      * @brief Change the boot partition to the new partition
@@ -132,6 +857,122 @@ private:
      */
     UpdateOTAError selectPartition();
 
+#if UPDATE_OTA_BUNDLE || UPDATE_OTA_SPARSE
+    /**
+     * @brief Read exactly length bytes of the response and feed them to the signature verifier
+     * @param data Output buffer
+     * @param length Number of bytes to read
+     * @param verifySignature Flag indicating whether the bytes are hashed
+     * @return false if the stream ended early
+     */
+    bool readStream(void *data, size_t length, bool verifySignature);
+#endif
+
+    /**
+     * @brief Sleep as required by the QoS policy after a block was processed
+     * @param bytes Bytes received for the block
+     * @param blockStart millis() when the work on the block started
+     */
+    void throttle(size_t bytes, uint32_t blockStart);
+
+    /**
+     * @brief Pay a block into the QoS token bucket and compute the pause it requires
+     * @param bytes Bytes received for the block
+     * @param blockStart millis() when the work on the block started
+     * @return Pause in milliseconds required by the rate limit and the duty cycle
+     */
+    uint32_t qosPauseMs(size_t bytes, uint32_t blockStart);
+
+    /**
+     * @brief Check the image header and app descriptor in the first block of a firmware
+     * @param block First block of the image
+     * @param length Length of the block
+     * @return UpdateOTAError::SUCCESS if the firmware fits this device, otherwise UpdateOTAError::INVALID_IMAGE
+     */
+    UpdateOTAError checkImageHeader(const uint8_t *block, size_t length);
+
+    /**
+     * @brief Feed an image written to _newPartition to the signature verifier
+     * @param imageLength Length of the image
+     * @return UpdateOTAError::SUCCESS if the image was read, UpdateOTAError::FLASH_ERROR if a read failed
+     */
+    UpdateOTAError hashPartition(uint32_t imageLength);
+
+#if UPDATE_OTA_BACKGROUND_STAGING
+    /**
+     * @brief Load the staging state from NVS once
+     */
+    void loadStagingState();
+
+    /**
+     * @brief Open the staging download at the saved offset
+     * @return UpdateOTAError indicating the success or failure of the request
+     */
+    UpdateOTAError openStagingSession();
+
+    /**
+     * @brief Verify the staged image and set it as boot partition
+     * @return UpdateOTAError indicating the success or failure of the verification
+     */
+    UpdateOTAError finishStaging();
+#endif
+
+#if UPDATE_OTA_SPARSE
+    /**
+     * @brief Feed a blank (0xFF) range to the signature verifier
+     * @param length Length of the range
+     */
+    void hashBlankRange(size_t length);
+#endif
+
+#if UPDATE_OTA_FILE_SYNC
+    /**
+     * @brief Download _uRL into a file
+     * @param file File open for writing
+     * @param digest Output for the SHA-256 of the content, 32 bytes
+     * @param verifySignature Flag indicating whether the content is fed to the signature verifier
+     * @return UpdateOTAError indicating the success or failure of the download
+     */
+    UpdateOTAError downloadFile(fs::File &file, uint8_t *digest, bool verifySignature);
+
+    /**
+     * @brief Compute the SHA-256 of a file
+     * @param file File open for reading
+     * @param digest Output for the hash, 32 bytes
+     */
+    void hashFile(fs::File &file, uint8_t *digest);
+
+    /**
+     * @brief Replace a file by its downloaded copy, keeping a backup where the rename cannot overwrite
+     * @param fs Filesystem holding both files
+     * @param temporaryPath Path of the downloaded copy
+     * @param path Path of the file to replace
+     * @return true if the file was replaced, false if the old file is unchanged
+     */
+    bool replaceFile(fs::FS &fs, const String &temporaryPath, const char *path);
+
+    /**
+     * @brief Finish the swaps a power loss interrupted, see replaceFile()
+     * @param fs Filesystem to recover
+     * @param directory Directory to start from
+     */
+    void restoreBackups(fs::FS &fs, const char *directory);
+
+    /**
+     * @brief Delete the files the last sync installed (FILE_SYNC_MANIFEST) that the new manifest no longer lists
+     * @param fs Filesystem to clean up
+     * @param manifestPath Path of the new manifest
+     * @param listed Number of entries in the new manifest
+     * @return Number of deleted files
+     */
+    uint16_t removeStaleFiles(fs::FS &fs, const String &manifestPath, uint16_t listed);
+#endif
+
+    /**
+     * @brief Close the session and reboot into the boot partition
+     */
+    void restart();
+
     /**
      * @brief Print the update progress
      * @param written Number of bytes written
@@ -139,6 +980,12 @@ private:
      */
     void printProgress(size_t written, size_t total);
 
+    /**
+     * @brief Switch the relay module on or off while an update runs
+     * @param on true at the start of a transfer, false at its end
+     */
+    void setIndicator(bool on);
+
     /**
      * @brief Toggle the LED if pinStatus is not zero
      */
@@ -146,76 +993,67 @@ private:
 
     RelayModuleInterface *_relayModule = nullptr;   ///< RelayModuleInterface instance for controlling an LED during the update
     MultiPrinterLoggerInterface *_logger = nullptr; ///< Logger for logging messages
-    WiFiClientSecure *_wifiClientSecure = nullptr;  ///< WiFiClientSecure instance for secure communication
+    WiFiClient *_wifiClient = nullptr;              ///< WiFiClient (or WiFiClientSecure for HTTPS) instance for communication
+    bool _isSecure = true;                          ///< Flag indicating whether the current session uses TLS
     HTTPClient *_httpClient = nullptr;              ///< HTTPClient instance for handling HTTP requests
-    uint16_t _httpCode = 0;                         ///< HTTP response code
+    int16_t _httpCode = 0;                          ///< HTTP response code, negative for HTTPClient errors
     const char *_uRL;                               ///< URL for the update
     char _buffer[BLOCK_SIZE_P];                     ///< Buffer for reading/writing data blocks
     const esp_partition_t *_newPartition;           ///< Pointer to the new partition for firmware update
     bool _isFirmware = false;                       ///< Flag indicating whether the update is for firmware
-    char ca_cert[1600] =                            ///< Certificate data for secure communication
-"-----BEGIN CERTIFICATE-----\n"
-"MIIDjjCCAnagAwIBAgIQAzrx5qcRqaC7KGSxHQn65TANBgkqhkiG9w0BAQsFADBh\n"
-"MQswCQYDVQQGEwJVUzEVMBMGA1UEChMMRGlnaUNlcnQgSW5jMRkwFwYDVQQLExB3\n"
-"d3cuZGlnaWNlcnQuY29tMSAwHgYDVQQDExdEaWdpQ2VydCBHbG9iYWwgUm9vdCBH\n"
-"MjAeFw0xMzA4MDExMjAwMDBaFw0zODAxMTUxMjAwMDBaMGExCzAJBgNVBAYTAlVT\n"
-"MRUwEwYDVQQKEwxEaWdpQ2VydCBJbmMxGTAXBgNVBAsTEHd3dy5kaWdpY2VydC5j\n"
-"b20xIDAeBgNVBAMTF0RpZ2lDZXJ0IEdsb2JhbCBSb290IEcyMIIBIjANBgkqhkiG\n"
-"9w0BAQEFAAOCAQ8AMIIBCgKCAQEAuzfNNNx7a8myaJCtSnX/RrohCgiN9RlUyfuI\n"
-"2/Ou8jqJkTx65qsGGmvPrC3oXgkkRLpimn7Wo6h+4FR1IAWsULecYxpsMNzaHxmx\n"
-"1x7e/dfgy5SDN67sH0NO3Xss0r0upS/kqbitOtSZpLYl6ZtrAGCSYP9PIUkY92eQ\n"
-"q2EGnI/yuum06ZIya7XzV+hdG82MHauVBJVJ8zUtluNJbd134/tJS7SsVQepj5Wz\n"
-"tCO7TG1F8PapspUwtP1MVYwnSlcUfIKdzXOS0xZKBgyMUNGPHgm+F6HmIcr9g+UQ\n"
-"vIOlCsRnKPZzFBQ9RnbDhxSJITRNrw9FDKZJobq7nMWxM4MphQIDAQABo0IwQDAP\n"
-"BgNVHRMBAf8EBTADAQH/MA4GA1UdDwEB/wQEAwIBhjAdBgNVHQ4EFgQUTiJUIBiV\n"
-"5uNu5g/6+rkS7QYXjzkwDQYJKoZIhvcNAQELBQADggEBAGBnKJRvDkhj6zHd6mcY\n"
-"1Yl9PMWLSn/pvtsrF9+wX3N3KjITOYFnQoQj8kVnNeyIv/iPsGEMNKSuIEyExtv4\n"
-"NeF22d+mQrvHRAiGfzZ0JFrabA0UWTW98kndth/Jsw1HKj2ZL7tcu7XUIOGZX1NG\n"
-"Fdtom/DzMNU+MeKNhJ7jitralj41E6Vf8PlwUHBHQRFXGU7Aj64GxJUTFy8bJZ91\n"
-"8rGOmaFvE7FBcf6IKshPECBV1/MUReXgRPTqh5Uykw7+U0b6LJ3/iyK5S9kJRaTe\n"
-"pLiaWN0bfVKfjllDiIGknibVb63dDcY3fe0Dkhvld1927jyNxF1WW6LZZm6zNTfl\n"
-"MrY=\n"
-"-----END CERTIFICATE-----\n";
-
-//     "-----BEGIN CERTIFICATE-----\n"
-// "MIICjzCCAhWgAwIBAgIQXIuZxVqUxdJxVt7NiYDMJjAKBggqhkjOPQQDAzCBiDEL\n"
-// "MAkGA1UEBhMCVVMxEzARBgNVBAgTCk5ldyBKZXJzZXkxFDASBgNVBAcTC0plcnNl\n"
-// "eSBDaXR5MR4wHAYDVQQKExVUaGUgVVNFUlRSVVNUIE5ldHdvcmsxLjAsBgNVBAMT\n"
-// "JVVTRVJUcnVzdCBFQ0MgQ2VydGlmaWNhdGlvbiBBdXRob3JpdHkwHhcNMTAwMjAx\n"
-// "MDAwMDAwWhcNMzgwMTE4MjM1OTU5WjCBiDELMAkGA1UEBhMCVVMxEzARBgNVBAgT\n"
-// "Ck5ldyBKZXJzZXkxFDASBgNVBAcTC0plcnNleSBDaXR5MR4wHAYDVQQKExVUaGUg\n"
-// "VVNFUlRSVVNUIE5ldHdvcmsxLjAsBgNVBAMTJVVTRVJUcnVzdCBFQ0MgQ2VydGlm\n"
-// "aWNhdGlvbiBBdXRob3JpdHkwdjAQBgcqhkjOPQIBBgUrgQQAIgNiAAQarFRaqflo\n"
-// "I+d61SRvU8Za2EurxtW20eZzca7dnNYMYf3boIkDuAUU7FfO7l0/4iGzzvfUinng\n"
-// "o4N+LZfQYcTxmdwlkWOrfzCjtHDix6EznPO/LlxTsV+zfTJ/ijTjeXmjQjBAMB0G\n"
-// "A1UdDgQWBBQ64QmG1M8ZwpZ2dEl23OA1xmNjmjAOBgNVHQ8BAf8EBAMCAQYwDwYD\n"
-// "VR0TAQH/BAUwAwEB/zAKBggqhkjOPQQDAwNoADBlAjA2Z6EWCNzklwBBHU6+4WMB\n"
-// "zzuqQhFkoJ2UOQIReVx7Hfpkue4WQrO/isIJxOzksU0CMQDpKmFHjFJKS04YcPbW\n"
-// "RNZu9YO6bVi9JNlWSOrvxKJGgYhqOkbRqZtNyWHa0V1Xahg=\n"
-// "-----END CERTIFICATE-----\n";
-
-        // "-----BEGIN CERTIFICATE-----\n"
-        // "MIIDjjCCAnagAwIBAgIQAzrx5qcRqaC7KGSxHQn65TANBgkqhkiG9w0BAQsFADBh\n"
-        // "MQswCQYDVQQGEwJVUzEVMBMGA1UEChMMRGlnaUNlcnQgSW5jMRkwFwYDVQQLExB3\n"
-        // "d3cuZGlnaWNlcnQuY29tMSAwHgYDVQQDExdEaWdpQ2VydCBHbG9iYWwgUm9vdCBH\n"
-        // "MjAeFw0xMzA4MDExMjAwMDBaFw0zODAxMTUxMjAwMDBaMGExCzAJBgNVBAYTAlVT\n"
-        // "MRUwEwYDVQQKEwxEaWdpQ2VydCBJbmMxGTAXBgNVBAsTEHd3dy5kaWdpY2VydC5j\n"
-        // "b20xIDAeBgNVBAMTF0RpZ2lDZXJ0IEdsb2JhbCBSb290IEcyMIIBIjANBgkqhkiG\n"
-        // "9w0BAQEFAAOCAQ8AMIIBCgKCAQEAuzfNNNx7a8myaJCtSnX/RrohCgiN9RlUyfuI\n"
-        // "2/Ou8jqJkTx65qsGGmvPrC3oXgkkRLpimn7Wo6h+4FR1IAWsULecYxpsMNzaHxmx\n"
-        // "1x7e/dfgy5SDN67sH0NO3Xss0r0upS/kqbitOtSZpLYl6ZtrAGCSYP9PIUkY92eQ\n"
-        // "q2EGnI/yuum06ZIya7XzV+hdG82MHauVBJVJ8zUtluNJbd134/tJS7SsVQepj5Wz\n"
-        // "tCO7TG1F8PapspUwtP1MVYwnSlcUfIKdzXOS0xZKBgyMUNGPHgm+F6HmIcr9g+UQ\n"
-        // "vIOlCsRnKPZzFBQ9RnbDhxSJITRNrw9FDKZJobq7nMWxM4MphQIDAQABo0IwQDAP\n"
-        // "BgNVHRMBAf8EBTADAQH/MA4GA1UdDwEB/wQEAwIBhjAdBgNVHQ4EFgQUTiJUIBiV\n"
-        // "5uNu5g/6+rkS7QYXjzkwDQYJKoZIhvcNAQELBQADggEBAGBnKJRvDkhj6zHd6mcY\n"
-        // "1Yl9PMWLSn/pvtsrF9+wX3N3KjITOYFnQoQj8kVnNeyIv/iPsGEMNKSuIEyExtv4\n"
-        // "NeF22d+mQrvHRAiGfzZ0JFrabA0UWTW98kndth/Jsw1HKj2ZL7tcu7XUIOGZX1NG\n"
-        // "Fdtom/DzMNU+MeKNhJ7jitralj41E6Vf8PlwUHBHQRFXGU7Aj64GxJUTFy8bJZ91\n"
-        // "8rGOmaFvE7FBcf6IKshPECBV1/MUReXgRPTqh5Uykw7+U0b6LJ3/iyK5S9kJRaTe\n"
-        // "pLiaWN0bfVKfjllDiIGknibVb63dDcY3fe0Dkhvld1927jyNxF1WW6LZZm6zNTfl\n"
-        // "MrY=\n"
-        // "-----END CERTIFICATE-----\n";
+    UpdateOTATlsProfile _tlsProfile;                ///< TLS settings applied to every session
+    UpdateOTASignature _signature;                  ///< Verifier for detached image signatures
+    uint32_t _streamLength = 0;                     ///< Total length of the image being downloaded
+    std::atomic<uint32_t> _bytesCompleted{0};       ///< Bytes of the image written to flash so far, advanced by the flash stage
+    UpdateOTAResult _lastResult = {};               ///< Detailed outcome of the last operation
+    UpdateOTARetryPolicy _retryPolicy;              ///< Retry settings
+    UpdateOTAMirrorPolicy _mirrorPolicy;            ///< Mirror selection settings
+    const char *const *_mirrors = nullptr;          ///< Mirrors of the running update, null outside startUpdate()
+    uint32_t _mirrorListHash = 0;                   ///< Hash of the URLs of the last ranked mirror list
+    uint8_t _mirrorCount = 0;                       ///< Number of mirrors
+    uint8_t _mirrorRanking[MAX_MIRRORS];            ///< Mirror indexes, fastest first
+    uint8_t _mirrorPosition = 0;                    ///< Position of the current mirror in the ranking
+    uint32_t _rankingTime = 0;                      ///< millis() of the last ranking, zero if none
+    uint32_t _validationTimeMs = 0;                 ///< Time from boot to the confirmation of the image
+    bool _stageOnly = false;                        ///< Flag indicating whether firmware is staged instead of activated
+    bool _verifyWrites = false;                     ///< Flag indicating whether written blocks are read back
+    bool _allowReinstall = false;                   ///< Flag indicating whether the running version may be installed again
+    bool _conditionalDownload = false;              ///< Flag indicating whether firmware downloads are conditional requests
+    char _pendingETag[ETAG_MAX] = {0};              ///< ETag of the downloaded image, saved once the image is verified
+    uint32_t _blankEnd = 0;                         ///< End of the pre-erased range of _newPartition
+#if UPDATE_OTA_BACKGROUND_STAGING
+    UpdateOTAStagingState _staging;                 ///< Background staging state, mirrored in NVS
+    bool _stagingLoaded = false;                    ///< Flag indicating whether _staging was loaded from NVS
+    bool _stagingSession = false;                   ///< Flag indicating whether the open session belongs to the staging
+    uint32_t _stagingBlankEnd = 0;                  ///< End of the pre-erased range of the staging slot
+    uint8_t _stagingUnsaved = 0;                    ///< Blocks staged since the state was saved
+    uint8_t _stagingAttempts = 0;                   ///< Consecutive failed staging requests
+    uint32_t _stagingRetryAt = 0;                   ///< millis() of the next staging step after a failure or QoS pause, zero if none
+    const esp_partition_t *_stagingPartition = nullptr; ///< Slot being staged, apart from _newPartition of foreground updates
+    char *_stagingBuffer = nullptr;                 ///< Block being received by the staging, allocated while a staging runs
+    size_t _stagingFill = 0;                        ///< Bytes of the current block received so far
+    uint32_t _stagingBlockStart = 0;                ///< millis() of the first byte of the current block
+    uint32_t _stagingLastData = 0;                  ///< millis() of the last received data, for the stream timeout
+#endif
+#if UPDATE_OTA_PIPELINE
+    bool _pipeline = false;                         ///< Flag indicating whether updates run in two stages
+    UpdateOTABlockRing _ring;                       ///< Blocks passed from the network to the flash stage
+    TaskHandle_t _networkTask = nullptr;            ///< Task running the network stage
+    TaskHandle_t _flashTask = nullptr;              ///< Task running the flash stage
+    std::atomic<bool> _flashFailed{false};          ///< Set by the flash stage when an erase or write failed
+    std::atomic<bool> _flashDone{false};            ///< Set by the flash stage when it finished
+    int64_t _flashBusyUs = 0;                       ///< Time the flash stage worked, valid once done
+#endif
+    UpdateOTAQosPolicy _qosPolicy;                  ///< Bandwidth and CPU limits, guarded by _qosLock
+    portMUX_TYPE _qosLock = portMUX_INITIALIZER_UNLOCKED; ///< Lock for policy changes from other tasks
+    int64_t _qosTokens = 0;                         ///< Token bucket content in bytes, negative while in debt
+    int64_t _qosRefillTime = 0;                     ///< esp_timer_get_time() of the last refill
+    uint32_t _qosLastSleep = 0;                     ///< millis() of the last sleep
+    bool _activationScheduled = false;              ///< Flag indicating whether handleActivation() may reboot
+    uint32_t _activationEpoch = 0;                  ///< Earliest activation time (Unix time), zero if none
+    std::function<bool()> _activationIdle;          ///< Idle condition for the activation, empty if none
+    char _rolloutId[32] = {0};                      ///< Rollout seen by the last isRolloutDue()
+    uint32_t _rolloutFirstSeen = 0;                 ///< millis() when that rollout was first seen
 };
 
 #endif // UPDATE
@@ -0,0 +1,74 @@
+#ifndef UPDATE_OTA_BLOCK_RING_HPP
+#define UPDATE_OTA_BLOCK_RING_HPP
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+#include <atomic>   // std::atomic
+
+#define BLOCK_RING_MAX_SLOTS (4) // Maximum number of blocks buffered between the pipeline stages.
+
+/**
+ * @brief Lock-free single-producer/single-consumer ring of block buffers
+ *
+ * The producer fills producerSlot() and publishes it with push(), the consumer processes
+ * consumerSlot() and releases it with pop(). Each side only writes its own index, the
+ * acquire/release pair on the indexes orders the block data between the cores.
+ */
+class UpdateOTABlockRing
+{
+public:
+    /**
+     * @brief Destructor
+     */
+    ~UpdateOTABlockRing();
+
+    /**
+     * @brief Allocate the block buffers and empty the ring
+     * @param slots Number of blocks, at most BLOCK_RING_MAX_SLOTS
+     * @param slotSize Size of a block in bytes
+     * @return false if the buffers cannot be allocated
+     */
+    bool begin(uint8_t slots, size_t slotSize);
+
+    /**
+     * @brief Release the block buffers
+     */
+    void end();
+
+    /**
+     * @brief Get the buffer the producer fills next
+     * @return The buffer, nullptr while the ring is full
+     */
+    uint8_t *producerSlot();
+
+    /**
+     * @brief Publish the filled buffer to the consumer
+     * @param offset Offset of the block in the image
+     * @param length Length of the block, zero to mark the end of the stream
+     */
+    void push(size_t offset, size_t length);
+
+    /**
+     * @brief Get the next block for the consumer
+     * @param offset Output for the offset of the block
+     * @param length Output for the length of the block
+     * @return The buffer, nullptr while the ring is empty
+     */
+    uint8_t *consumerSlot(size_t *offset, size_t *length);
+
+    /**
+     * @brief Release the consumed block to the producer
+     */
+    void pop();
+
+private:
+    uint8_t *_data = nullptr;                 ///< Block buffers, slots * slotSize bytes
+    size_t _slotSize = 0;                     ///< Size of a block buffer
+    uint8_t _slots = 0;                       ///< Number of block buffers
+    size_t _offsets[BLOCK_RING_MAX_SLOTS];    ///< Image offset of each published block
+    size_t _lengths[BLOCK_RING_MAX_SLOTS];    ///< Length of each published block
+    std::atomic<uint32_t> _head{0};           ///< Blocks published, written by the producer
+    std::atomic<uint32_t> _tail{0};           ///< Blocks released, written by the consumer
+};
+
+#endif // UPDATE_OTA_BLOCK_RING_HPP
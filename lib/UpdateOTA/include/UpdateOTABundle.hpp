@@ -0,0 +1,32 @@
+#ifndef UPDATE_OTA_BUNDLE_HPP
+#define UPDATE_OTA_BUNDLE_HPP
+
+#include <stdint.h> // uint8_t
+
+#define BUNDLE_MAGIC (0x4E424F55) // "UOBN" in little-endian byte order.
+
+/**
+ * @brief Header of a bundle, followed by `count` UpdateOTABundleEntry and the payloads
+ *
+ * All fields are little-endian, the payloads follow the index in the order of the entries.
+ * Built by tools/ota_bundle.py.
+ */
+struct __attribute__((packed)) UpdateOTABundleHeader
+{
+    uint32_t magic; ///< BUNDLE_MAGIC
+    uint32_t count; ///< Number of entries
+};
+
+/**
+ * @brief Index entry of a bundle payload
+ */
+struct __attribute__((packed)) UpdateOTABundleEntry
+{
+    char label[16];    ///< Partition label, empty to match by type and subtype
+    uint8_t type;      ///< esp_partition_type_t, app entries go to the next OTA slot
+    uint8_t subtype;   ///< esp_partition_subtype_t, 0xFF for any
+    uint16_t reserved; ///< Zero
+    uint32_t length;   ///< Payload length in bytes
+};
+
+#endif // UPDATE_OTA_BUNDLE_HPP
@@ -0,0 +1,49 @@
+#ifndef UPDATE_OTA_CONFIG_HPP
+#define UPDATE_OTA_CONFIG_HPP
+
+/**
+ * Compile-time feature selection of UpdateOTA
+ *
+ * Every feature is enabled by default. A disabled feature is removed together with its
+ * public methods, members and dependencies, so it costs no flash and no RAM. Override the
+ * values with build flags, e.g. in platformio.ini:
+ *      build_flags = -DUPDATE_OTA_MULTICAST=0 -DUPDATE_OTA_INDICATOR=0
+ */
+
+#ifndef UPDATE_OTA_MULTICAST
+#define UPDATE_OTA_MULTICAST (1)          // startMulticastUpdate() with the fountain decoder and WiFiUDP.
+#endif
+
+#ifndef UPDATE_OTA_FILE_SYNC
+#define UPDATE_OTA_FILE_SYNC (1)          // syncFileSystem() with the FS dependency.
+#endif
+
+#ifndef UPDATE_OTA_PIPELINE
+#define UPDATE_OTA_PIPELINE (1)           // setPipelineMode() with the flash stage task and its ring.
+#endif
+
+#ifndef UPDATE_OTA_BUNDLE
+#define UPDATE_OTA_BUNDLE (1)             // startBundleUpdate() with the bundle index and partition writer.
+#endif
+
+#ifndef UPDATE_OTA_SPARSE
+#define UPDATE_OTA_SPARSE (1)             // startSparseUpdate() with the extent format and partition writer.
+#endif
+
+#ifndef UPDATE_OTA_BACKGROUND_STAGING
+#define UPDATE_OTA_BACKGROUND_STAGING (1) // startBackgroundStaging() and its NVS state.
+#endif
+
+#ifndef UPDATE_OTA_INDICATOR
+#define UPDATE_OTA_INDICATOR (1)          // Relay module state and LED toggling while an update runs.
+#endif
+
+#ifndef UPDATE_OTA_TRACE
+#define UPDATE_OTA_TRACE (1)              // Binary event trace in RTC memory, see UpdateOTATrace.
+#endif
+
+#ifndef UPDATE_OTA_PROGRESS_LOG
+#define UPDATE_OTA_PROGRESS_LOG (1)       // Progress log line per block.
+#endif
+
+#endif // UPDATE_OTA_CONFIG_HPP
@@ -0,0 +1,37 @@
+#ifndef UPDATE_OTA_FILE_MANIFEST_HPP
+#define UPDATE_OTA_FILE_MANIFEST_HPP
+
+#include <stdint.h> // uint8_t
+
+#define FILE_MANIFEST_PATH_MAX (64) // Longest file path in a manifest, including the terminator.
+
+/**
+ * @brief One file of a filesystem manifest
+ */
+struct UpdateOTAFileEntry
+{
+    uint8_t sha256[32];                 ///< SHA-256 of the file content
+    uint32_t size;                      ///< File size in bytes
+    char path[FILE_MANIFEST_PATH_MAX];  ///< Absolute path of the file
+};
+
+/**
+ * @brief Parsing of the filesystem manifest used by UpdateOTA::syncFileSystem()
+ *
+ * One line per file, hash as 64 hex digits, size in bytes and absolute path:
+ *      9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08 2048 /www/index.html
+ * Empty lines and lines starting with '#' are skipped.
+ */
+class UpdateOTAFileManifest
+{
+public:
+    /**
+     * @brief Parse a manifest line
+     * @param line Null-terminated line, a trailing "\r" is ignored
+     * @param entry Output entry
+     * @return false if the line is not a file entry
+     */
+    static bool parseLine(const char *line, UpdateOTAFileEntry *entry);
+};
+
+#endif // UPDATE_OTA_FILE_MANIFEST_HPP
@@ -0,0 +1,135 @@
+#ifndef UPDATE_OTA_FOUNTAIN_DECODER_HPP
+#define UPDATE_OTA_FOUNTAIN_DECODER_HPP
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+
+#include "UpdateOTAInterface.hpp" // BLOCK_SIZE_P
+
+#define FOUNTAIN_MAGIC (0x43464F55)                                    // "UOFC" little-endian, marks a fountain packet.
+#define FOUNTAIN_SYMBOL_SIZE (512)                                     // Payload bytes per packet.
+#define FOUNTAIN_SYMBOLS_PER_BLOCK (BLOCK_SIZE_P / FOUNTAIN_SYMBOL_SIZE) // Source symbols per partition block (K).
+#define FOUNTAIN_SLOTS (4)                                             // Blocks decoded concurrently.
+#define FOUNTAIN_SIGNATURE_BLOCK (0xFFFFFFFF)                          // Block index of packets carrying the image signature.
+
+/**
+ * @brief Header of a multicast fountain packet, followed by FOUNTAIN_SYMBOL_SIZE payload bytes
+ *
+ * All fields are little-endian. For signature packets `seed` holds the signature length.
+ */
+struct __attribute__((packed)) UpdateOTAFountainHeader
+{
+    uint32_t magic;      ///< FOUNTAIN_MAGIC
+    uint32_t imageSize;  ///< Total size of the image in bytes
+    uint32_t blockIndex; ///< Index of the BLOCK_SIZE_P block this symbol belongs to
+    uint32_t seed;       ///< Selects the source symbols XORed into the payload
+};
+
+/**
+ * @brief Rateless (random linear fountain over GF(2)) decoder working block by block
+ *
+ * Each BLOCK_SIZE_P block of the image is split into FOUNTAIN_SYMBOLS_PER_BLOCK source symbols.
+ * An encoded symbol is the XOR of the source symbols selected by coefficientsForSeed(); seeds
+ * below FOUNTAIN_SYMBOLS_PER_BLOCK are the source symbols themselves. A block is recovered by
+ * incremental Gaussian elimination as soon as any FOUNTAIN_SYMBOLS_PER_BLOCK independent symbols
+ * arrived, in any order, so lost packets never need to be retransmitted individually.
+ */
+class UpdateOTAFountainDecoder
+{
+public:
+    /**
+     * @brief Constructor
+     */
+    UpdateOTAFountainDecoder();
+
+    /**
+     * @brief Destructor
+     */
+    ~UpdateOTAFountainDecoder();
+
+    /**
+     * @brief Start decoding a new image
+     * @param imageSize Size of the image in bytes
+     * @return false if the block bitmap could not be allocated
+     */
+    bool begin(uint32_t imageSize);
+
+    /**
+     * @brief Add a received symbol
+     * @param blockIndex Block the symbol belongs to
+     * @param seed Seed of the symbol
+     * @param payload FOUNTAIN_SYMBOL_SIZE bytes, used as scratch space
+     * @param block Output, the decoded block when the function returns true
+     * @return true if the symbol completed its block
+     */
+    bool addSymbol(uint32_t blockIndex, uint32_t seed, uint8_t *payload, const uint8_t **block);
+
+    /**
+     * @brief Release the slot of the block returned by addSymbol() and mark it decoded
+     * @param blockIndex Block that was written
+     */
+    void releaseBlock(uint32_t blockIndex);
+
+    /**
+     * @brief Check if a block was already decoded
+     * @param blockIndex Block to check
+     * @return true if the block is decoded
+     */
+    bool isDecoded(uint32_t blockIndex) const;
+
+    /**
+     * @brief Get the number of blocks of the image
+     * @return Number of blocks
+     */
+    uint32_t blockCount() const;
+
+    /**
+     * @brief Get the number of decoded blocks
+     * @return Number of decoded blocks
+     */
+    uint32_t decodedCount() const;
+
+    /**
+     * @brief Get the source symbols combined by an encoded symbol
+     * @param seed Seed of the symbol
+     * @return Bit mask, bit i selects source symbol i
+     */
+    static uint8_t coefficientsForSeed(uint32_t seed);
+
+private:
+    /**
+     * @brief Block under decoding, rows are kept in reduced row echelon form indexed by pivot
+     */
+    struct Slot
+    {
+        uint8_t data[FOUNTAIN_SYMBOLS_PER_BLOCK][FOUNTAIN_SYMBOL_SIZE]; ///< Payload of each row, first to keep it word aligned
+        uint32_t blockIndex;                                           ///< Block decoded in this slot
+        uint32_t lastUsed;                                             ///< Symbol counter value of the last update
+        uint8_t pivots;                                                ///< Bit mask of the pivots present
+        uint8_t rank;                                                  ///< Number of independent symbols
+        bool inUse;                                                    ///< Flag indicating whether the slot is busy
+        uint8_t rows[FOUNTAIN_SYMBOLS_PER_BLOCK];                      ///< Coefficients of each row
+    };
+
+    /**
+     * @brief Find the slot of a block, allocating (or evicting the stalest) slot if needed
+     * @param blockIndex Block to look up
+     * @return The slot
+     */
+    Slot *slotForBlock(uint32_t blockIndex);
+
+    /**
+     * @brief XOR a symbol into another one
+     * @param destination Symbol to modify
+     * @param source Symbol to add
+     */
+    static void xorSymbol(uint8_t *destination, const uint8_t *source);
+
+    Slot _slots[FOUNTAIN_SLOTS];   ///< Blocks currently being decoded
+    uint8_t *_decoded = nullptr;   ///< Bitmap of decoded blocks
+    uint32_t _blockCount = 0;      ///< Number of blocks of the image
+    uint32_t _decodedCount = 0;    ///< Number of decoded blocks
+    uint32_t _symbolCounter = 0;   ///< Number of symbols received, used to age slots
+};
+
+#endif // UPDATE_OTA_FOUNTAIN_DECODER_HPP
@@ -0,0 +1,78 @@
+#ifndef UPDATE_OTA_IMAGE_RECORD_HPP
+#define UPDATE_OTA_IMAGE_RECORD_HPP
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+#include <esp_partition.h>
+
+/**
+ * @brief Persistent (NVS) record of the verified image stored in a partition
+ *
+ * A record is written after an image passed signature verification and cleared as soon as
+ * the partition is written again, so its presence means the partition holds exactly
+ * `length` bytes that match `signature`. A partition without image may instead carry a blank
+ * watermark: the range from its start up to the watermark is known to be erased.
+ */
+class UpdateOTAImageRecord
+{
+public:
+    /**
+     * @brief Save the record of a verified image
+     * @param partition Partition holding the image
+     * @param length Length of the image in bytes
+     * @param signature Detached signature of the image
+     * @param signatureLength Length of the signature
+     * @return true if the record was saved
+     */
+    static bool save(const esp_partition_t *partition, uint32_t length, const uint8_t *signature, size_t signatureLength);
+
+    /**
+     * @brief Load the record of a partition
+     * @param partition Partition to look up
+     * @param length Output for the image length
+     * @param signature Output buffer for the signature, may be nullptr
+     * @param signatureLength In: size of the signature buffer, Out: length of the signature
+     * @return true if the partition holds a verified image
+     */
+    static bool load(const esp_partition_t *partition, uint32_t *length, uint8_t *signature, size_t *signatureLength);
+
+    /**
+     * @brief Remove the record, the blank watermark and the entity tag of a partition, called before the partition is modified
+     * @param partition Partition to clear
+     */
+    static void clear(const esp_partition_t *partition);
+
+    /**
+     * @brief Save the blank watermark of a partition
+     * @param partition Partition that was erased
+     * @param blankEnd End of the erased range from the start of the partition
+     * @return true if the watermark was saved
+     */
+    static bool saveBlankEnd(const esp_partition_t *partition, uint32_t blankEnd);
+
+    /**
+     * @brief Load the blank watermark of a partition
+     * @param partition Partition to look up
+     * @return End of the erased range from the start of the partition, zero if unknown
+     */
+    static uint32_t loadBlankEnd(const esp_partition_t *partition);
+
+    /**
+     * @brief Save the HTTP entity tag the image of a partition was downloaded with
+     * @param partition Partition holding the image
+     * @param eTag Entity tag, as sent by the server
+     * @return true if the tag was saved
+     */
+    static bool saveETag(const esp_partition_t *partition, const char *eTag);
+
+    /**
+     * @brief Load the HTTP entity tag of the image of a partition
+     * @param partition Partition to look up
+     * @param eTag Output buffer for the tag
+     * @param eTagSize Size of the buffer
+     * @return true if a tag is known
+     */
+    static bool loadETag(const esp_partition_t *partition, char *eTag, size_t eTagSize);
+};
+
+#endif // UPDATE_OTA_IMAGE_RECORD_HPP
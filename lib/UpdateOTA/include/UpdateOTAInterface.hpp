@@ -1,9 +1,13 @@
 #ifndef UPDATE_OTA_INTERFACE_HPP
 #define UPDATE_OTA_INTERFACE_HPP
 
-#include <stdint.h> // uint8_t
+#include <stdint.h>   // uint8_t
+#include <functional> // std::function
 
-#define BLOCK_SIZE_P (4096) // Size of the block to write to the partition.
+#define BLOCK_SIZE_P (4096)            // Size of the block to write to the partition.
+#define MAX_MIRRORS (8)                // Maximum number of mirrors passed to startUpdate().
+#define HEALTH_CHECK_INTERVAL_MS (100) // Polling interval of the health check in validateBootedImage().
+#define MAX_MISMATCHED_SECTORS (8)     // Mismatched sectors listed in UpdateOTAResult.
 
 /**
  * @brief Enum representing different update OTA errors
@@ -20,10 +24,62 @@ enum UpdateOTAError : uint8_t
     UPDATE_PROGRESS_ERROR,  ///< Error during the update progress
     NO_ENOUGH_SPACE,        ///< Insufficient space for the update
     UNKNOWN,                ///< Unknown error during update
+    SIGNATURE_INVALID,      ///< Image signature is missing or does not match
+    CONNECTION_FAILED,      ///< Connection, TLS handshake or transfer failed before a response
+    SERVER_BUSY,            ///< Server is overloaded (HTTP 429/503), see UpdateOTAResult::retryAfterMs
+    SERVER_ERROR,           ///< Server error (HTTP 5xx)
+    VALIDATION_FAILED,      ///< Booted image failed its health check and could not be rolled back
+    NO_STAGED_UPDATE,       ///< No staged firmware waits for activation
+    FLASH_ERROR,            ///< Flash erase or write failed, or written data did not read back
+    INVALID_IMAGE,          ///< Firmware header targets another chip or project, or the running version
+    NO_UPDATE_AVAILABLE,    ///< Server has no firmware newer than the running one, see setConditionalDownload()
+};
+
+/**
+ * @brief Order of a published version relative to the running firmware, see checkForUpdate()
+ */
+enum class UpdateOTAVersionOrder : int8_t
+{
+    OLDER = -1, ///< Published version is older than the running firmware
+    SAME = 0,   ///< Published version is the running firmware
+    NEWER = 1,  ///< Published version is newer, an update is available
+};
+
+/**
+ * @brief Detailed outcome of the last operation
+ */
+struct UpdateOTAResult
+{
+    UpdateOTAError error;    ///< Error returned by the operation
+    int16_t httpCode;        ///< Last HTTP status code, negative for HTTPClient errors
+    int32_t transportError;  ///< mbedTLS or HTTPClient error of a failed connection, zero if none
+    uint32_t bytesCompleted; ///< Bytes of the image written to flash
+    uint32_t retryAfterMs;   ///< Delay requested by the server (Retry-After), zero if none
+    uint8_t attempts;        ///< Number of attempts made
+    bool transient;          ///< Flag indicating whether retrying later may succeed
+    uint8_t networkUtilization;                         ///< Busy share of the network stage (receiving, decrypting) in the transfer time, percent, not a CPU load
+    uint8_t flashUtilization;                           ///< Busy share of the flash stage (hashing, erasing, writing) in the transfer time, percent, not a CPU load
+    uint16_t mismatchedSectors;                         ///< Sectors whose readback did not match, see setVerifyWrites()
+    uint32_t mismatchedOffsets[MAX_MISMATCHED_SECTORS]; ///< Partition offsets of the first mismatched sectors
+};
+
+/**
+ * @brief Content of the version manifest, see getUpdateManifest()
+ */
+struct UpdateOTAManifest
+{
+    char version[32];    ///< Version of the published image
+    char rolloutId[32];  ///< Identifier of the rollout, empty if the image is released to all devices at once
+    uint32_t windowSec;  ///< Length of the rollout window in seconds
+    uint32_t startEpoch; ///< Start of the rollout window (Unix time), zero to count from the first check
 };
 
 /**
  * @brief Abstract class defining the interface for handling Over-The-Air (OTA) updates
+ *
+ * Only startUpdate(const char *, bool), getVersionNumber() and errorToString() are pure. The methods added
+ * later have defaults that report UpdateOTAError::UNKNOWN (or false), so existing implementations and mocks
+ * keep compiling.
  */
 class UpdateOTAInterface
 {
@@ -42,10 +98,24 @@ public:
      *      UpdateOTAError::PARTITION_NOT_BOOTABLE  - If the selected partition is not bootable
      *      UpdateOTAError::UPDATE_PROGRESS_ERROR   - If there is an error in the update progress
      *      UpdateOTAError::NO_ENOUGH_SPACE         - If there is insufficient space for the update
+     *      UpdateOTAError::SIGNATURE_INVALID       - If the image signature is missing or does not match
+     *      UpdateOTAError::CONNECTION_FAILED       - If the connection failed
+     *      UpdateOTAError::SERVER_BUSY             - If the server is overloaded
+     *      UpdateOTAError::SERVER_ERROR            - If the server failed
      *      UpdateOTAError::UNKNOWN                 - If there is an unknown error during update
      */
     virtual UpdateOTAError startUpdate(const char *uRL, bool isFirmware) = 0;
 
+    /**
+     * @brief Start the OTA update process from the fastest of several mirrors of the same image
+     * @param uRLs The URLs of the mirrors
+     * @param count Number of mirrors, at most MAX_MIRRORS
+     * @param isFirmware Flag indicating whether the update is for firmware
+     * @return UpdateOTAError indicating the success or failure of the OTA update process, same options as
+     *      startUpdate(const char *, bool), and UpdateOTAError::BAD_REQUEST if the mirror count is invalid
+     */
+    virtual UpdateOTAError startUpdate(const char *const * /*uRLs*/, uint8_t /*count*/, bool /*isFirmware*/) { return UNKNOWN; }
+
     /**
      * @brief Get the version number from the specified URL and store it in the provided buffer
      * @param uRL The URL to get the version number from
@@ -54,7 +124,7 @@ public:
      * @return UpdateOTAError indicating the success or failure of the operation, Options:-
      *      UpdateOTAError::SUCCESS         - If the version number was retrieved successfully
      *      UpdateOTAError::NO_INTERNET     - If there is no internet connection
-     *      UpdateOTAError::BAD_REQUEST     - If there is a bad request error during update
+     *      UpdateOTAError::BAD_REQUEST     - If there is a bad request error or no buffer
      *      UpdateOTAError::UNAUTHORIZED    - If there is unauthorized access during update
      *      UpdateOTAError::PAGE_NOT_FOUND  - If the page is not found during update
      *      UpdateOTAError::NO_ENOUGH_SPACE - If there is insufficient space for the update
@@ -62,6 +132,31 @@ public:
      */
     virtual UpdateOTAError getVersionNumber(const char *uRL, char *buffer, uint8_t bufferSize) = 0;
 
+    /**
+     * @brief Get and parse the version manifest from the specified URL
+     * @param uRL The URL of the manifest
+     * @param manifest Output manifest
+     * @return UpdateOTAError indicating the success or failure of the operation, same options as
+     *      getVersionNumber(), and UpdateOTAError::UNKNOWN if the manifest has no version
+     */
+    virtual UpdateOTAError getUpdateManifest(const char * /*uRL*/, UpdateOTAManifest * /*manifest*/) { return UNKNOWN; }
+
+    /**
+     * @brief Check if the rollout slot of this device has arrived
+     * @param manifest Manifest returned by getUpdateManifest()
+     * @return true if startUpdate() may be called now
+     */
+    virtual bool isRolloutDue(const UpdateOTAManifest & /*manifest*/) { return false; }
+
+    /**
+     * @brief Compare the version published at the specified URL with the running firmware
+     * @param uRL The URL of the version file or manifest
+     * @param order Output order of the published version
+     * @return UpdateOTAError indicating the success or failure of the operation, same options as
+     *      getUpdateManifest(), and UpdateOTAError::UNKNOWN if a version is no semantic version
+     */
+    virtual UpdateOTAError checkForUpdate(const char * /*uRL*/, UpdateOTAVersionOrder * /*order*/) { return UNKNOWN; }
+
     /**
      * @brief Convert an update OTA error to a human-readable string and store it in the provided buffer
      * @param error The update OTA error
@@ -69,6 +164,50 @@ public:
      * @param bufferSize Size of the buffer
      */
     virtual void errorToString(UpdateOTAError error, char *buffer, uint8_t bufferSize) = 0;
+
+    /**
+     * @brief Get the detailed outcome of the last startUpdate() or getVersionNumber()
+     * @return The result, valid until the next operation
+     */
+    virtual const UpdateOTAResult &getLastResult()
+    {
+        static const UpdateOTAResult unknown = {UNKNOWN, 0, 0, 0, 0, 0, false, 0, 0, 0, {0}};
+        return unknown;
+    }
+
+    /**
+     * @brief Confirm or roll back a freshly updated image, call it early in setup()
+     * @param healthCheck Returns true once the new firmware works (connected, peripherals up, ...)
+     * @param deadlineMs Time allowed for the health check before rolling back
+     * @return UpdateOTAError indicating the success or failure of the operation, Options:-
+     *      UpdateOTAError::SUCCESS             - If the image was confirmed or did not need validation
+     *      UpdateOTAError::VALIDATION_FAILED   - If the health check failed and no image to roll back to exists
+     */
+    virtual UpdateOTAError validateBootedImage(std::function<bool()> /*healthCheck*/, uint32_t /*deadlineMs*/) { return UNKNOWN; }
+
+    /**
+     * @brief Check whether a staged firmware waits for activation
+     * @return true if the boot partition differs from the running one
+     */
+    virtual bool hasStagedUpdate() { return false; }
+
+    /**
+     * @brief Reboot into the staged firmware now
+     * @return UpdateOTAError::NO_STAGED_UPDATE if nothing is staged, does not return otherwise
+     */
+    virtual UpdateOTAError activateStagedUpdate() { return UNKNOWN; }
+
+    /**
+     * @brief Schedule the activation of the staged firmware, see handleActivation()
+     * @param notBeforeEpoch Earliest activation time (Unix time), zero for no time condition
+     * @param isIdle Returns true when the device may reboot, nullptr to ignore
+     */
+    virtual void scheduleActivation(uint32_t /*notBeforeEpoch*/, std::function<bool()> /*isIdle*/ = nullptr) {}
+
+    /**
+     * @brief Activate the staged firmware once the scheduled conditions hold, call it from loop()
+     */
+    virtual void handleActivation() {}
 };
 
 #endif // UPDATE_OTA_INTERFACE_HPP
@@ -0,0 +1,58 @@
+#ifndef UPDATE_OTA_PARTITION_WRITER_HPP
+#define UPDATE_OTA_PARTITION_WRITER_HPP
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+#include <esp_partition.h>
+
+/**
+ * @brief Sequential partition writer that erases sectors only when the data reaches them
+ *
+ * Data of any length is appended at the current offset, so callers streaming several images
+ * or odd sized chunks need not align to sectors. Blank ranges are skipped without writing,
+ * erasing leaves them 0xFF. Sectors past the end of the written data are never erased.
+ */
+class UpdateOTAPartitionWriter
+{
+public:
+    /**
+     * @brief Start writing at the beginning of a partition
+     * @param partition Partition to write
+     */
+    void begin(const esp_partition_t *partition);
+
+    /**
+     * @brief Append data at the current offset
+     * @param data Data to write
+     * @param length Length of the data
+     * @return false if the data does not fit or the flash operation failed
+     */
+    bool write(const void *data, size_t length);
+
+    /**
+     * @brief Move forward to an offset, the range in between is left blank (0xFF)
+     * @param offset New offset, not below the current one
+     * @return false if the offset is out of range or the erase failed
+     */
+    bool skipTo(size_t offset);
+
+    /**
+     * @brief Current offset from the start of the partition
+     * @return Offset in bytes
+     */
+    size_t offset() const;
+
+private:
+    /**
+     * @brief Erase the sectors up to an offset that were not erased yet
+     * @param end End offset, exclusive
+     * @return false if the erase failed
+     */
+    bool eraseUpTo(size_t end);
+
+    const esp_partition_t *_partition = nullptr; ///< Partition being written
+    size_t _offset = 0;                          ///< Offset of the next write
+    size_t _erasedEnd = 0;                       ///< End of the erased range, sector aligned
+};
+
+#endif // UPDATE_OTA_PARTITION_WRITER_HPP
@@ -0,0 +1,101 @@
+#ifndef UPDATE_OTA_PEER_SERVER_HPP
+#define UPDATE_OTA_PEER_SERVER_HPP
+
+#include <MultiPrinterLoggerInterface.hpp> // MultiPrinterLoggerInterface
+#include <WiFi.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+
+#include "UpdateOTAInterface.hpp"
+#include "UpdateOTASignature.hpp"
+
+#define PEER_SERVER_DEFAULT_PORT (8266) // Default TCP port of the peer server.
+#define PEER_HEADER_TIMEOUT_MS (2000)   // Deadline for the whole request header of a client.
+#define PEER_HEADER_LINE_MAX (128)      // Longer header lines are cut, requests from neighbours are tiny.
+
+/**
+ * @brief Small HTTP server that shares the verified firmware of this device with its neighbours
+ *
+ * Serves "/firmware.bin" (with Range support) and "/firmware.bin.sig" straight from flash.
+ * The served image is the staged partition when an update waits for a reboot, otherwise the
+ * running partition, and only if it was installed through a signature-verified update.
+ * Neighbours fetch it with UpdateOTA::startUpdate() using the URL from getURL() and the same
+ * signing key, so the image is authenticated end-to-end even though the peer link is plain HTTP.
+ */
+class UpdateOTAPeerServer
+{
+public:
+    /**
+     * @brief Constructor
+     * @param port TCP port to listen on
+     * @param logger Logger for logging messages
+     */
+    UpdateOTAPeerServer(uint16_t port = PEER_SERVER_DEFAULT_PORT, MultiPrinterLoggerInterface *logger = nullptr);
+
+    /**
+     * @brief Destructor
+     */
+    ~UpdateOTAPeerServer();
+
+    /**
+     * @brief Start serving the verified image of this device
+     * @return UpdateOTAError indicating the success or failure of the operation, Options:-
+     *      UpdateOTAError::SUCCESS                 - If the server was started
+     *      UpdateOTAError::NO_INTERNET             - If WiFi is not connected
+     *      UpdateOTAError::NO_PARTITION_AVAILABLE  - If no verified image is available to share
+     */
+    UpdateOTAError begin();
+
+    /**
+     * @brief Stop the server and close the current connection
+     */
+    void end();
+
+    /**
+     * @brief Serve pending requests, call it from the main loop
+     *
+     * Each call sends at most one block so the caller is never blocked for a whole transfer.
+     */
+    void handleClient();
+
+    /**
+     * @brief Get the URL neighbours should pass to startUpdate()
+     * @param buffer Buffer to store the URL
+     * @param bufferSize Size of the buffer
+     */
+    void getURL(char *buffer, uint8_t bufferSize);
+
+private:
+    /**
+     * @brief Parse the request of a newly accepted client and send the response headers
+     */
+    void beginResponse();
+
+    /**
+     * @brief Read one line of the request header
+     * @param line Line without its terminator, cut to PEER_HEADER_LINE_MAX characters
+     * @param deadline millis() value the whole header must be received by
+     * @return true if a complete line was read, false if the deadline passed or the client disconnected
+     */
+    bool readLine(String &line, uint32_t deadline);
+
+    /**
+     * @brief Send a response without body and close the connection
+     * @param status HTTP status line, e.g. "404 Not Found"
+     */
+    void sendStatus(const char *status);
+
+    MultiPrinterLoggerInterface *_logger = nullptr; ///< Logger for logging messages
+    WiFiServer _server;                             ///< Listening socket
+    WiFiClient _client;                             ///< Client currently being served
+    uint16_t _port;                                 ///< TCP port of the server
+    const esp_partition_t *_partition = nullptr;    ///< Partition holding the shared image
+    uint32_t _imageLength = 0;                      ///< Length of the shared image
+    uint8_t _signature[SIGNATURE_MAX_SIZE];         ///< Detached signature of the shared image
+    size_t _signatureLength = 0;                    ///< Length of the detached signature
+    size_t _offset = 0;                             ///< Next offset to send to the current client
+    size_t _end = 0;                                ///< End (exclusive) of the range sent to the current client
+    char _buffer[BLOCK_SIZE_P];                     ///< Buffer for reading blocks from flash
+};
+
+#endif // UPDATE_OTA_PEER_SERVER_HPP
@@ -0,0 +1,44 @@
+#ifndef UPDATE_OTA_ROLLOUT_HPP
+#define UPDATE_OTA_ROLLOUT_HPP
+
+#include <stdint.h> // uint8_t
+
+#include "UpdateOTAInterface.hpp" // UpdateOTAManifest
+
+#define CLOCK_VALID_EPOCH (1600000000) // System clocks before this Unix time are not synchronized.
+
+/**
+ * @brief Manifest parsing and deterministic rollout slots
+ *
+ * The manifest is the version file extended with optional "key=value" lines:
+ *      5.1.2
+ *      rollout=2024-03-a
+ *      window=7200
+ *      start=1710000000
+ * The first line is the version, so a plain version file is a manifest without rollout.
+ */
+class UpdateOTARollout
+{
+public:
+    /**
+     * @brief Parse a manifest
+     * @param text Null-terminated manifest text
+     * @param manifest Output manifest
+     * @return false if the manifest has no version
+     */
+    static bool parseManifest(const char *text, UpdateOTAManifest *manifest);
+
+    /**
+     * @brief Compute the slot of a device inside the rollout window
+     *
+     * The device hash is scaled to the window (not taken modulo), so widening or narrowing
+     * the window keeps the order of the devices and only stretches their slots.
+     * @param mac MAC address of the device, 6 bytes
+     * @param rolloutId Identifier of the rollout
+     * @param windowSec Length of the rollout window in seconds
+     * @return Offset of the slot from the start of the window in seconds
+     */
+    static uint32_t slotOffsetSec(const uint8_t *mac, const char *rolloutId, uint32_t windowSec);
+};
+
+#endif // UPDATE_OTA_ROLLOUT_HPP
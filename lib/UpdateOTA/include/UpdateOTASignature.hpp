@@ -0,0 +1,86 @@
+#ifndef UPDATE_OTA_SIGNATURE_HPP
+#define UPDATE_OTA_SIGNATURE_HPP
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+#include <mbedtls/pk.h>
+#include <mbedtls/sha256.h>
+
+#define SIGNATURE_MAX_SIZE (512) // Large enough for RSA-4096 and DER encoded ECDSA signatures.
+
+/**
+ * @brief Verifies a detached signature (SHA-256 + RSA/ECDSA) over a streamed image
+ */
+class UpdateOTASignature
+{
+public:
+    /**
+     * @brief Constructor
+     */
+    UpdateOTASignature();
+
+    /**
+     * @brief Destructor
+     */
+    ~UpdateOTASignature();
+
+    /**
+     * @brief Set the public key used to verify signatures
+     * @param publicKeyPem PEM encoded public key, nullptr to disable verification
+     * @return true if the key was parsed successfully
+     */
+    bool setPublicKey(const char *publicKeyPem);
+
+    /**
+     * @brief Check if a public key is configured
+     * @return true if signatures can be verified
+     */
+    bool hasPublicKey() const;
+
+    /**
+     * @brief Store the detached signature of the image that is about to be streamed
+     * @param signature Signature bytes
+     * @param length Length of the signature
+     * @return false if the signature does not fit
+     */
+    bool setSignature(const uint8_t *signature, size_t length);
+
+    /**
+     * @brief Get the signature buffer, used to read the signature in place
+     * @return Pointer to a buffer of SIGNATURE_MAX_SIZE bytes
+     */
+    uint8_t *signatureBuffer();
+
+    /**
+     * @brief Get the length of the stored signature
+     * @return Length in bytes, zero if no signature is stored
+     */
+    size_t signatureLength() const;
+
+    /**
+     * @brief Start hashing a new image
+     */
+    void begin();
+
+    /**
+     * @brief Feed the next part of the image
+     * @param data Image data
+     * @param length Length of the data
+     */
+    void update(const uint8_t *data, size_t length);
+
+    /**
+     * @brief Finish hashing and verify the stored signature
+     * @return true if the signature matches the streamed image
+     */
+    bool verify();
+
+private:
+    mbedtls_pk_context _publicKey;              ///< Parsed public key
+    mbedtls_sha256_context _sha256;             ///< Running hash of the streamed image
+    bool _hasPublicKey = false;                 ///< Flag indicating whether a key was parsed
+    uint8_t _signature[SIGNATURE_MAX_SIZE];     ///< Detached signature of the image
+    size_t _signatureLength = 0;                ///< Length of the detached signature
+};
+
+#endif // UPDATE_OTA_SIGNATURE_HPP
@@ -0,0 +1,30 @@
+#ifndef UPDATE_OTA_SPARSE_HPP
+#define UPDATE_OTA_SPARSE_HPP
+
+#include <stdint.h> // uint8_t
+
+#define SPARSE_MAGIC (0x50534F55) // "UOSP" in little-endian byte order.
+
+/**
+ * @brief Header of a sparse image, followed by extents until the end of the stream
+ *
+ * All fields are little-endian. Each extent is an UpdateOTASparseExtent followed by `length`
+ * bytes of image data, extents are in ascending order and do not overlap. Everything between
+ * the extents is 0xFF. Built by tools/ota_sparse.py.
+ */
+struct __attribute__((packed)) UpdateOTASparseHeader
+{
+    uint32_t magic;     ///< SPARSE_MAGIC
+    uint32_t imageSize; ///< Length of the expanded image in bytes
+};
+
+/**
+ * @brief Extent of non-blank image data
+ */
+struct __attribute__((packed)) UpdateOTASparseExtent
+{
+    uint32_t offset; ///< Offset of the data in the image
+    uint32_t length; ///< Length of the data in bytes
+};
+
+#endif // UPDATE_OTA_SPARSE_HPP
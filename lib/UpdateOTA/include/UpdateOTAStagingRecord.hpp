@@ -0,0 +1,48 @@
+#ifndef UPDATE_OTA_STAGING_RECORD_HPP
+#define UPDATE_OTA_STAGING_RECORD_HPP
+
+#include <stdint.h> // uint8_t
+
+#define STAGING_URL_MAX (160) // Longest staging URL, including the terminator.
+#define STAGING_ETAG_MAX (72) // Longest ETag kept for If-Range, including the terminator.
+
+/**
+ * @brief Progress of a background staging, kept in NVS so it survives reboots
+ */
+struct UpdateOTAStagingState
+{
+    char uRL[STAGING_URL_MAX];   ///< Image URL, empty if no staging is active
+    char eTag[STAGING_ETAG_MAX]; ///< ETag of the image, empty if the server sent none
+    char partition[17];          ///< Label of the slot being written
+    uint32_t length;             ///< Image length, zero before the first response
+    uint32_t offset;             ///< Bytes of the image written to the slot
+    bool paused;                 ///< Flag indicating whether the staging was paused
+};
+
+/**
+ * @brief Persistent (NVS) record of the background staging
+ */
+class UpdateOTAStagingRecord
+{
+public:
+    /**
+     * @brief Save the staging state
+     * @param state State to save
+     * @return true if the state was saved
+     */
+    static bool save(const UpdateOTAStagingState &state);
+
+    /**
+     * @brief Load the staging state
+     * @param state Output state, empty (no URL) if none is saved
+     * @return true if a staging is active
+     */
+    static bool load(UpdateOTAStagingState *state);
+
+    /**
+     * @brief Remove the staging state
+     */
+    static void clear();
+};
+
+#endif // UPDATE_OTA_STAGING_RECORD_HPP
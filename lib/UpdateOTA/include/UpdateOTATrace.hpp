@@ -0,0 +1,156 @@
+#ifndef UPDATE_OTA_TRACE_HPP
+#define UPDATE_OTA_TRACE_HPP
+
+#include <stdint.h> // uint8_t
+#include <atomic>   // std::atomic_signal_fence
+#include <esp_timer.h>
+
+#include "UpdateOTAConfig.hpp"
+
+#define TRACE_CAPACITY (128)      // Records kept in RTC memory, the oldest are overwritten.
+#define TRACE_MAGIC (0x55545243u) // Marks an initialized trace buffer ("UTRC").
+
+/**
+ * @brief Events of the update trace
+ */
+enum class UpdateOTATraceEvent : uint8_t
+{
+    BOOT,           ///< First UpdateOTA of a boot, code: esp_reset_reason(), value: ms since the app started
+    UPDATE_START,   ///< Update started, code: 1 for firmware
+    DOWNLOAD_START, ///< Image response received, value: image length in KB
+    BLOCK,          ///< Block received and written, value: duration in ms
+    MIRROR_SWITCH,  ///< Download resumed from another mirror, code: position in the ranking
+    VERIFY,         ///< Image verified, code: UpdateOTAError
+    ACTIVATE,       ///< Boot partition switched to the new image
+    RESTART,        ///< Rebooting into the new image
+    ERROR,          ///< Operation failed, code: UpdateOTAError, value: HTTP code
+    SERVICE_STOPPED, ///< Application stopped its service for the update
+    SERVICE_READY,   ///< Application serves again after boot
+};
+
+/**
+ * @brief One trace record, 8 bytes
+ */
+struct UpdateOTATraceRecord
+{
+    uint32_t timeMs;           ///< Time in ms on a clock that keeps running across software resets
+    UpdateOTATraceEvent event; ///< Event
+    uint8_t code;              ///< Event specific code
+    uint16_t value;            ///< Event specific value
+};
+
+/**
+ * @brief Service downtime of the last firmware update, see UpdateOTATrace::downtime()
+ */
+struct UpdateOTADowntime
+{
+    uint32_t shutdownMs; ///< From SERVICE_STOPPED to the restart, zero if the application did not mark it
+    uint32_t bootMs;     ///< From the restart to the start of the new app: reset, bootloader and image verification
+    uint32_t initMs;     ///< From the start of the new app to SERVICE_READY
+    uint32_t totalMs;    ///< Sum of the phases
+};
+
+/**
+ * @brief Ring of trace records as laid out in RTC memory
+ */
+struct UpdateOTATraceBuffer
+{
+    uint32_t magic;                               ///< TRACE_MAGIC once initialized
+    uint32_t head;                                ///< Number of records written, the ring index is head % TRACE_CAPACITY
+    UpdateOTATraceRecord records[TRACE_CAPACITY]; ///< Records
+};
+
+/**
+ * @brief Binary trace of the update engine in RTC slow memory
+ *
+ * Recording is a handful of stores without formatting, locks or flash access, and is compiled
+ * out with UPDATE_OTA_TRACE=0. The buffer is not initialized at boot (RTC_NOINIT), so after
+ * the reboot into a new firmware the trace of the update that installed it can be read back.
+ * Timestamps are system time (RTC timer), which keeps running across software resets, so the
+ * gap between RESTART and BOOT is the reboot time. A power-on reset clears the trace.
+ *
+ * Records are written by the task running the update only; the head is advanced after the
+ * record is complete, so a reset in between loses that record and nothing else.
+ */
+class UpdateOTATrace
+{
+public:
+    /**
+     * @brief Validate the buffer after boot and record the BOOT event, once per boot
+     */
+    static void begin();
+
+    /**
+     * @brief Append a record
+     * @param event Event
+     * @param code Event specific code
+     * @param value Event specific value
+     */
+    static inline void record(UpdateOTATraceEvent event, uint8_t code = 0, uint16_t value = 0)
+    {
+#if UPDATE_OTA_TRACE
+        UpdateOTATraceRecord &entry = _buffer.records[_buffer.head % TRACE_CAPACITY];
+        entry.timeMs = nowMs();
+        entry.event = event;
+        entry.code = code;
+        entry.value = value;
+        std::atomic_signal_fence(std::memory_order_release);
+        _buffer.head = _buffer.head + 1;
+#endif
+    }
+
+    /**
+     * @brief Remove all records, called when a new update starts
+     */
+    static void clear();
+
+    /**
+     * @brief Get the number of records available
+     * @return Number of records, at most TRACE_CAPACITY
+     */
+    static uint16_t count();
+
+    /**
+     * @brief Get a record
+     * @param index Index of the record, 0 is the oldest
+     * @param record Output record
+     * @return false if the index is out of range
+     */
+    static bool get(uint16_t index, UpdateOTATraceRecord *record);
+
+    /**
+     * @brief Get the time from the last RESTART to the BOOT that followed it
+     * @return Reboot time in ms, zero if the trace does not contain a reboot
+     */
+    static uint32_t rebootGapMs();
+
+    /**
+     * @brief Get the service downtime of the update that installed the running firmware
+     * @param downtime Output downtime
+     * @return false if the trace does not contain a reboot followed by SERVICE_READY
+     */
+    static bool downtime(UpdateOTADowntime *downtime);
+
+    /**
+     * @brief Get the name of an event
+     * @param event Event
+     * @return Name, e.g. "BLOCK"
+     */
+    static const char *eventName(UpdateOTATraceEvent event);
+
+    /**
+     * @brief Get the current time in the clock domain of the records
+     * @return Time in ms
+     */
+    static inline uint32_t nowMs()
+    {
+        return (uint32_t)(esp_timer_get_time() / 1000) + _bootOffsetMs;
+    }
+
+private:
+    static UpdateOTATraceBuffer _buffer; ///< Trace ring, in RTC slow memory
+    static uint32_t _bootOffsetMs;       ///< System time at boot, added to esp_timer_get_time()
+    static bool _begun;                  ///< Flag indicating whether begin() ran in this boot
+};
+
+#endif // UPDATE_OTA_TRACE_HPP
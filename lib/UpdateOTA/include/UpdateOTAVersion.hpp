@@ -0,0 +1,53 @@
+#ifndef UPDATE_OTA_VERSION_HPP
+#define UPDATE_OTA_VERSION_HPP
+
+#include <stdint.h> // uint32_t
+
+/**
+ * @brief Semantic version, parsed in place
+ *
+ * The pre-release tag points into the parsed text, which must outlive the version.
+ */
+struct UpdateOTASemver
+{
+    uint32_t major;              ///< Major version
+    uint32_t minor;              ///< Minor version, zero if missing
+    uint32_t patch;              ///< Patch version, zero if missing
+    const char *preRelease;      ///< Pre-release tag without the '-', e.g. "rc.1"
+    uint8_t preReleaseLength;    ///< Length of the pre-release tag, zero for a release
+};
+
+/**
+ * @brief Parsing and ordering of semantic versions without heap use
+ *
+ * Accepts "MAJOR[.MINOR[.PATCH]][-PRERELEASE][+BUILD]" with an optional leading 'v' and
+ * surrounding whitespace, as written to version files and to esp_app_desc_t::version.
+ * Build metadata is ignored for the order, as required by semver 2.0.0.
+ */
+class UpdateOTAVersion
+{
+public:
+    /**
+     * @brief Parse a version
+     * @param text Null-terminated version, the rest of the line after it is ignored
+     * @param version Output version
+     * @return false if the text does not start with a version
+     */
+    static bool parse(const char *text, UpdateOTASemver *version);
+
+    /**
+     * @brief Order two versions, a pre-release is lower than its release
+     * @param a First version
+     * @param b Second version
+     * @return Negative if a is older than b, zero if they are equal, positive if a is newer
+     */
+    static int8_t compare(const UpdateOTASemver &a, const UpdateOTASemver &b);
+
+private:
+    /**
+     * @brief Order two pre-release tags per dot-separated identifier
+     */
+    static int8_t comparePreRelease(const UpdateOTASemver &a, const UpdateOTASemver &b);
+};
+
+#endif // UPDATE_OTA_VERSION_HPP
@@ -1,263 +1,2560 @@
 #include "UpdateOTA.hpp"
+#include "UpdateOTAImageRecord.hpp"
+
+#include <algorithm> // std::sort, std::binary_search
+#include <new> // std::nothrow
+
+const char UpdateOTA::CA_DIGICERT_GLOBAL_ROOT_G2[] =
+    "-----BEGIN CERTIFICATE-----\n"
+    "MIIDjjCCAnagAwIBAgIQAzrx5qcRqaC7KGSxHQn65TANBgkqhkiG9w0BAQsFADBh\n"
+    "MQswCQYDVQQGEwJVUzEVMBMGA1UEChMMRGlnaUNlcnQgSW5jMRkwFwYDVQQLExB3\n"
+    "d3cuZGlnaWNlcnQuY29tMSAwHgYDVQQDExdEaWdpQ2VydCBHbG9iYWwgUm9vdCBH\n"
+    "MjAeFw0xMzA4MDExMjAwMDBaFw0zODAxMTUxMjAwMDBaMGExCzAJBgNVBAYTAlVT\n"
+    "MRUwEwYDVQQKEwxEaWdpQ2VydCBJbmMxGTAXBgNVBAsTEHd3dy5kaWdpY2VydC5j\n"
+    "b20xIDAeBgNVBAMTF0RpZ2lDZXJ0IEdsb2JhbCBSb290IEcyMIIBIjANBgkqhkiG\n"
+    "9w0BAQEFAAOCAQ8AMIIBCgKCAQEAuzfNNNx7a8myaJCtSnX/RrohCgiN9RlUyfuI\n"
+    "2/Ou8jqJkTx65qsGGmvPrC3oXgkkRLpimn7Wo6h+4FR1IAWsULecYxpsMNzaHxmx\n"
+    "1x7e/dfgy5SDN67sH0NO3Xss0r0upS/kqbitOtSZpLYl6ZtrAGCSYP9PIUkY92eQ\n"
+    "q2EGnI/yuum06ZIya7XzV+hdG82MHauVBJVJ8zUtluNJbd134/tJS7SsVQepj5Wz\n"
+    "tCO7TG1F8PapspUwtP1MVYwnSlcUfIKdzXOS0xZKBgyMUNGPHgm+F6HmIcr9g+UQ\n"
+    "vIOlCsRnKPZzFBQ9RnbDhxSJITRNrw9FDKZJobq7nMWxM4MphQIDAQABo0IwQDAP\n"
+    "BgNVHRMBAf8EBTADAQH/MA4GA1UdDwEB/wQEAwIBhjAdBgNVHQ4EFgQUTiJUIBiV\n"
+    "5uNu5g/6+rkS7QYXjzkwDQYJKoZIhvcNAQELBQADggEBAGBnKJRvDkhj6zHd6mcY\n"
+    "1Yl9PMWLSn/pvtsrF9+wX3N3KjITOYFnQoQj8kVnNeyIv/iPsGEMNKSuIEyExtv4\n"
+    "NeF22d+mQrvHRAiGfzZ0JFrabA0UWTW98kndth/Jsw1HKj2ZL7tcu7XUIOGZX1NG\n"
+    "Fdtom/DzMNU+MeKNhJ7jitralj41E6Vf8PlwUHBHQRFXGU7Aj64GxJUTFy8bJZ91\n"
+    "8rGOmaFvE7FBcf6IKshPECBV1/MUReXgRPTqh5Uykw7+U0b6LJ3/iyK5S9kJRaTe\n"
+    "pLiaWN0bfVKfjllDiIGknibVb63dDcY3fe0Dkhvld1927jyNxF1WW6LZZm6zNTfl\n"
+    "MrY=\n"
+    "-----END CERTIFICATE-----\n";
+
+const char UpdateOTA::CA_USERTRUST_ECC[] =
+    "-----BEGIN CERTIFICATE-----\n"
+    "MIICjzCCAhWgAwIBAgIQXIuZxVqUxdJxVt7NiYDMJjAKBggqhkjOPQQDAzCBiDEL\n"
+    "MAkGA1UEBhMCVVMxEzARBgNVBAgTCk5ldyBKZXJzZXkxFDASBgNVBAcTC0plcnNl\n"
+    "eSBDaXR5MR4wHAYDVQQKExVUaGUgVVNFUlRSVVNUIE5ldHdvcmsxLjAsBgNVBAMT\n"
+    "JVVTRVJUcnVzdCBFQ0MgQ2VydGlmaWNhdGlvbiBBdXRob3JpdHkwHhcNMTAwMjAx\n"
+    "MDAwMDAwWhcNMzgwMTE4MjM1OTU5WjCBiDELMAkGA1UEBhMCVVMxEzARBgNVBAgT\n"
+    "Ck5ldyBKZXJzZXkxFDASBgNVBAcTC0plcnNleSBDaXR5MR4wHAYDVQQKExVUaGUg\n"
+    "VVNFUlRSVVNUIE5ldHdvcmsxLjAsBgNVBAMTJVVTRVJUcnVzdCBFQ0MgQ2VydGlm\n"
+    "aWNhdGlvbiBBdXRob3JpdHkwdjAQBgcqhkjOPQIBBgUrgQQAIgNiAAQarFRaqflo\n"
+    "I+d61SRvU8Za2EurxtW20eZzca7dnNYMYf3boIkDuAUU7FfO7l0/4iGzzvfUinng\n"
+    "o4N+LZfQYcTxmdwlkWOrfzCjtHDix6EznPO/LlxTsV+zfTJ/ijTjeXmjQjBAMB0G\n"
+    "A1UdDgQWBBQ64QmG1M8ZwpZ2dEl23OA1xmNjmjAOBgNVHQ8BAf8EBAMCAQYwDwYD\n"
+    "VR0TAQH/BAUwAwEB/zAKBggqhkjOPQQDAwNoADBlAjA2Z6EWCNzklwBBHU6+4WMB\n"
+    "zzuqQhFkoJ2UOQIReVx7Hfpkue4WQrO/isIJxOzksU0CMQDpKmFHjFJKS04YcPbW\n"
+    "RNZu9YO6bVi9JNlWSOrvxKJGgYhqOkbRqZtNyWHa0V1Xahg=\n"
+    "-----END CERTIFICATE-----\n";
 
 UpdateOTA::UpdateOTA(MultiPrinterLoggerInterface *logger, RelayModuleInterface *relayModule)
     : _logger(logger),
       _relayModule(relayModule)
 {
     Log_Debug(_logger, "UpdateOTA created");
+    UpdateOTATrace::begin();
     // Initialize member variables
     _newPartition = nullptr;
     _uRL = nullptr;
+    _tlsProfile = {CA_DIGICERT_GLOBAL_ROOT_G2, 120, 30000, 10000};
+    _mirrorPolicy = {600000, 16384, 5000};
+    _retryPolicy = {1, 1000, 60000};
+    _qosPolicy = {0, BLOCK_SIZE_P, 100};
+#if UPDATE_OTA_BACKGROUND_STAGING
+    memset(&_staging, 0, sizeof(_staging));
+#endif
 }
 
 UpdateOTA::~UpdateOTA()
 {
-    Log_Debug(_logger, "UpdateOTA destroyed");
-    // Clean up resources on destruction
-    if (_httpClient != nullptr)
+    Log_Debug(_logger, "UpdateOTA destroyed");
+    // Clean up resources on destruction
+    endSession();
+#if UPDATE_OTA_BACKGROUND_STAGING
+    delete[] _stagingBuffer;
+#endif
+}
+
+UpdateOTAError UpdateOTA::startUpdate(const char *uRL, bool isFirmware)
+{
+    // A single URL is a mirror list of one, probing is skipped
+    return startUpdate(&uRL, 1, isFirmware);
+}
+
+UpdateOTAError UpdateOTA::startUpdate(const char *const *uRLs, uint8_t count, bool isFirmware)
+{
+    Log_Verbose(_logger, "UpdateOTA startUpdate: URL='%s', Mirrors=%u, isFirmware=%s", count > 0 ? uRLs[0] : "", count, isFirmware ? "true" : "false");
+
+    // Set member variables based on input parameters
+    _isFirmware = isFirmware;
+    _bytesCompleted = 0;
+    _pendingETag[0] = '\0';
+    _lastResult = {};
+    _httpCode = 0; // Errors before the first request carry no HTTP code.
+    UpdateOTATrace::clear();
+    UpdateOTATrace::record(UpdateOTATraceEvent::UPDATE_START, isFirmware);
+
+    if (uRLs == nullptr || count == 0 || count > MAX_MIRRORS)
+    {
+        Log_Error(_logger, "UpdateOTA startUpdate error: Invalid mirror count=%u", count);
+        return recordResult(UpdateOTAError::BAD_REQUEST);
+    }
+
+    // Check if the device is connected to the internet
+    if (WiFi.status() != WL_CONNECTED)
+    {
+        Log_Error(_logger, "UpdateOTA startUpdate error: No internet connection");
+        return recordResult(UpdateOTAError::NO_INTERNET);
+    }
+
+    // Plain HTTP is only accepted when the image signature can be verified
+    bool verifySignature = _signature.hasPublicKey();
+    for (uint8_t i = 0; i < count && !verifySignature; i++)
+    {
+        if (strncmp(uRLs[i], "http://", 7) == 0)
+        {
+            Log_Error(_logger, "UpdateOTA startUpdate error: Plain HTTP source requires a signing key");
+            return recordResult(UpdateOTAError::SIGNATURE_INVALID);
+        }
+    }
+
+    // Download, retrying transient failures from where the previous attempt stopped
+    UpdateOTAError err = UpdateOTAError::SUCCESS;
+    for (uint8_t attempt = 1;; attempt++)
+    {
+        err = recordResult(downloadImage(uRLs, count, verifySignature));
+        _lastResult.attempts = attempt;
+        if (err == UpdateOTAError::SUCCESS || !_lastResult.transient || attempt >= _retryPolicy.maxAttempts)
+            break;
+
+        uint32_t retryDelay = retryDelayMs(attempt);
+        if (retryDelay > _retryPolicy.maxDelayMs)
+        {
+            Log_Error(_logger, "UpdateOTA startUpdate error: Server asked to retry after %ums", retryDelay);
+            break;
+        }
+        Log_Verbose(_logger, "UpdateOTA startUpdate: Attempt %u failed, ErrorCode=%d, Completed=%u, retrying in %ums",
+                    attempt, err, _bytesCompleted.load(), retryDelay);
+        delay(retryDelay);
+    }
+    _mirrors = nullptr; // The list belongs to the caller, only the ranking is kept.
+
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        Log_Error(_logger, "UpdateOTA startUpdate error: Failed to update firmware, ErrorCode=%d", err);
+        _pendingETag[0] = '\0';
+        return err;
+    }
+
+    return recordResult(finishUpdate(_streamLength, verifySignature));
+}
+
+UpdateOTAError UpdateOTA::startUpdate(const UpdateOTATarget *targets, uint8_t count)
+{
+    Log_Verbose(_logger, "UpdateOTA startUpdate: Targets=%u", count);
+    _lastResult = {};
+    _httpCode = 0;
+
+    if (targets == nullptr || count == 0 || count > MAX_TARGETS)
+    {
+        Log_Error(_logger, "UpdateOTA startUpdate error: Invalid target count=%u", count);
+        return recordResult(UpdateOTAError::BAD_REQUEST);
+    }
+
+    // Check if the device is connected to the internet
+    if (WiFi.status() != WL_CONNECTED)
+    {
+        Log_Error(_logger, "UpdateOTA startUpdate error: No internet connection");
+        return recordResult(UpdateOTAError::NO_INTERNET);
+    }
+
+    // Resolve every partition before the first byte is written
+    const esp_partition_t *partitions[MAX_TARGETS];
+    const esp_partition_t *appPartition = nullptr;
+    uint8_t appTarget = 0;
+    bool verifySignature = _signature.hasPublicKey();
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (!verifySignature && strncmp(targets[i].uRL, "http://", 7) == 0)
+        {
+            Log_Error(_logger, "UpdateOTA startUpdate error: Plain HTTP source requires a signing key");
+            return recordResult(UpdateOTAError::SIGNATURE_INVALID);
+        }
+
+        partitions[i] = findTargetPartition(targets[i]);
+        if (partitions[i] == nullptr)
+        {
+            Log_Error(_logger, "UpdateOTA startUpdate error: No partition for target %u", i);
+            return recordResult(UpdateOTAError::NO_PARTITION_AVAILABLE);
+        }
+        for (uint8_t j = 0; j < i; j++)
+        {
+            if (partitions[j] == partitions[i])
+            {
+                Log_Error(_logger, "UpdateOTA startUpdate error: Partition '%s' targeted twice", partitions[i]->label);
+                return recordResult(UpdateOTAError::BAD_REQUEST);
+            }
+        }
+        if (partitions[i]->type != ESP_PARTITION_TYPE_APP)
+            continue;
+        if (appPartition != nullptr)
+        {
+            Log_Error(_logger, "UpdateOTA startUpdate error: More than one app target");
+            return recordResult(UpdateOTAError::BAD_REQUEST);
+        }
+        appPartition = partitions[i];
+        appTarget = i;
+    }
+
+    // The app goes to the inactive slot first, a failure there leaves every data partition intact.
+    // Data partitions are overwritten in place, a later failure leaves them changed.
+    uint8_t order[MAX_TARGETS];
+    uint8_t ordered = 0;
+    if (appPartition != nullptr)
+        order[ordered++] = appTarget;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (appPartition == nullptr || i != appTarget)
+            order[ordered++] = i;
+    }
+
+    // HTTPClient keeps the connection alive between requests to the same origin
+    UpdateOTAError err = UpdateOTAError::SUCCESS;
+    for (uint8_t n = 0; n < count && err == UpdateOTAError::SUCCESS; n++)
+    {
+        uint8_t i = order[n];
+        _newPartition = partitions[i];
+        _isFirmware = _newPartition->type == ESP_PARTITION_TYPE_APP;
+        _uRL = targets[i].uRL;
+        if (n == 0 || !isSameOrigin(targets[order[n - 1]].uRL, _uRL))
+            beginSession(); // Scheme and client type follow the target, the previous session is closed.
+        if (verifySignature)
+        {
+            err = fetchSignature();
+            if (err != UpdateOTAError::SUCCESS)
+                break;
+        }
+
+        err = processGetRequest();
+        if (err != UpdateOTAError::SUCCESS)
+            break;
+        if (_httpClient->getSize() < 0 || (uint32_t)_httpClient->getSize() > _newPartition->size)
+        {
+            Log_Error(_logger, "UpdateOTA startUpdate error: Image does not fit partition '%s'", _newPartition->label);
+            err = UpdateOTAError::NO_ENOUGH_SPACE;
+            break;
+        }
+
+        // A single source per target, a stalled transfer ends the session
+        _mirrors = &targets[i].uRL;
+        _mirrorCount = 1;
+        _mirrorPosition = 0;
+        _rankingTime = 0;
+
+        _blankEnd = UpdateOTAImageRecord::loadBlankEnd(_newPartition);
+        UpdateOTAImageRecord::clear(_newPartition);
+        _streamLength = _httpClient->getSize();
+        _bytesCompleted = 0;
+        if (verifySignature)
+            _signature.begin();
+        Log_Verbose(_logger, "UpdateOTA startUpdate: Target %u to partition '%s', Size=%u", i, _newPartition->label, _streamLength);
+        err = updateFirmware();
+        if (err == UpdateOTAError::SUCCESS)
+            err = verifyImage(_streamLength, verifySignature);
+    }
+    endSession();
+    _mirrors = nullptr;
+
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        Log_Error(_logger, "UpdateOTA startUpdate error: Session failed, ErrorCode=%d", err);
+        return recordResult(err);
+    }
+
+    if (appPartition == nullptr)
+        return recordResult(UpdateOTAError::SUCCESS);
+
+    _newPartition = appPartition;
+    _isFirmware = true;
+    return recordResult(activateImage());
+}
+
+bool UpdateOTA::isSameOrigin(const char *uRL, const char *otherURL)
+{
+    // Scheme, host and port: everything up to the first '/' after "://"
+    const char *authority = strstr(uRL, "://");
+    if (authority == nullptr)
+        return false;
+    size_t length = authority + 3 - uRL;
+    length += strcspn(uRL + length, "/");
+    return strncmp(uRL, otherURL, length) == 0 && (otherURL[length] == '/' || otherURL[length] == '\0');
+}
+
+#if UPDATE_OTA_BUNDLE
+UpdateOTAError UpdateOTA::startBundleUpdate(const char *uRL)
+{
+    Log_Verbose(_logger, "UpdateOTA startBundleUpdate: URL='%s'", uRL);
+    _lastResult = {};
+    _httpCode = 0;
+
+    // Check if the device is connected to the internet
+    if (WiFi.status() != WL_CONNECTED)
+    {
+        Log_Error(_logger, "UpdateOTA startBundleUpdate error: No internet connection");
+        return recordResult(UpdateOTAError::NO_INTERNET);
+    }
+
+    bool verifySignature = _signature.hasPublicKey();
+    if (!verifySignature && strncmp(uRL, "http://", 7) == 0)
+    {
+        Log_Error(_logger, "UpdateOTA startBundleUpdate error: Plain HTTP source requires a signing key");
+        return recordResult(UpdateOTAError::SIGNATURE_INVALID);
+    }
+
+    UpdateOTAError err = UpdateOTAError::SUCCESS;
+    _uRL = uRL;
+    beginSession();
+    if (verifySignature)
+    {
+        err = fetchSignature();
+        _signature.begin();
+    }
+    if (err == UpdateOTAError::SUCCESS)
+        err = processGetRequest();
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        endSession();
+        return recordResult(err);
+    }
+
+    // Index: header and entries, checked against the partition table before any write
+    UpdateOTABundleHeader header;
+    UpdateOTABundleEntry entries[MAX_TARGETS];
+    const esp_partition_t *partitions[MAX_TARGETS];
+    const esp_partition_t *appPartition = nullptr;
+    uint32_t total = sizeof(header);
+    if (!readStream(&header, sizeof(header), verifySignature) || header.magic != BUNDLE_MAGIC ||
+        header.count == 0 || header.count > MAX_TARGETS ||
+        !readStream(entries, header.count * sizeof(UpdateOTABundleEntry), verifySignature))
+    {
+        Log_Error(_logger, "UpdateOTA startBundleUpdate error: Invalid bundle index");
+        endSession();
+        return recordResult(UpdateOTAError::BAD_REQUEST);
+    }
+    total += header.count * sizeof(UpdateOTABundleEntry);
+
+    for (uint8_t i = 0; i < header.count && err == UpdateOTAError::SUCCESS; i++)
+    {
+        char label[sizeof(entries[i].label) + 1] = {0};
+        memcpy(label, entries[i].label, sizeof(entries[i].label));
+        UpdateOTATarget target = {uRL, (esp_partition_type_t)entries[i].type, (esp_partition_subtype_t)entries[i].subtype,
+                                  label[0] != '\0' ? label : nullptr};
+        partitions[i] = findTargetPartition(target);
+        if (partitions[i] == nullptr)
+            err = UpdateOTAError::NO_PARTITION_AVAILABLE;
+        else if (entries[i].length > partitions[i]->size)
+            err = UpdateOTAError::NO_ENOUGH_SPACE;
+        for (uint8_t j = 0; j < i && err == UpdateOTAError::SUCCESS; j++)
+        {
+            if (partitions[j] == partitions[i])
+                err = UpdateOTAError::BAD_REQUEST;
+        }
+        if (err != UpdateOTAError::SUCCESS)
+        {
+            Log_Error(_logger, "UpdateOTA startBundleUpdate error: Entry %u cannot be written, ErrorCode=%d", i, err);
+            break;
+        }
+        if (partitions[i]->type == ESP_PARTITION_TYPE_APP && appPartition != nullptr)
+        {
+            Log_Error(_logger, "UpdateOTA startBundleUpdate error: More than one app entry");
+            err = UpdateOTAError::BAD_REQUEST;
+            break;
+        }
+        if (partitions[i]->type == ESP_PARTITION_TYPE_APP)
+            appPartition = partitions[i];
+        total += entries[i].length;
+    }
+    if (err == UpdateOTAError::SUCCESS && (uint32_t)_httpClient->getSize() != total)
+    {
+        Log_Error(_logger, "UpdateOTA startBundleUpdate error: Bundle length %d does not match its index (%u)", _httpClient->getSize(), total);
+        err = UpdateOTAError::BAD_REQUEST;
+    }
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        endSession();
+        return recordResult(err);
+    }
+
+    // Route each payload into its partition as it streams
+    setIndicator(true);
+    UpdateOTAPartitionWriter writer;
+    _qosTokens = INT32_MAX;
+    _qosRefillTime = esp_timer_get_time();
+    uint32_t received = sizeof(header) + header.count * sizeof(UpdateOTABundleEntry);
+    for (uint8_t i = 0; i < header.count && err == UpdateOTAError::SUCCESS; i++)
+    {
+        Log_Verbose(_logger, "UpdateOTA startBundleUpdate: Entry %u to partition '%s', Size=%u", i, partitions[i]->label, entries[i].length);
+        UpdateOTAImageRecord::clear(partitions[i]);
+        writer.begin(partitions[i]);
+        uint32_t remaining = entries[i].length;
+        while (remaining > 0)
+        {
+            uint32_t blockStart = millis();
+            printProgress(received, total);
+            toggleLed();
+            size_t length = remaining < BLOCK_SIZE_P ? remaining : BLOCK_SIZE_P;
+            if (!readStream(_buffer, length, verifySignature))
+            {
+                Log_Error(_logger, "UpdateOTA startBundleUpdate error: Entry %u interrupted at offset=%u", i, (unsigned)writer.offset());
+                err = UpdateOTAError::UPDATE_PROGRESS_ERROR;
+                break;
+            }
+            if (partitions[i]->type == ESP_PARTITION_TYPE_APP && writer.offset() == 0 &&
+                (err = checkImageHeader((const uint8_t *)_buffer, length)) != UpdateOTAError::SUCCESS)
+                break; // Before anything of the slot is written.
+            if (!writer.write(_buffer, length))
+            {
+                Log_Error(_logger, "UpdateOTA startBundleUpdate error: Entry %u interrupted at offset=%u", i, (unsigned)writer.offset());
+                err = UpdateOTAError::UPDATE_PROGRESS_ERROR;
+                break;
+            }
+            remaining -= length;
+            received += length;
+            throttle(length, blockStart);
+        }
+    }
+    printProgress(received, total);
+    setIndicator(false);
+    endSession();
+
+    if (err == UpdateOTAError::SUCCESS && verifySignature && !_signature.verify())
+    {
+        // Keep the old firmware and stop filesystems from mounting the unverified data, the previous
+        // content of the data partitions is already overwritten
+        Log_Error(_logger, "UpdateOTA startBundleUpdate error: Bundle signature verification failed");
+        for (uint8_t i = 0; i < header.count; i++)
+        {
+            if (partitions[i]->type != ESP_PARTITION_TYPE_APP)
+                esp_partition_erase_range(partitions[i], 0, BLOCK_SIZE_P);
+        }
+        err = UpdateOTAError::SIGNATURE_INVALID;
+    }
+    if (err != UpdateOTAError::SUCCESS || appPartition == nullptr)
+        return recordResult(err);
+
+    _newPartition = appPartition;
+    _isFirmware = true;
+    return recordResult(activateImage());
+}
+#endif
+
+#if UPDATE_OTA_SPARSE
+UpdateOTAError UpdateOTA::startSparseUpdate(const char *uRL, bool isFirmware)
+{
+    Log_Verbose(_logger, "UpdateOTA startSparseUpdate: URL='%s', isFirmware=%s", uRL, isFirmware ? "true" : "false");
+    _isFirmware = isFirmware;
+    _lastResult = {};
+    _httpCode = 0;
+
+    // Check if the device is connected to the internet
+    if (WiFi.status() != WL_CONNECTED)
+    {
+        Log_Error(_logger, "UpdateOTA startSparseUpdate error: No internet connection");
+        return recordResult(UpdateOTAError::NO_INTERNET);
+    }
+
+    bool verifySignature = _signature.hasPublicKey();
+    if (!verifySignature && strncmp(uRL, "http://", 7) == 0)
+    {
+        Log_Error(_logger, "UpdateOTA startSparseUpdate error: Plain HTTP source requires a signing key");
+        return recordResult(UpdateOTAError::SIGNATURE_INVALID);
+    }
+
+    UpdateOTAError err = UpdateOTAError::SUCCESS;
+    _uRL = uRL;
+    beginSession();
+    if (verifySignature)
+    {
+        err = fetchSignature();
+        _signature.begin();
+    }
+    if (err == UpdateOTAError::SUCCESS)
+        err = processGetRequest();
+    if (err == UpdateOTAError::SUCCESS)
+        err = selectPartition();
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        endSession();
+        return recordResult(err);
+    }
+
+    UpdateOTASparseHeader header;
+    int32_t remaining = _httpClient->getSize() - sizeof(header);
+    if (remaining < 0 || !readStream(&header, sizeof(header), false) || header.magic != SPARSE_MAGIC)
+    {
+        Log_Error(_logger, "UpdateOTA startSparseUpdate error: Not a sparse image");
+        endSession();
+        return recordResult(UpdateOTAError::BAD_REQUEST);
+    }
+    if (header.imageSize > _newPartition->size)
+    {
+        Log_Error(_logger, "UpdateOTA startSparseUpdate error: Image size %u exceeds partition '%s'", header.imageSize, _newPartition->label);
+        endSession();
+        return recordResult(UpdateOTAError::NO_ENOUGH_SPACE);
+    }
+
+    // Write the extents, skipping and erasing the blank ranges in between
+    UpdateOTAImageRecord::clear(_newPartition);
+    setIndicator(true);
+    UpdateOTAPartitionWriter writer;
+    writer.begin(_newPartition);
+    _qosTokens = INT32_MAX;
+    _qosRefillTime = esp_timer_get_time();
+    uint32_t transferred = 0;
+    while (remaining > 0 && err == UpdateOTAError::SUCCESS)
+    {
+        UpdateOTASparseExtent extent;
+        if (remaining < (int32_t)sizeof(extent) || !readStream(&extent, sizeof(extent), false) ||
+            extent.offset < writer.offset() || extent.length > remaining - sizeof(extent) ||
+            extent.offset > header.imageSize || extent.length > header.imageSize - extent.offset)
+        {
+            Log_Error(_logger, "UpdateOTA startSparseUpdate error: Invalid extent at offset=%u", (unsigned)writer.offset());
+            err = UpdateOTAError::BAD_REQUEST;
+            break;
+        }
+        remaining -= sizeof(extent) + extent.length;
+
+        // The image header is never blank, a firmware starts with an extent at offset zero
+        if (_isFirmware && writer.offset() == 0 && extent.offset != 0)
+        {
+            Log_Error(_logger, "UpdateOTA startSparseUpdate error: Firmware without image header");
+            err = UpdateOTAError::INVALID_IMAGE;
+            break;
+        }
+
+        if (verifySignature)
+            hashBlankRange(extent.offset - writer.offset());
+        if (!writer.skipTo(extent.offset))
+            err = UpdateOTAError::UPDATE_PROGRESS_ERROR;
+
+        uint32_t length = extent.length;
+        while (length > 0 && err == UpdateOTAError::SUCCESS)
+        {
+            uint32_t blockStart = millis();
+            printProgress(writer.offset(), header.imageSize);
+            toggleLed();
+            size_t chunk = length < BLOCK_SIZE_P ? length : BLOCK_SIZE_P;
+            if (!readStream(_buffer, chunk, verifySignature))
+                err = UpdateOTAError::UPDATE_PROGRESS_ERROR;
+            else if (_isFirmware && writer.offset() == 0)
+                err = checkImageHeader((const uint8_t *)_buffer, chunk); // Before anything of the slot is written.
+            if (err == UpdateOTAError::SUCCESS && !writer.write(_buffer, chunk))
+                err = UpdateOTAError::UPDATE_PROGRESS_ERROR;
+            if (err == UpdateOTAError::UPDATE_PROGRESS_ERROR)
+                Log_Error(_logger, "UpdateOTA startSparseUpdate error: Interrupted at offset=%u", (unsigned)writer.offset());
+            length -= chunk;
+            transferred += chunk;
+            throttle(chunk, blockStart);
+        }
+    }
+
+    // Blank tail
+    if (err == UpdateOTAError::SUCCESS)
+    {
+        if (verifySignature)
+            hashBlankRange(header.imageSize - writer.offset());
+        if (!writer.skipTo(header.imageSize))
+            err = UpdateOTAError::UPDATE_PROGRESS_ERROR;
+    }
+    printProgress(writer.offset(), header.imageSize);
+    setIndicator(false);
+    endSession();
+
+    if (err != UpdateOTAError::SUCCESS)
+        return recordResult(err);
+
+    Log_Verbose(_logger, "UpdateOTA startSparseUpdate: Image=%u, Transferred=%u", header.imageSize, transferred);
+    return recordResult(finishUpdate(header.imageSize, verifySignature));
+}
+#endif
+
+UpdateOTAError UpdateOTA::checkAnnouncedVersion()
+{
+    // Servers without the header stream the image, the image header check still applies
+    String announced = _httpClient->header("X-Firmware-Version");
+    const char *runningVersion = esp_ota_get_app_description()->version;
+    UpdateOTASemver published, running;
+    if (announced.length() == 0 || !UpdateOTAVersion::parse(announced.c_str(), &published) || !UpdateOTAVersion::parse(runningVersion, &running))
+        return UpdateOTAError::SUCCESS;
+
+    int8_t order = UpdateOTAVersion::compare(published, running);
+    if (order < 0 || (order == 0 && !_allowReinstall))
+    {
+        Log_Verbose(_logger, "UpdateOTA checkAnnouncedVersion: Announced='%s', Running='%s', no update", announced.c_str(), runningVersion);
+        return UpdateOTAError::NO_UPDATE_AVAILABLE;
+    }
+
+    Log_Verbose(_logger, "UpdateOTA checkAnnouncedVersion: Announced='%s', Running='%s', downloading", announced.c_str(), runningVersion);
+    return UpdateOTAError::SUCCESS;
+}
+
+UpdateOTAError UpdateOTA::checkImageHeader(const uint8_t *block, size_t length)
+{
+    // The app descriptor follows the image header and the first segment header
+    const size_t descOffset = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t);
+    if (length < descOffset + sizeof(esp_app_desc_t))
+    {
+        Log_Error(_logger, "UpdateOTA checkImageHeader error: Image shorter than its header");
+        return UpdateOTAError::INVALID_IMAGE;
+    }
+
+    esp_image_header_t header;
+    esp_app_desc_t desc;
+    memcpy(&header, block, sizeof(header));
+    memcpy(&desc, block + descOffset, sizeof(desc));
+    const esp_app_desc_t *running = esp_ota_get_app_description();
+
+    if (header.magic != ESP_IMAGE_HEADER_MAGIC || desc.magic_word != ESP_APP_DESC_MAGIC_WORD)
+    {
+        Log_Error(_logger, "UpdateOTA checkImageHeader error: No ESP application image, Magic=0x%02X", header.magic);
+        return UpdateOTAError::INVALID_IMAGE;
+    }
+    if (header.chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID)
+    {
+        Log_Error(_logger, "UpdateOTA checkImageHeader error: Image for chip %u, running on chip %u", header.chip_id, CONFIG_IDF_FIRMWARE_CHIP_ID);
+        return UpdateOTAError::INVALID_IMAGE;
+    }
+    if (strncmp(desc.project_name, running->project_name, sizeof(desc.project_name)) != 0)
+    {
+        Log_Error(_logger, "UpdateOTA checkImageHeader error: Image of project '%.32s', running '%.32s'", desc.project_name, running->project_name);
+        return UpdateOTAError::INVALID_IMAGE;
+    }
+    if (!_allowReinstall && strncmp(desc.version, running->version, sizeof(desc.version)) == 0)
+    {
+        Log_Error(_logger, "UpdateOTA checkImageHeader error: Image has the running version '%.32s'", desc.version);
+        return UpdateOTAError::INVALID_IMAGE;
+    }
+
+    Log_Verbose(_logger, "UpdateOTA checkImageHeader: Project='%.32s', Version='%.32s'", desc.project_name, desc.version);
+    return UpdateOTAError::SUCCESS;
+}
+
+UpdateOTAError UpdateOTA::hashPartition(uint32_t imageLength)
+{
+    _signature.begin();
+    for (uint32_t offset = 0; offset < imageLength; offset += BLOCK_SIZE_P)
+    {
+        size_t length = imageLength - offset < BLOCK_SIZE_P ? imageLength - offset : BLOCK_SIZE_P;
+        esp_err_t flashErr = esp_partition_read(_newPartition, offset, _buffer, length);
+        if (flashErr != ESP_OK)
+        {
+            Log_Error(_logger, "UpdateOTA hashPartition error: Flash read failed at offset=%u, ErrorCode=%d", offset, flashErr);
+            return UpdateOTAError::FLASH_ERROR;
+        }
+        _signature.update((const uint8_t *)_buffer, length);
+    }
+    return UpdateOTAError::SUCCESS;
+}
+
+#if UPDATE_OTA_SPARSE
+void UpdateOTA::hashBlankRange(size_t length)
+{
+    memset(_buffer, 0xFF, BLOCK_SIZE_P);
+    while (length > 0)
+    {
+        size_t chunk = length < BLOCK_SIZE_P ? length : BLOCK_SIZE_P;
+        _signature.update((const uint8_t *)_buffer, chunk);
+        length -= chunk;
+    }
+}
+#endif
+
+#if UPDATE_OTA_BUNDLE || UPDATE_OTA_SPARSE
+bool UpdateOTA::readStream(void *data, size_t length, bool verifySignature)
+{
+    if (_wifiClient->readBytes((char *)data, length) != length)
+        return false;
+    if (verifySignature)
+        _signature.update((const uint8_t *)data, length);
+    return true;
+}
+#endif
+
+const esp_partition_t *UpdateOTA::findTargetPartition(const UpdateOTATarget &target)
+{
+    const esp_partition_t *partition = nullptr;
+    if (target.type == ESP_PARTITION_TYPE_APP && target.label == nullptr)
+        partition = esp_ota_get_next_update_partition(nullptr);
+    else
+        partition = esp_partition_find_first(target.type, target.subtype, target.label);
+
+#if UPDATE_OTA_BACKGROUND_STAGING
+    // Labeled or bundled app targets may be the slot being staged as well
+    if (target.type == ESP_PARTITION_TYPE_APP)
+        cancelBackgroundStaging();
+#endif
+
+    // Never overwrite the firmware that is running
+    if (partition == esp_ota_get_running_partition())
+        return nullptr;
+    return partition;
+}
+
+UpdateOTAError UpdateOTA::downloadImage(const char *const *uRLs, uint8_t count, bool verifySignature)
+{
+    // Start with the fastest mirror
+    rankMirrors(uRLs, count);
+    _mirrorPosition = 0;
+    _uRL = _mirrors[_mirrorRanking[0]];
+
+    UpdateOTAError err = UpdateOTAError::SUCCESS;
+    bool conditional = _conditionalDownload && _isFirmware;
+
+    // Fetch the detached signature before the image, conditional requests fetch it after
+    if (verifySignature && _bytesCompleted == 0 && !conditional)
+    {
+        err = fetchSignature();
+        if (err != UpdateOTAError::SUCCESS)
+        {
+            Log_Error(_logger, "UpdateOTA downloadImage error: Failed to fetch signature, ErrorCode=%d", err);
+            return err;
+        }
+    }
+
+    // Initialize WiFiClient and HTTPClient
+    beginSession();
+
+    // Process the GET request, resuming after the blocks a previous attempt completed
+    char range[24];
+    snprintf(range, sizeof(range), "bytes=%u-", _bytesCompleted.load());
+    err = processGetRequest(_bytesCompleted > 0 ? range : nullptr, nullptr, conditional && _bytesCompleted == 0);
+    if (err == UpdateOTAError::SUCCESS && conditional && _bytesCompleted == 0)
+        err = checkAnnouncedVersion();
+    if (err == UpdateOTAError::NO_UPDATE_AVAILABLE)
+    {
+        // Closed before the body, the check cost one request
+        endSession();
+        return err;
+    }
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        Log_Error(_logger, "UpdateOTA downloadImage error: Failed to process GET request, ErrorCode=%d", err);
+        endSession();
+        return err;
+    }
+
+    if (_bytesCompleted > 0)
+    {
+        if (_httpCode == HTTP_CODE_PARTIAL_CONTENT && (uint32_t)_httpClient->getSize() == _streamLength - _bytesCompleted)
+        {
+            Log_Verbose(_logger, "UpdateOTA downloadImage: Resuming at offset=%u", _bytesCompleted.load());
+            err = updateFirmware();
+            if (err == UpdateOTAError::SUCCESS && conditional && verifySignature)
+                err = fetchSignature();
+            endSession();
+            return err;
+        }
+
+        // The server ignored the range or the image changed, start over
+        Log_Verbose(_logger, "UpdateOTA downloadImage: Resume not possible, restarting the download");
+        _bytesCompleted = 0;
+        if (_httpCode != HTTP_CODE_OK)
+        {
+            endSession();
+            return UpdateOTAError::UPDATE_PROGRESS_ERROR;
+        }
+    }
+
+    // Check if there is enough space for the firmware
+    uint64_t maxSketchSpace = ESP.getFreeSketchSpace() - (ESP.getFreeSketchSpace() % BLOCK_SIZE_P);
+    if (_httpClient->getSize() > maxSketchSpace)
+    {
+        endSession();
+        return UpdateOTAError::NO_ENOUGH_SPACE;
+    }
+
+    // Get the next updatable partition and check if there is a partition available for update
+    err = selectPartition();
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        Log_Error(_logger, "UpdateOTA downloadImage error: Insufficient space for update");
+        endSession();
+        return err;
+    }
+
+    // The partition content is about to change, forget the verified image it held
+    _blankEnd = UpdateOTAImageRecord::loadBlankEnd(_newPartition);
+    UpdateOTAImageRecord::clear(_newPartition);
+
+    // Update the firmware
+    _streamLength = _httpClient->getSize();
+    UpdateOTATrace::record(UpdateOTATraceEvent::DOWNLOAD_START, 0, _streamLength / 1024);
+    if (conditional)
+    {
+        // Saved by finishUpdate() once the image is verified
+        strncpy(_pendingETag, _httpClient->header("ETag").c_str(), sizeof(_pendingETag) - 1);
+        _pendingETag[sizeof(_pendingETag) - 1] = '\0';
+    }
+    if (verifySignature)
+        _signature.begin();
+    err = updateFirmware();
+
+    // The signature follows over the kept-alive connection
+    if (err == UpdateOTAError::SUCCESS && conditional && verifySignature)
+        err = fetchSignature();
+    endSession();
+    return err;
+}
+
+#if UPDATE_OTA_MULTICAST
+UpdateOTAError UpdateOTA::startMulticastUpdate(IPAddress group, uint16_t port, bool isFirmware, uint32_t timeoutMs)
+{
+    Log_Verbose(_logger, "UpdateOTA startMulticastUpdate: Group=%s, Port=%u, isFirmware=%s", group.toString().c_str(), port, isFirmware ? "true" : "false");
+
+    _isFirmware = isFirmware;
+    _lastResult = {};
+    _httpCode = 0;
+
+    // Check if the device is connected to the network
+    if (WiFi.status() != WL_CONNECTED)
+    {
+        Log_Error(_logger, "UpdateOTA startMulticastUpdate error: No internet connection");
+        return recordResult(UpdateOTAError::NO_INTERNET);
+    }
+
+    // Any host on the network can send to the group, only a signed image may be flashed
+    if (!_signature.hasPublicKey())
+    {
+        Log_Error(_logger, "UpdateOTA startMulticastUpdate error: Multicast source requires a signing key");
+        return recordResult(UpdateOTAError::SIGNATURE_INVALID);
+    }
+
+    // Get the partition the decoded blocks are written to
+    UpdateOTAError err = selectPartition();
+    if (err != UpdateOTAError::SUCCESS)
+        return recordResult(err);
+
+    // The decoder holds FOUNTAIN_SLOTS blocks, keep it off the stack and out of this instance
+    UpdateOTAFountainDecoder *decoder = new (std::nothrow) UpdateOTAFountainDecoder();
+    if (decoder == nullptr)
+    {
+        Log_Error(_logger, "UpdateOTA startMulticastUpdate error: Not enough memory for the decoder");
+        return recordResult(UpdateOTAError::NO_ENOUGH_SPACE);
+    }
+
+    WiFiUDP udp;
+    if (!udp.beginMulticast(group, port))
+    {
+        Log_Error(_logger, "UpdateOTA startMulticastUpdate error: Failed to join multicast group");
+        delete decoder;
+        return recordResult(UpdateOTAError::NO_INTERNET);
+    }
+
+    // The partition content is about to change, forget the verified image it held
+    UpdateOTAImageRecord::clear(_newPartition);
+
+    uint32_t imageLength = 0;
+    err = receiveMulticastImage(udp, *decoder, timeoutMs, &imageLength);
+    udp.stop();
+    delete decoder;
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        Log_Error(_logger, "UpdateOTA startMulticastUpdate error: Failed to receive image, ErrorCode=%d", err);
+        return recordResult(err);
+    }
+
+    // Blocks arrive out of order, so the signature is checked on the image in flash
+    if ((err = hashPartition(imageLength)) != UpdateOTAError::SUCCESS)
+        return recordResult(err);
+
+    return recordResult(finishUpdate(imageLength, true));
+}
+#endif
+
+#if UPDATE_OTA_FILE_SYNC
+UpdateOTAError UpdateOTA::syncFileSystem(fs::FS &fs, const char *manifestURL, const char *baseURL)
+{
+    Log_Verbose(_logger, "UpdateOTA syncFileSystem: Manifest='%s', Base='%s'", manifestURL, baseURL);
+    _lastResult = {};
+    _httpCode = 0;
+
+    if (manifestURL == nullptr || baseURL == nullptr || baseURL[0] == '\0')
+    {
+        Log_Error(_logger, "UpdateOTA syncFileSystem error: Manifest or base URL missing");
+        return recordResult(UpdateOTAError::BAD_REQUEST);
+    }
+
+    // A sync cut off during a swap left the old file as a backup
+    restoreBackups(fs, "/");
+
+    // Check if the device is connected to the internet
+    if (WiFi.status() != WL_CONNECTED)
+    {
+        Log_Error(_logger, "UpdateOTA syncFileSystem error: No internet connection");
+        return recordResult(UpdateOTAError::NO_INTERNET);
+    }
+
+    // The manifest authenticates every file, plain HTTP needs its signature
+    bool verifySignature = _signature.hasPublicKey();
+    if (!verifySignature && strncmp(manifestURL, "http://", 7) == 0)
+    {
+        Log_Error(_logger, "UpdateOTA syncFileSystem error: Plain HTTP source requires a signing key");
+        return recordResult(UpdateOTAError::SIGNATURE_INVALID);
+    }
+
+    UpdateOTAError err = UpdateOTAError::SUCCESS;
+    _uRL = manifestURL;
+    if (verifySignature)
+    {
+        err = fetchSignature();
+        if (err != UpdateOTAError::SUCCESS)
+            return recordResult(err);
+        _signature.begin();
+    }
+
+    // Keep the manifest on the filesystem, it is read twice and may be larger than the RAM. The
+    // manifest of the last complete sync stays next to it to tell removed files from the application's.
+    uint8_t digest[32];
+    const String manifestPath = FILE_SYNC_MANIFEST FILE_SYNC_TEMP_SUFFIX;
+    fs::File manifest = fs.open(manifestPath, FILE_WRITE);
+    if (!manifest)
+    {
+        Log_Error(_logger, "UpdateOTA syncFileSystem error: Cannot create '%s'", manifestPath.c_str());
+        return recordResult(UpdateOTAError::NO_ENOUGH_SPACE);
+    }
+    err = downloadFile(manifest, digest, verifySignature);
+    manifest.close();
+    if (err == UpdateOTAError::SUCCESS && verifySignature && !_signature.verify())
+    {
+        Log_Error(_logger, "UpdateOTA syncFileSystem error: Manifest signature verification failed");
+        err = UpdateOTAError::SIGNATURE_INVALID;
+    }
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        fs.remove(manifestPath);
+        return recordResult(err);
+    }
+
+    // The partition no longer holds the image that was recorded for it
+    UpdateOTAImageRecord::clear(esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, nullptr));
+
+    // Download the files that changed
+    uint16_t unchanged = 0;
+    uint16_t downloaded = 0;
+    uint16_t listed = 0;
+    UpdateOTAFileEntry entry;
+    manifest = fs.open(manifestPath, FILE_READ);
+    while (err == UpdateOTAError::SUCCESS && manifest.available())
+    {
+        String line = manifest.readStringUntil('\n');
+        if (!UpdateOTAFileManifest::parseLine(line.c_str(), &entry))
+            continue;
+        listed++;
+
+        fs::File file = fs.open(entry.path, FILE_READ);
+        if (file && !file.isDirectory() && file.size() == entry.size)
+        {
+            hashFile(file, digest);
+            if (memcmp(digest, entry.sha256, sizeof(digest)) == 0)
+            {
+                file.close();
+                unchanged++;
+                continue;
+            }
+        }
+        file.close();
+
+        // Download next to the old file and swap them once the content is verified
+        String temporaryPath = String(entry.path) + FILE_SYNC_TEMP_SUFFIX;
+        file = fs.open(temporaryPath, FILE_WRITE, true);
+        if (!file)
+        {
+            Log_Error(_logger, "UpdateOTA syncFileSystem error: Cannot create '%s'", temporaryPath.c_str());
+            err = UpdateOTAError::NO_ENOUGH_SPACE;
+            break;
+        }
+        const char *relativePath = baseURL[strlen(baseURL) - 1] == '/' ? entry.path + 1 : entry.path;
+        String fileURL = String(baseURL) + relativePath;
+        _uRL = fileURL.c_str();
+        err = downloadFile(file, digest, false);
+        size_t size = file.size();
+        file.close();
+        if (err == UpdateOTAError::SUCCESS && (size != entry.size || memcmp(digest, entry.sha256, sizeof(digest)) != 0))
+        {
+            Log_Error(_logger, "UpdateOTA syncFileSystem error: '%s' does not match the manifest", entry.path);
+            err = UpdateOTAError::UPDATE_PROGRESS_ERROR;
+        }
+        if (err == UpdateOTAError::SUCCESS && !replaceFile(fs, temporaryPath, entry.path))
+        {
+            Log_Error(_logger, "UpdateOTA syncFileSystem error: Cannot replace '%s'", entry.path);
+            err = UpdateOTAError::NO_ENOUGH_SPACE;
+        }
+        if (err != UpdateOTAError::SUCCESS)
+        {
+            fs.remove(temporaryPath);
+            break;
+        }
+        downloaded++;
+        Log_Verbose(_logger, "UpdateOTA syncFileSystem: Updated '%s', Size=%u", entry.path, entry.size);
+    }
+    manifest.close();
+
+    // Delete what the manifest no longer lists, only after a complete sync, then keep the manifest
+    // as the reference of the next sync
+    uint16_t removed = 0;
+    if (err == UpdateOTAError::SUCCESS)
+    {
+        removed = removeStaleFiles(fs, manifestPath, listed);
+        if (!replaceFile(fs, manifestPath, FILE_SYNC_MANIFEST))
+        {
+            Log_Error(_logger, "UpdateOTA syncFileSystem error: Cannot replace '%s'", FILE_SYNC_MANIFEST);
+            err = UpdateOTAError::NO_ENOUGH_SPACE;
+        }
+    }
+    fs.remove(manifestPath);
+
+    Log_Verbose(_logger, "UpdateOTA syncFileSystem: Unchanged=%u, Downloaded=%u, Removed=%u, ErrorCode=%d", unchanged, downloaded, removed, err);
+    return recordResult(err);
+}
+#endif
+
+UpdateOTAError UpdateOTA::getVersionNumber(const char *uRL, char *buffer, uint8_t bufferSize)
+{
+    Log_Verbose(_logger, "UpdateOTA getVersionNumber: URL='%s', BufferSize=%u", uRL, bufferSize);
+    _lastResult = {};
+    _httpCode = 0;
+
+    if (buffer == nullptr || bufferSize == 0)
+    {
+        Log_Error(_logger, "UpdateOTA getVersionNumber error: Invalid version buffer");
+        return recordResult(UpdateOTAError::BAD_REQUEST);
+    }
+
+    UpdateOTAError err = fetchText(uRL, buffer, bufferSize);
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        Log_Error(_logger, "UpdateOTA getVersionNumber error: Failed to get the version, ErrorCode=%d", err);
+        return recordResult(err);
+    }
+
+    Log_Verbose(_logger, "UpdateOTA getVersionNumber: Version retrieved successfully");
+    return recordResult(UpdateOTAError::SUCCESS);
+}
+
+UpdateOTAError UpdateOTA::getUpdateManifest(const char *uRL, UpdateOTAManifest *manifest)
+{
+    Log_Verbose(_logger, "UpdateOTA getUpdateManifest: URL='%s'", uRL);
+    _lastResult = {};
+    _httpCode = 0;
+
+    // The manifest is a version file with optional rollout lines, all of them must fit
+    char text[MANIFEST_MAX_SIZE];
+    UpdateOTAError err = fetchText(uRL, text, sizeof(text));
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        Log_Error(_logger, "UpdateOTA getUpdateManifest error: Failed to get the manifest, ErrorCode=%d", err);
+        return recordResult(err);
+    }
+
+    if (!UpdateOTARollout::parseManifest(text, manifest))
+    {
+        Log_Error(_logger, "UpdateOTA getUpdateManifest error: Manifest has no version");
+        return recordResult(UpdateOTAError::UNKNOWN);
+    }
+
+    Log_Verbose(_logger, "UpdateOTA getUpdateManifest: Version='%s', Rollout='%s', Window=%us",
+                manifest->version, manifest->rolloutId, manifest->windowSec);
+    return recordResult(UpdateOTAError::SUCCESS);
+}
+
+UpdateOTAError UpdateOTA::checkForUpdate(const char *uRL, UpdateOTAVersionOrder *order)
+{
+    UpdateOTAManifest manifest;
+    UpdateOTAError err = getUpdateManifest(uRL, &manifest);
+    if (err != UpdateOTAError::SUCCESS)
+        return err;
+
+    // Parsed in place, the versions stay in the manifest and the app descriptor
+    const char *runningVersion = esp_ota_get_app_description()->version;
+    UpdateOTASemver published, running;
+    if (!UpdateOTAVersion::parse(manifest.version, &published) || !UpdateOTAVersion::parse(runningVersion, &running))
+    {
+        Log_Error(_logger, "UpdateOTA checkForUpdate error: Version '%s' or '%s' is no semantic version", manifest.version, runningVersion);
+        return recordResult(UpdateOTAError::UNKNOWN);
+    }
+
+    *order = (UpdateOTAVersionOrder)UpdateOTAVersion::compare(published, running);
+    Log_Verbose(_logger, "UpdateOTA checkForUpdate: Published='%s', Running='%s', Order=%d", manifest.version, runningVersion, (int)*order);
+    return UpdateOTAError::SUCCESS;
+}
+
+bool UpdateOTA::isRolloutDue(const UpdateOTAManifest &manifest)
+{
+    // No rollout window: every device may update now
+    if (manifest.rolloutId[0] == '\0' || manifest.windowSec == 0)
+        return true;
+
+    uint8_t mac[6];
+    WiFi.macAddress(mac);
+    uint32_t slot = UpdateOTARollout::slotOffsetSec(mac, manifest.rolloutId, manifest.windowSec);
+
+    // Wall clock when the server announced a start and the clock is synchronized
+    time_t now = time(nullptr);
+    if (manifest.startEpoch != 0 && now > CLOCK_VALID_EPOCH)
+    {
+        Log_Verbose(_logger, "UpdateOTA isRolloutDue: Slot=%us after start, Remaining=%ds", slot, (int32_t)(manifest.startEpoch + slot - now));
+        return (uint64_t)now >= (uint64_t)manifest.startEpoch + slot;
+    }
+
+    // Otherwise count from the first time this rollout was seen
+    if (strncmp(_rolloutId, manifest.rolloutId, sizeof(_rolloutId)) != 0)
+    {
+        strncpy(_rolloutId, manifest.rolloutId, sizeof(_rolloutId) - 1);
+        _rolloutFirstSeen = millis();
+    }
+    Log_Verbose(_logger, "UpdateOTA isRolloutDue: Slot=%us after first check", slot);
+    return (uint64_t)(millis() - _rolloutFirstSeen) >= (uint64_t)slot * 1000;
+}
+
+void UpdateOTA::errorToString(UpdateOTAError error, char *buffer, uint8_t bufferSize)
+{
+    if (buffer == nullptr || bufferSize < 50)
+    {
+        Log_Error(_logger, "Invalid error string buffer");
+        return;
+    }
+    // Convert an update OTA error to a human-readable string and store it in the provided buffer
+    switch (error)
+    {
+    case UpdateOTAError::SUCCESS:
+        strncpy(buffer, "No error occurred.", bufferSize);
+        break;
+    case UpdateOTAError::NO_INTERNET:
+        strncpy(buffer, "No internet connection.", bufferSize);
+        break;
+    case UpdateOTAError::BAD_REQUEST:
+        strncpy(buffer, "Bad request received.", bufferSize);
+        break;
+    case UpdateOTAError::UNAUTHORIZED:
+        strncpy(buffer, "Unauthorized access.", bufferSize);
+        break;
+    case UpdateOTAError::PAGE_NOT_FOUND:
+        strncpy(buffer, "Page(URL) not found.", bufferSize);
+        break;
+    case UpdateOTAError::NO_PARTITION_AVAILABLE:
+        strncpy(buffer, "No partition available for update.", bufferSize);
+        break;
+    case UpdateOTAError::PARTITION_NOT_BOOTABLE:
+        strncpy(buffer, "Selected partition is not bootable.", bufferSize);
+        break;
+    case UpdateOTAError::UPDATE_PROGRESS_ERROR:
+        strncpy(buffer, "Error in update progress.", bufferSize);
+        break;
+    case UpdateOTAError::NO_ENOUGH_SPACE:
+        strncpy(buffer, "Insufficient space for update.", bufferSize);
+        break;
+    case UpdateOTAError::UNKNOWN:
+        strncpy(buffer, "Unknown error.", bufferSize);
+        break;
+    case UpdateOTAError::SIGNATURE_INVALID:
+        strncpy(buffer, "Image signature missing or invalid.", bufferSize);
+        break;
+    case UpdateOTAError::CONNECTION_FAILED:
+        strncpy(buffer, "Connection to server failed.", bufferSize);
+        break;
+    case UpdateOTAError::SERVER_BUSY:
+        strncpy(buffer, "Server busy, retry later.", bufferSize);
+        break;
+    case UpdateOTAError::SERVER_ERROR:
+        strncpy(buffer, "Server error.", bufferSize);
+        break;
+    case UpdateOTAError::VALIDATION_FAILED:
+        strncpy(buffer, "Image validation failed, no rollback.", bufferSize);
+        break;
+    case UpdateOTAError::NO_STAGED_UPDATE:
+        strncpy(buffer, "No staged update.", bufferSize);
+        break;
+    case UpdateOTAError::FLASH_ERROR:
+        strncpy(buffer, "Flash write or verify failed.", bufferSize);
+        break;
+    case UpdateOTAError::INVALID_IMAGE:
+        strncpy(buffer, "Image is not for this device.", bufferSize);
+        break;
+    case UpdateOTAError::NO_UPDATE_AVAILABLE:
+        strncpy(buffer, "No newer firmware available.", bufferSize);
+        break;
+    default:
+        strncpy(buffer, "Unknown error.", bufferSize);
+        break;
+    }
+}
+
+UpdateOTAError UpdateOTA::finishUpdate(uint32_t imageLength, bool verifySignature)
+{
+    UpdateOTAError err = verifyImage(imageLength, verifySignature);
+
+    // The tag identifies the image to conditional requests, only once it passed verification
+    if (err == UpdateOTAError::SUCCESS && _pendingETag[0] != '\0')
+        UpdateOTAImageRecord::saveETag(_newPartition, _pendingETag);
+    _pendingETag[0] = '\0';
+    if (err != UpdateOTAError::SUCCESS)
+        return err;
+
+    // If the update is not for the firmware, then return
+    if (!_isFirmware)
+    {
+        Log_Verbose(_logger, "UpdateOTA finishUpdate: Update completed successfully (not firmware)");
+        return UpdateOTAError::SUCCESS;
+    }
+
+    return activateImage();
+}
+
+UpdateOTAError UpdateOTA::verifyImage(uint32_t imageLength, bool verifySignature)
+{
+    // Never activate an image whose signature does not match
+    if (verifySignature && !_signature.verify())
+    {
+        Log_Error(_logger, "UpdateOTA verifyImage error: Image signature verification failed");
+        if (!_isFirmware)
+            resetPartitionRange(0, BLOCK_SIZE_P); // Invalidate the filesystem header so it is not mounted.
+        return UpdateOTAError::SIGNATURE_INVALID;
+    }
+
+    // Remember the verified image so it can be shared with peers
+    if (verifySignature)
+        UpdateOTAImageRecord::save(_newPartition, imageLength, _signature.signatureBuffer(), _signature.signatureLength());
+
+    UpdateOTATrace::record(UpdateOTATraceEvent::VERIFY, UpdateOTAError::SUCCESS, imageLength / 1024);
+    return UpdateOTAError::SUCCESS;
+}
+
+UpdateOTAError UpdateOTA::activateImage()
+{
+    // Change the boot partition to the new partition
+    UpdateOTAError err = changeBootPartition();
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        Log_Error(_logger, "UpdateOTA activateImage error: Failed to change boot partition, ErrorCode=%d", err);
+        return err;
+    }
+    UpdateOTATrace::record(UpdateOTATraceEvent::ACTIVATE);
+
+    // Keep running the current firmware until the activation
+    if (_stageOnly)
+    {
+        Log_Verbose(_logger, "UpdateOTA activateImage: Firmware staged on partition '%s'", _newPartition->label);
+        return UpdateOTAError::SUCCESS;
+    }
+
+    restart();
+
+    // Never reached
+    return UpdateOTAError::SUCCESS;
+}
+
+#if UPDATE_OTA_MULTICAST
+UpdateOTAError UpdateOTA::receiveMulticastImage(WiFiUDP &udp, UpdateOTAFountainDecoder &decoder, uint32_t timeoutMs, uint32_t *imageLength)
+{
+    // Word aligned packet buffer, the payload follows the 16 byte header
+    uint32_t packet[(sizeof(UpdateOTAFountainHeader) + FOUNTAIN_SYMBOL_SIZE) / sizeof(uint32_t)];
+    UpdateOTAFountainHeader *header = (UpdateOTAFountainHeader *)packet;
+    uint8_t *payload = (uint8_t *)packet + sizeof(UpdateOTAFountainHeader);
+
+    bool needSignature = _signature.hasPublicKey();
+    bool hasSignature = false;
+    uint32_t lastProgress = millis();
+    *imageLength = 0;
+
+    setIndicator(true);
+
+    UpdateOTAError err = UpdateOTAError::SUCCESS;
+    while (*imageLength == 0 || decoder.decodedCount() < decoder.blockCount() || (needSignature && !hasSignature))
+    {
+        if (millis() - lastProgress > timeoutMs)
+        {
+            Log_Error(_logger, "UpdateOTA receiveMulticastImage error: No progress for %ums", timeoutMs);
+            err = UpdateOTAError::UPDATE_PROGRESS_ERROR;
+            break;
+        }
+
+        if (udp.parsePacket() <= 0)
+        {
+            delay(1); // Let the network stack run.
+            continue;
+        }
+
+        int readed = udp.read((uint8_t *)packet, sizeof(packet));
+        if (readed < (int)sizeof(UpdateOTAFountainHeader) || header->magic != FOUNTAIN_MAGIC)
+            continue;
+
+        // The signature is repeated by the sender, keep the first copy
+        if (header->blockIndex == FOUNTAIN_SIGNATURE_BLOCK)
+        {
+            if (!hasSignature && header->seed <= readed - sizeof(UpdateOTAFountainHeader))
+                hasSignature = _signature.setSignature(payload, header->seed);
+            continue;
+        }
+
+        if (readed != sizeof(packet))
+            continue;
+
+        // The first symbol announces the image size
+        if (*imageLength == 0)
+        {
+            if (header->imageSize == 0 || header->imageSize > _newPartition->size)
+            {
+                Log_Error(_logger, "UpdateOTA receiveMulticastImage error: Image size=%u does not fit", header->imageSize);
+                err = UpdateOTAError::NO_ENOUGH_SPACE;
+                break;
+            }
+            if (!decoder.begin(header->imageSize))
+            {
+                err = UpdateOTAError::NO_ENOUGH_SPACE;
+                break;
+            }
+            *imageLength = header->imageSize;
+        }
+
+        if (header->imageSize != *imageLength)
+            continue; // Symbol of another image.
+
+        const uint8_t *block = nullptr;
+        if (!decoder.addSymbol(header->blockIndex, header->seed, payload, &block))
+            continue;
+
+        // A block is complete, write it to the partition
+        size_t offset = header->blockIndex * BLOCK_SIZE_P;
+        size_t length = *imageLength - offset < BLOCK_SIZE_P ? *imageLength - offset : BLOCK_SIZE_P;
+        memcpy(_buffer, block, length);
+        decoder.releaseBlock(header->blockIndex);
+
+        // Blocks decode out of order, the header is checked as soon as the first block is complete
+        if (_isFirmware && header->blockIndex == 0 && (err = checkImageHeader((const uint8_t *)_buffer, length)) != UpdateOTAError::SUCCESS)
+            break;
+
+        toggleLed();
+        esp_err_t flashErr = resetPartitionRange(offset, BLOCK_SIZE_P);
+        if (flashErr == ESP_OK)
+            flashErr = writeBlockBufferToPartition(offset, length);
+        toggleLed();
+        if (flashErr != ESP_OK)
+        {
+            Log_Error(_logger, "UpdateOTA receiveMulticastImage error: Flash operation failed at offset=%u, ErrorCode=%d", (unsigned)offset, flashErr);
+            err = UpdateOTAError::FLASH_ERROR;
+            break;
+        }
+
+        printProgress(decoder.decodedCount(), decoder.blockCount());
+        lastProgress = millis();
+    }
+
+    setIndicator(false);
+
+    return err;
+}
+#endif
+
+void UpdateOTA::setTlsProfile(const UpdateOTATlsProfile &profile)
+{
+    // Applied by processGetRequest() on the next session
+    _tlsProfile = profile;
+    Log_Verbose(_logger, "UpdateOTA setTlsProfile: CACert=%s, HandshakeTimeout=%us",
+                profile.caCert != nullptr ? "set" : "insecure", profile.handshakeTimeoutSec);
+}
+
+bool UpdateOTA::setSigningKey(const char *publicKeyPem)
+{
+    // Parse the key once, it is reused for every update
+    if (!_signature.setPublicKey(publicKeyPem))
+    {
+        Log_Error(_logger, "UpdateOTA setSigningKey error: Invalid public key");
+        return false;
+    }
+
+    Log_Verbose(_logger, "UpdateOTA setSigningKey: Signature verification %s", publicKeyPem != nullptr ? "enabled" : "disabled");
+    return true;
+}
+
+void UpdateOTA::beginSession()
+{
+    // A previous session may still hold a connection and its TLS buffers
+    endSession();
+    _isSecure = strncmp(_uRL, "https://", 8) == 0;
+    _wifiClient = _isSecure ? new WiFiClientSecure() : new WiFiClient();
+    _httpClient = new HTTPClient();
+}
+
+void UpdateOTA::endSession()
+{
+    // Stop the connection first so mbedTLS frees its record buffers
+    if (_httpClient != nullptr)
+    {
+        _httpClient->end();
+        delete _httpClient;
+        _httpClient = nullptr;
+    }
+    if (_wifiClient != nullptr)
+    {
+        _wifiClient->stop();
+        delete _wifiClient;
+        _wifiClient = nullptr;
+    }
+#if UPDATE_OTA_BACKGROUND_STAGING
+    _stagingSession = false; // Any other request replaces the staging download
+#endif
+}
+
+UpdateOTAError UpdateOTA::fetchSignature()
+{
+    // The detached signature is published next to the image as "<URL>.sig", ".sig" goes before the query
+    // or fragment so presigned URLs keep their parameters
+    const char *imageURL = _uRL;
+    size_t pathEnd = strcspn(_uRL, "?#");
+    String signatureURL = String(_uRL).substring(0, pathEnd) + ".sig" + (_uRL + pathEnd);
+    _uRL = signatureURL.c_str();
+
+    // Reuse the connection of an open session
+    bool ownSession = _httpClient == nullptr;
+    if (ownSession)
+        beginSession();
+    UpdateOTAError err = processGetRequest();
+    _uRL = imageURL; // The signature URL does not outlive this call.
+    int size = _httpClient->getSize();
+    if (err == UpdateOTAError::SUCCESS && (size <= 0 || size > SIGNATURE_MAX_SIZE))
+    {
+        Log_Error(_logger, "UpdateOTA fetchSignature error: Invalid signature size=%d", size);
+        err = UpdateOTAError::SIGNATURE_INVALID;
+    }
+
+    if (err == UpdateOTAError::SUCCESS)
+    {
+        size_t readed = _wifiClient->readBytes(_signature.signatureBuffer(), size);
+        _signature.setSignature(_signature.signatureBuffer(), readed);
+        if (readed != (size_t)size)
+            err = UpdateOTAError::SIGNATURE_INVALID;
+    }
+
+    if (ownSession)
+        endSession();
+    if (err != UpdateOTAError::SUCCESS)
+        return err;
+
+    Log_Verbose(_logger, "UpdateOTA fetchSignature: Signature retrieved, Size=%d", size);
+    return UpdateOTAError::SUCCESS;
+}
+
+namespace
+{
+/**
+ * @brief Stream that fills a text buffer, HTTPClient::writeToStream() feeds it the decoded body
+ */
+class TextBufferStream : public Stream
+{
+public:
+    TextBufferStream(char *buffer, size_t bufferSize) : _buffer(buffer), _capacity(bufferSize - 1) { _buffer[0] = '\0'; }
+
+    size_t write(uint8_t byte) override { return write(&byte, 1); }
+
+    size_t write(const uint8_t *data, size_t length) override
+    {
+        // Accept what fits, a short write makes HTTPClient stop reading
+        size_t count = length < _capacity - _length ? length : _capacity - _length;
+        memcpy(_buffer + _length, data, count);
+        _length += count;
+        _buffer[_length] = '\0';
+        _overflow |= count < length;
+        return count;
+    }
+
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+
+    bool overflowed() const { return _overflow; }
+
+private:
+    char *_buffer;
+    size_t _capacity;
+    size_t _length = 0;
+    bool _overflow = false;
+};
+} // namespace
+
+UpdateOTAError UpdateOTA::fetchText(const char *uRL, char *buffer, size_t bufferSize)
+{
+    // Check if the device is connected to the internet
+    if (WiFi.status() != WL_CONNECTED)
+    {
+        Log_Error(_logger, "UpdateOTA fetchText error: No internet connection");
+        return UpdateOTAError::NO_INTERNET;
+    }
+
+    _uRL = uRL;
+    beginSession();
+    UpdateOTAError err = processGetRequest();
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        endSession();
+        return err;
+    }
+
+    // A known length is checked up front, chunked bodies only while they are decoded
+    int size = _httpClient->getSize();
+    if (size >= 0 && (size_t)size >= bufferSize)
+    {
+        Log_Error(_logger, "UpdateOTA fetchText error: Body of %d bytes does not fit %u", size, (unsigned)bufferSize);
+        endSession();
+        return UpdateOTAError::NO_ENOUGH_SPACE;
+    }
+
+    TextBufferStream text(buffer, bufferSize);
+    int written = _httpClient->writeToStream(&text);
+    endSession();
+    if (text.overflowed())
+    {
+        Log_Error(_logger, "UpdateOTA fetchText error: Chunked body does not fit %u", (unsigned)bufferSize);
+        return UpdateOTAError::NO_ENOUGH_SPACE;
+    }
+    if (written < 0)
+    {
+        Log_Error(_logger, "UpdateOTA fetchText error: Failed to read the body, Error='%s'", HTTPClient::errorToString(written).c_str());
+        _lastResult.transportError = written;
+        return UpdateOTAError::CONNECTION_FAILED;
+    }
+    return UpdateOTAError::SUCCESS;
+}
+
+const UpdateOTAResult &UpdateOTA::getLastResult()
+{
+    return _lastResult;
+}
+
+UpdateOTAError UpdateOTA::validateBootedImage(std::function<bool()> healthCheck, uint32_t deadlineMs)
+{
+    // Only an image booted for the first time after an update waits for validation
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(running, &state) != ESP_OK || state != ESP_OTA_IMG_PENDING_VERIFY)
+    {
+        Log_Verbose(_logger, "UpdateOTA validateBootedImage: Partition '%s' does not need validation", running->label);
+        return UpdateOTAError::SUCCESS;
+    }
+
+    uint32_t start = millis();
+    while (!healthCheck())
+    {
+        if (millis() - start >= deadlineMs)
+        {
+            // Does not return when a previous image exists
+            Log_Error(_logger, "UpdateOTA validateBootedImage error: Health check failed after %ums, rolling back", deadlineMs);
+            esp_ota_mark_app_invalid_rollback_and_reboot();
+            Log_Error(_logger, "UpdateOTA validateBootedImage error: No image to roll back to");
+            return UpdateOTAError::VALIDATION_FAILED;
+        }
+        delay(HEALTH_CHECK_INTERVAL_MS);
+    }
+
+    esp_ota_mark_app_valid_cancel_rollback();
+    _validationTimeMs = esp_timer_get_time() / 1000;
+    Log_Verbose(_logger, "UpdateOTA validateBootedImage: Partition '%s' confirmed %ums after boot", running->label, _validationTimeMs);
+    return UpdateOTAError::SUCCESS;
+}
+
+uint32_t UpdateOTA::getValidationTimeMs()
+{
+    return _validationTimeMs;
+}
+
+bool UpdateOTA::hasStagedUpdate()
+{
+    return esp_ota_get_boot_partition() != esp_ota_get_running_partition();
+}
+
+UpdateOTAError UpdateOTA::activateStagedUpdate()
+{
+    if (!hasStagedUpdate())
+    {
+        Log_Error(_logger, "UpdateOTA activateStagedUpdate error: No staged firmware");
+        return UpdateOTAError::NO_STAGED_UPDATE;
+    }
+
+    Log_Verbose(_logger, "UpdateOTA activateStagedUpdate: Activating partition '%s'", esp_ota_get_boot_partition()->label);
+    restart();
+
+    // Never reached
+    return UpdateOTAError::SUCCESS;
+}
+
+void UpdateOTA::scheduleActivation(uint32_t notBeforeEpoch, std::function<bool()> isIdle)
+{
+    _activationScheduled = true;
+    _activationEpoch = notBeforeEpoch;
+    _activationIdle = isIdle;
+    Log_Verbose(_logger, "UpdateOTA scheduleActivation: Not before %u, idle condition %s", notBeforeEpoch, isIdle ? "set" : "none");
+}
+
+void UpdateOTA::handleActivation()
+{
+    if (!_activationScheduled || !hasStagedUpdate())
+        return;
+
+    // The time condition needs a synchronised clock
+    if (_activationEpoch != 0)
+    {
+        time_t now = time(nullptr);
+        if (now < CLOCK_VALID_EPOCH || (uint32_t)now < _activationEpoch)
+            return;
+    }
+
+    if (_activationIdle && !_activationIdle())
+        return;
+
+    activateStagedUpdate();
+}
+
+void UpdateOTA::setQosPolicy(const UpdateOTAQosPolicy &policy)
+{
+    portENTER_CRITICAL(&_qosLock);
+    _qosPolicy = policy;
+    portEXIT_CRITICAL(&_qosLock);
+    Log_Verbose(_logger, "UpdateOTA setQosPolicy: Rate=%uB/s, Burst=%u, DutyCycle=%u%%", policy.maxBytesPerSec, policy.burstBytes, policy.dutyCyclePercent);
+}
+
+void UpdateOTA::throttle(size_t bytes, uint32_t blockStart)
+{
+    uint32_t pauseMs = qosPauseMs(bytes, blockStart);
+
+    // Sleep at least one tick now and then, busy loops starve the idle task and its watchdog
+    if (pauseMs == 0 && millis() - _qosLastSleep >= QOS_YIELD_INTERVAL_MS)
+        pauseMs = 1;
+    if (pauseMs > 0)
+    {
+        delay(pauseMs);
+        _qosLastSleep = millis();
+    }
+}
+
+uint32_t UpdateOTA::qosPauseMs(size_t bytes, uint32_t blockStart)
+{
+    UpdateOTAQosPolicy policy;
+    portENTER_CRITICAL(&_qosLock);
+    policy = _qosPolicy;
+    portEXIT_CRITICAL(&_qosLock);
+
+    // Duty cycle: pause in proportion to the time the block took
+    uint32_t pauseMs = 0;
+    if (policy.dutyCyclePercent > 0 && policy.dutyCyclePercent < 100)
+        pauseMs = (millis() - blockStart) * (100 - policy.dutyCyclePercent) / policy.dutyCyclePercent;
+
+    // Token bucket: pay for the block, wait out any debt
+    int64_t now = esp_timer_get_time();
+    if (policy.maxBytesPerSec > 0)
+    {
+        _qosTokens += (now - _qosRefillTime) * policy.maxBytesPerSec / 1000000;
+        if (_qosTokens > policy.burstBytes)
+            _qosTokens = policy.burstBytes;
+        _qosTokens -= bytes;
+        if (_qosTokens < 0)
+        {
+            uint32_t waitMs = (-_qosTokens * 1000 + policy.maxBytesPerSec - 1) / policy.maxBytesPerSec;
+            pauseMs = waitMs > pauseMs ? waitMs : pauseMs;
+        }
+    }
+    _qosRefillTime = now;
+    return pauseMs;
+}
+
+void UpdateOTA::setVerifyWrites(bool verifyWrites)
+{
+    _verifyWrites = verifyWrites;
+}
+
+void UpdateOTA::setAllowReinstall(bool allowReinstall)
+{
+    _allowReinstall = allowReinstall;
+}
+
+void UpdateOTA::setConditionalDownload(bool conditional)
+{
+    _conditionalDownload = conditional;
+}
+
+void UpdateOTA::setStageOnly(bool stageOnly)
+{
+    _stageOnly = stageOnly;
+}
+
+void UpdateOTA::setRetryPolicy(const UpdateOTARetryPolicy &policy)
+{
+    // Applied by the next startUpdate()
+    _retryPolicy = policy;
+    Log_Verbose(_logger, "UpdateOTA setRetryPolicy: MaxAttempts=%u, BaseDelay=%ums, MaxDelay=%ums", policy.maxAttempts, policy.baseDelayMs, policy.maxDelayMs);
+}
+
+UpdateOTAError UpdateOTA::recordResult(UpdateOTAError error)
+{
+    // Only failures that may succeed later without any change on the device are transient
+    _lastResult.error = error;
+    _lastResult.httpCode = _httpCode;
+    _lastResult.bytesCompleted = _bytesCompleted;
+    if (error != UpdateOTAError::SUCCESS)
+        UpdateOTATrace::record(UpdateOTATraceEvent::ERROR, error, _httpCode);
+    switch (error)
+    {
+    case UpdateOTAError::NO_INTERNET:
+    case UpdateOTAError::CONNECTION_FAILED:
+    case UpdateOTAError::SERVER_BUSY:
+    case UpdateOTAError::SERVER_ERROR:
+    case UpdateOTAError::UPDATE_PROGRESS_ERROR:
+        _lastResult.transient = true;
+        break;
+    default:
+        _lastResult.transient = false;
+        break;
+    }
+    return error;
+}
+
+uint32_t UpdateOTA::retryDelayMs(uint8_t attempt)
+{
+    // Exponential backoff with full jitter spreads a fleet over the whole window
+    uint32_t cap = _retryPolicy.baseDelayMs;
+    for (uint8_t i = 1; i < attempt && cap < _retryPolicy.maxDelayMs; i++)
+        cap *= 2;
+    if (cap > _retryPolicy.maxDelayMs)
+        cap = _retryPolicy.maxDelayMs;
+    uint32_t delayMs = esp_random() % (cap + 1);
+
+    // The server knows best when it is overloaded
+    if (_lastResult.retryAfterMs > delayMs)
+        delayMs = _lastResult.retryAfterMs;
+    return delayMs;
+}
+
+void UpdateOTA::setMirrorPolicy(const UpdateOTAMirrorPolicy &policy)
+{
+    // Applied by the next startUpdate(), the cached ranking is kept
+    _mirrorPolicy = policy;
+    Log_Verbose(_logger, "UpdateOTA setMirrorPolicy: RankingTTL=%ums, MinThroughput=%uB/s", policy.rankingTtlMs, policy.minThroughput);
+}
+
+void UpdateOTA::rankMirrors(const char *const *uRLs, uint8_t count)
+{
+    // FNV-1a over the URLs, the same mirrors may be passed in another array next time
+    uint32_t listHash = 2166136261u;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        const char *c = uRLs[i];
+        do
+            listHash = (listHash ^ (uint8_t)*c) * 16777619u;
+        while (*c++ != '\0');
+    }
+
+    // Only valid while the caller's call runs, see startUpdate()
+    _mirrors = uRLs;
+
+    // Reuse the cached ranking of the same list while it is fresh
+    if (listHash == _mirrorListHash && count == _mirrorCount && _rankingTime != 0 &&
+        millis() - _rankingTime < _mirrorPolicy.rankingTtlMs)
+    {
+        Log_Verbose(_logger, "UpdateOTA rankMirrors: Using cached ranking, Fastest='%s'", _mirrors[_mirrorRanking[0]]);
+        return;
+    }
+
+    _mirrorListHash = listHash;
+    _mirrorCount = count;
+    _mirrorRanking[0] = 0;
+    _rankingTime = 0;
+    if (count == 1)
+        return;
+
+    // Probe: connection setup (TCP + TLS) and a one byte ranged read
+    uint32_t latency[MAX_MIRRORS];
+    for (uint8_t i = 0; i < count; i++)
+    {
+        _uRL = uRLs[i];
+        uint32_t start = millis();
+        beginSession();
+        UpdateOTAError err = processGetRequest("bytes=0-0");
+        latency[i] = err == UpdateOTAError::SUCCESS ? millis() - start : UINT32_MAX;
+        endSession();
+        Log_Verbose(_logger, "UpdateOTA rankMirrors: URL='%s', Latency=%ums", uRLs[i], latency[i]);
+
+        // Insertion sort, unreachable mirrors end up last but stay usable as fallback
+        uint8_t position = i;
+        while (position > 0 && latency[_mirrorRanking[position - 1]] > latency[i])
+        {
+            _mirrorRanking[position] = _mirrorRanking[position - 1];
+            position--;
+        }
+        _mirrorRanking[position] = i;
+    }
+    _rankingTime = millis();
+}
+
+UpdateOTAError UpdateOTA::switchMirror(size_t offset)
+{
+    // Continue the same image from the next mirror in the ranking
+    char range[24];
+    snprintf(range, sizeof(range), "bytes=%u-", (unsigned)offset);
+
+    while (++_mirrorPosition < _mirrorCount)
+    {
+        _uRL = _mirrors[_mirrorRanking[_mirrorPosition]];
+        Log_Verbose(_logger, "UpdateOTA switchMirror: Resuming at offset=%u from URL='%s'", (unsigned)offset, _uRL);
+
+        beginSession();
+        if (processGetRequest(range) == UpdateOTAError::SUCCESS &&
+            _httpCode == HTTP_CODE_PARTIAL_CONTENT &&
+            (size_t)_httpClient->getSize() == _streamLength - offset)
+        {
+            UpdateOTATrace::record(UpdateOTATraceEvent::MIRROR_SWITCH, _mirrorPosition);
+            return UpdateOTAError::SUCCESS;
+        }
+        endSession();
+    }
+
+    // The measured ranking no longer reflects reality, probe again next time
+    _rankingTime = 0;
+    Log_Error(_logger, "UpdateOTA switchMirror error: No mirror left to resume from");
+    return UpdateOTAError::UPDATE_PROGRESS_ERROR;
+}
+
+UpdateOTAError UpdateOTA::processGetRequest(const char *range, const char *ifRange, bool conditional)
+{
+    // Process a GET request for the update version
+    if (_isSecure)
+    {
+        WiFiClientSecure *wifiClientSecure = static_cast<WiFiClientSecure *>(_wifiClient);
+        if (_tlsProfile.caCert != nullptr)
+            wifiClientSecure->setCACert(_tlsProfile.caCert);
+        else
+            wifiClientSecure->setInsecure();
+        wifiClientSecure->setHandshakeTimeout(_tlsProfile.handshakeTimeoutSec);
+    }
+    _wifiClient->setTimeout(_tlsProfile.streamTimeoutMs); // Set the timeout for the input stream.
+
+    uint32_t freeHeap = ESP.getFreeHeap();
+
+    _httpClient->begin(*_wifiClient, _uRL);
+    _httpClient->setTimeout(_tlsProfile.httpTimeoutMs);
+    _httpClient->setFollowRedirects(followRedirects_t::HTTPC_DISABLE_FOLLOW_REDIRECTS);
+    _httpClient->setUserAgent("RonnyAgend"); // TODO: change this to your own user agent
+    _httpClient->addHeader("Cache-Control", "no-cache");
+    if (range != nullptr)
+        _httpClient->addHeader("Range", range);
+    if (ifRange != nullptr)
+        _httpClient->addHeader("If-Range", ifRange);
+    if (conditional)
+    {
+        // The server may answer 304 or announce its version before the body
+        char eTag[ETAG_MAX];
+        _httpClient->addHeader("X-Firmware-Version", esp_ota_get_app_description()->version);
+        if (UpdateOTAImageRecord::loadETag(esp_ota_get_running_partition(), eTag, sizeof(eTag)))
+            _httpClient->addHeader("If-None-Match", eTag);
+    }
+    const char *headerKeys[] = {"Retry-After", "ETag", "X-Firmware-Version"};
+    _httpClient->collectHeaders(headerKeys, 3);
+
+    _httpCode = _httpClient->GET();
+    _lastResult.transportError = 0;
+    _lastResult.retryAfterMs = 0;
+
+    Log_Verbose(_logger, "UpdateOTA processGetRequest: HTTP Code=%d, SessionHeap=%d", _httpCode, (int32_t)(freeHeap - ESP.getFreeHeap()));
+
+    switch (_httpCode)
+    {
+    case HTTP_CODE_OK:
+    case HTTP_CODE_PARTIAL_CONTENT:
+        Log_Verbose(_logger, "UpdateOTA processGetRequest: Success");
+        return UpdateOTAError::SUCCESS;
+    case HTTP_CODE_NOT_MODIFIED:
+        Log_Verbose(_logger, "UpdateOTA processGetRequest: Not modified");
+        return UpdateOTAError::NO_UPDATE_AVAILABLE;
+    case HTTP_CODE_NOT_FOUND:
+        Log_Error(_logger, "UpdateOTA processGetRequest error: Page not found");
+        return UpdateOTAError::PAGE_NOT_FOUND;
+    case HTTP_CODE_UNAUTHORIZED:
+        Log_Error(_logger, "UpdateOTA processGetRequest error: Unauthorized access");
+        return UpdateOTAError::UNAUTHORIZED;
+    case HTTP_CODE_BAD_REQUEST:
+        Log_Error(_logger, "UpdateOTA processGetRequest error: Bad request received");
+        return UpdateOTAError::BAD_REQUEST;
+    case HTTP_CODE_TOO_MANY_REQUESTS:
+    case HTTP_CODE_SERVICE_UNAVAILABLE:
+        // Retry-After in seconds, the HTTP-date form is not supported and ignored
+        _lastResult.retryAfterMs = _httpClient->header("Retry-After").toInt() * 1000;
+        Log_Error(_logger, "UpdateOTA processGetRequest error: Server busy, RetryAfter=%ums", _lastResult.retryAfterMs);
+        return UpdateOTAError::SERVER_BUSY;
+    default:
+        break;
+    }
+
+    if (_httpCode < 0)
+    {
+        // HTTPClient error, for TLS sessions the mbedTLS error explains the failure
+        char tlsError[64];
+        _lastResult.transportError = _isSecure ? static_cast<WiFiClientSecure *>(_wifiClient)->lastError(tlsError, sizeof(tlsError)) : 0;
+        if (_lastResult.transportError == 0)
+            _lastResult.transportError = _httpCode;
+        Log_Error(_logger, "UpdateOTA processGetRequest error: Connection failed, HTTP Code=%d, TransportError=%d", _httpCode, _lastResult.transportError);
+        return UpdateOTAError::CONNECTION_FAILED;
+    }
+
+    if (_httpCode >= 500)
+    {
+        Log_Error(_logger, "UpdateOTA processGetRequest error: Server error, HTTP Code=%d", _httpCode);
+        return UpdateOTAError::SERVER_ERROR;
+    }
+
+    Log_Error(_logger, "UpdateOTA processGetRequest error: Unknown HTTP Code=%d", _httpCode);
+    return UpdateOTAError::UNKNOWN;
+}
+
+UpdateOTAError UpdateOTA::updateFirmware()
+{
+    Log_Verbose(_logger, "Updating firmware");
+#if UPDATE_OTA_PIPELINE
+    if (_pipeline)
+        return updateFirmwarePipelined();
+#endif
+
+    // Update the firmware
+    setIndicator(true);
+
+    size_t written = _bytesCompleted; // Variable to keep track of the number of bytes written, resumed downloads start past zero.
+    size_t toWrite = 0; // Variable to keep track of the number of bytes to write.
+    size_t expected = 0; // Variable to keep track of the number of bytes of the current block.
+    uint32_t windowStart = millis(); // Start of the current throughput measurement window.
+    size_t windowBytes = 0;          // Bytes received in the current throughput measurement window.
+    size_t verifyOffset = 0;         // Offset of the written block waiting for its readback check.
+    size_t verifyLength = 0;         // Length of that block, zero if none.
+    uint32_t verifyCrc = 0;          // CRC32 of the data received for that block.
+    bool flashFailed = false;        // Flag indicating whether an erase or write failed.
+    UpdateOTAError imageErr = UpdateOTAError::SUCCESS; // Result of the image header check.
+    int64_t transferStart = esp_timer_get_time(); // Start of the transfer, for the stage utilization.
+    int64_t networkUs = 0;           // Time spent receiving and decrypting.
+    int64_t flashUs = 0;             // Time spent hashing, erasing and writing.
+
+    _qosTokens = INT32_MAX; // Capped to the burst size, the update starts at full speed.
+    _qosRefillTime = esp_timer_get_time();
+    while (written < _streamLength) // Loop until all the bytes are written.
+    {
+        uint32_t blockStart = millis(); // Start of the work on this block, for the QoS duty cycle.
+
+        printProgress(written, _streamLength); // Print the progress.
+
+        resetBuffer(); // Clear the buffer to prepare for the next block.
+
+        toggleLed(); // Toggle the LED.
+
+        expected = _streamLength - written < BLOCK_SIZE_P ? _streamLength - written : BLOCK_SIZE_P;
+        int64_t readStart = esp_timer_get_time();
+        toWrite = readBlockFromClientToBuffer(written, BLOCK_SIZE_P, _buffer); // Read the next block from the input stream.
+        networkUs += esp_timer_get_time() - readStart;
+
+        if (toWrite != expected)
+        {
+            // The stream stalled or closed, drop the partial block and resume it elsewhere
+            if (switchMirror(written) != UpdateOTAError::SUCCESS)
+                break;
+            windowStart = millis();
+            windowBytes = 0;
+            continue;
+        }
+
+        // A firmware for another device is rejected before anything of the slot is erased
+        if (_isFirmware && written == 0 && (imageErr = checkImageHeader((const uint8_t *)_buffer, toWrite)) != UpdateOTAError::SUCCESS)
+            break;
+
+        int64_t flashStart = esp_timer_get_time();
+        if (_signature.hasPublicKey())
+            _signature.update((const uint8_t *)_buffer, toWrite); // Hash the block while it is streamed.
+
+        // Check the previous block now that the network read of this one is done
+        uint32_t crc = _verifyWrites ? esp_rom_crc32_le(0, (const uint8_t *)_buffer, toWrite) : 0;
+        if (verifyLength > 0)
+        {
+            verifyBlock(verifyOffset, verifyLength, verifyCrc);
+            verifyLength = 0;
+        }
+
+        toggleLed(); // Toggle the LED.
+
+        // Clear the partition range (unless pre-erased) and write the block from the buffer to the partition.
+        esp_err_t flashErr = written + BLOCK_SIZE_P <= _blankEnd ? ESP_OK : resetPartitionRange(written, BLOCK_SIZE_P);
+        if (flashErr == ESP_OK)
+            flashErr = writeBlockBufferToPartition(written, toWrite);
+        if (flashErr != ESP_OK)
+        {
+            Log_Error(_logger, "UpdateOTA updateFirmware error: Flash operation failed at offset=%u, ErrorCode=%d", (unsigned)written, flashErr);
+            flashFailed = true;
+            break;
+        }
+        flashUs += esp_timer_get_time() - flashStart;
+
+        if (_verifyWrites)
+        {
+            verifyOffset = written;
+            verifyLength = toWrite;
+            verifyCrc = crc;
+        }
+
+        written += toWrite; // Update the number of bytes written.
+        _bytesCompleted = written;
+        UpdateOTATrace::record(UpdateOTATraceEvent::BLOCK, 0, millis() - blockStart);
+
+        throttle(toWrite, blockStart); // Leave bandwidth and CPU time to the application.
+
+        // Move to another mirror when the current one is too slow
+        windowBytes += toWrite;
+        uint32_t elapsed = millis() - windowStart;
+        if (elapsed >= _mirrorPolicy.throughputWindowMs)
+        {
+            uint32_t throughput = (uint64_t)windowBytes * 1000 / elapsed;
+            if (throughput < _mirrorPolicy.minThroughput && _mirrorPosition + 1 < _mirrorCount && written < _streamLength)
+            {
+                Log_Verbose(_logger, "UpdateOTA updateFirmware: Throughput=%uB/s below threshold, switching mirror", throughput);
+                if (switchMirror(written) != UpdateOTAError::SUCCESS)
+                    break;
+            }
+            windowStart = millis();
+            windowBytes = 0;
+        }
+    }
+
+    printProgress(written, _streamLength); // Print the progress.
+
+    if (verifyLength > 0)
+        verifyBlock(verifyOffset, verifyLength, verifyCrc);
+
+    int64_t elapsed = esp_timer_get_time() - transferStart;
+    _lastResult.networkUtilization = elapsed > 0 ? networkUs * 100 / elapsed : 0;
+    _lastResult.flashUtilization = elapsed > 0 ? flashUs * 100 / elapsed : 0;
+
+    setIndicator(false);
+
+    if (imageErr != UpdateOTAError::SUCCESS)
+        return imageErr;
+
+    if (flashFailed || _lastResult.mismatchedSectors > 0)
+        return UpdateOTAError::FLASH_ERROR;
+
+    if (_streamLength != written)
+        return UpdateOTAError::UPDATE_PROGRESS_ERROR; // Check if the number of bytes written is equal to the stream length. If not return an error.
+
+    return UpdateOTAError::SUCCESS;
+}
+
+#if UPDATE_OTA_PIPELINE
+UpdateOTAError UpdateOTA::updateFirmwarePipelined()
+{
+    // Without the buffers or the task the update runs in one task
+    _networkTask = xTaskGetCurrentTaskHandle();
+    _flashFailed = false;
+    _flashDone = false;
+    BaseType_t flashCore = portNUM_PROCESSORS > 1 ? 1 - xPortGetCoreID() : tskNO_AFFINITY;
+    if (!_ring.begin(PIPELINE_SLOTS, BLOCK_SIZE_P) ||
+        xTaskCreatePinnedToCore(flashStageTask, "UpdateOTAFlash", PIPELINE_STACK_SIZE, this,
+                                uxTaskPriorityGet(nullptr), &_flashTask, flashCore) != pdPASS)
+    {
+        Log_Error(_logger, "UpdateOTA updateFirmwarePipelined error: Cannot start the flash stage, running in one task");
+        _ring.end();
+        _pipeline = false;
+        UpdateOTAError err = updateFirmware();
+        _pipeline = true;
+        return err;
+    }
+
+    setIndicator(true);
+
+    size_t received = _bytesCompleted; // Bytes handed to the flash stage, ahead of _bytesCompleted.
+    UpdateOTAError imageErr = UpdateOTAError::SUCCESS;
+    int64_t transferStart = esp_timer_get_time();
+    int64_t networkUs = 0;
+    _qosTokens = INT32_MAX;
+    _qosRefillTime = esp_timer_get_time();
+    while (received < _streamLength && !_flashFailed)
+    {
+        uint32_t blockStart = millis();
+        printProgress(_bytesCompleted, _streamLength);
+        toggleLed();
+
+        // Wait for a free buffer, the flash stage releases one per block
+        uint8_t *slot;
+        while ((slot = _ring.producerSlot()) == nullptr && !_flashFailed)
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+        if (slot == nullptr)
+            break;
+
+        size_t expected = _streamLength - received < BLOCK_SIZE_P ? _streamLength - received : BLOCK_SIZE_P;
+        int64_t readStart = esp_timer_get_time();
+        size_t readed = readBlockFromClientToBuffer(received, BLOCK_SIZE_P, (char *)slot);
+        networkUs += esp_timer_get_time() - readStart;
+        if (readed != expected)
+        {
+            // The stream stalled or closed, resume after the last queued block elsewhere
+            if (switchMirror(received) != UpdateOTAError::SUCCESS)
+                break;
+            continue;
+        }
+        if (_isFirmware && received == 0 && (imageErr = checkImageHeader(slot, readed)) != UpdateOTAError::SUCCESS)
+            break;
+
+        _ring.push(received, readed);
+        xTaskNotifyGive(_flashTask);
+        received += readed;
+        UpdateOTATrace::record(UpdateOTATraceEvent::BLOCK, 0, millis() - blockStart);
+        throttle(readed, blockStart);
+    }
+
+    // Queue the end marker and wait until the flash stage drained the ring
+    while (_ring.producerSlot() == nullptr)
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+    _ring.push(received, 0);
+    xTaskNotifyGive(_flashTask);
+    while (!_flashDone)
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+    _ring.end();
+    printProgress(_bytesCompleted, _streamLength);
+
+    int64_t elapsed = esp_timer_get_time() - transferStart;
+    _lastResult.networkUtilization = elapsed > 0 ? networkUs * 100 / elapsed : 0;
+    _lastResult.flashUtilization = elapsed > 0 ? _flashBusyUs * 100 / elapsed : 0;
+    Log_Verbose(_logger, "UpdateOTA updateFirmwarePipelined: Network=%u%%, Flash=%u%%", _lastResult.networkUtilization, _lastResult.flashUtilization);
+
+    setIndicator(false);
+
+    if (imageErr != UpdateOTAError::SUCCESS)
+        return imageErr;
+
+    if (_flashFailed || _lastResult.mismatchedSectors > 0)
+        return UpdateOTAError::FLASH_ERROR;
+
+    if (_bytesCompleted != _streamLength)
+        return UpdateOTAError::UPDATE_PROGRESS_ERROR;
+
+    return UpdateOTAError::SUCCESS;
+}
+
+void UpdateOTA::flashStage()
+{
+    int64_t busyUs = 0;
+    for (;;)
+    {
+        size_t offset;
+        size_t length;
+        uint8_t *slot;
+        while ((slot = _ring.consumerSlot(&offset, &length)) == nullptr)
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+        if (length == 0)
+        {
+            _ring.pop();
+            break;
+        }
+
+        // After a failure the remaining blocks are only drained
+        if (!_flashFailed)
+        {
+            int64_t start = esp_timer_get_time();
+            if (_signature.hasPublicKey())
+                _signature.update(slot, length);
+            esp_err_t err = offset + BLOCK_SIZE_P <= _blankEnd ? ESP_OK : esp_partition_erase_range(_newPartition, offset, BLOCK_SIZE_P);
+            if (err == ESP_OK)
+                err = esp_partition_write(_newPartition, offset, slot, length);
+            if (err != ESP_OK)
+            {
+                Log_Error(_logger, "UpdateOTA flashStage error: Flash operation failed at offset=%u, ErrorCode=%d", (unsigned)offset, err);
+                _flashFailed = true;
+            }
+            else
+            {
+                if (_verifyWrites)
+                    verifyBlock(offset, length, esp_rom_crc32_le(0, slot, length));
+                _bytesCompleted = offset + length;
+            }
+            busyUs += esp_timer_get_time() - start;
+        }
+
+        _ring.pop();
+        xTaskNotifyGive(_networkTask);
+    }
+
+    _flashBusyUs = busyUs;
+    _flashDone = true;
+    xTaskNotifyGive(_networkTask);
+}
+
+void UpdateOTA::flashStageTask(void *updateOTA)
+{
+    static_cast<UpdateOTA *>(updateOTA)->flashStage();
+    vTaskDelete(nullptr);
+}
+#endif
+
+#if UPDATE_OTA_BACKGROUND_STAGING
+UpdateOTAError UpdateOTA::startBackgroundStaging(const char *uRL)
+{
+    Log_Verbose(_logger, "UpdateOTA startBackgroundStaging: URL='%s'", uRL);
+
+    if (strlen(uRL) >= STAGING_URL_MAX)
     {
-        _httpClient->end();
-        delete _httpClient;
-        _httpClient = nullptr;
+        Log_Error(_logger, "UpdateOTA startBackgroundStaging error: URL too long");
+        return UpdateOTAError::BAD_REQUEST;
     }
-    if (_wifiClientSecure != nullptr)
+    if (!_signature.hasPublicKey() && strncmp(uRL, "http://", 7) == 0)
     {
-        delete _wifiClientSecure;
-        _wifiClientSecure = nullptr;
+        Log_Error(_logger, "UpdateOTA startBackgroundStaging error: Plain HTTP source requires a signing key");
+        return UpdateOTAError::SIGNATURE_INVALID;
     }
+
+    const esp_partition_t *slot = esp_ota_get_next_update_partition(nullptr);
+    if (slot == nullptr || hasStagedUpdate())
+    {
+        Log_Error(_logger, "UpdateOTA startBackgroundStaging error: No free OTA slot");
+        return UpdateOTAError::NO_PARTITION_AVAILABLE;
+    }
+
+    cancelBackgroundStaging();
+    strncpy(_staging.uRL, uRL, sizeof(_staging.uRL) - 1);
+    strncpy(_staging.partition, slot->label, sizeof(_staging.partition) - 1);
+    UpdateOTAStagingRecord::save(_staging);
+    return UpdateOTAError::SUCCESS;
 }
 
-UpdateOTAError UpdateOTA::startUpdate(const char *uRL, bool isFirmware)
+void UpdateOTA::pauseBackgroundStaging()
 {
-    Log_Verbose(_logger, "UpdateOTA startUpdate: URL='%s', isFirmware=%s", uRL, isFirmware ? "true" : "false");
+    loadStagingState();
+    if (_staging.uRL[0] == '\0' || _staging.paused)
+        return;
 
-    // Set member variables based on input parameters
-    _uRL = uRL;
-    _isFirmware = isFirmware;
+    if (_stagingSession)
+        endSession();
+    _staging.paused = true;
+    UpdateOTAStagingRecord::save(_staging);
+    _stagingUnsaved = 0;
+    Log_Verbose(_logger, "UpdateOTA pauseBackgroundStaging: Paused at offset=%u", _staging.offset);
+}
 
-    // Check if the device is connected to the internet
-    if (WiFi.status() != WL_CONNECTED)
-    {
-        Log_Error(_logger, "UpdateOTA startUpdate error: No internet connection");
-        return UpdateOTAError::NO_INTERNET;
-    }
+void UpdateOTA::resumeBackgroundStaging()
+{
+    loadStagingState();
+    if (_staging.uRL[0] == '\0' || !_staging.paused)
+        return;
 
-    // Initialize WiFiClientSecure and HTTPClient
-    _wifiClientSecure = new WiFiClientSecure();
-    _httpClient = new HTTPClient();
+    _staging.paused = false;
+    UpdateOTAStagingRecord::save(_staging);
+    Log_Verbose(_logger, "UpdateOTA resumeBackgroundStaging: Resuming at offset=%u", _staging.offset);
+}
+
+void UpdateOTA::cancelBackgroundStaging()
+{
+    loadStagingState();
+    if (_staging.uRL[0] == '\0')
+        return;
+
+    if (_stagingSession)
+        endSession();
+    memset(&_staging, 0, sizeof(_staging));
+    UpdateOTAStagingRecord::clear();
+    delete[] _stagingBuffer;
+    _stagingBuffer = nullptr;
+    _stagingFill = 0;
+    _stagingAttempts = 0;
+    _stagingRetryAt = 0;
+    Log_Verbose(_logger, "UpdateOTA cancelBackgroundStaging: Staging cancelled");
+}
+
+bool UpdateOTA::getBackgroundStaging(uint32_t *completed, uint32_t *total)
+{
+    loadStagingState();
+    *completed = _staging.offset;
+    *total = _staging.length;
+    return _staging.uRL[0] != '\0';
+}
+
+UpdateOTAError UpdateOTA::handleBackgroundStaging()
+{
+    loadStagingState();
+    if (_staging.uRL[0] == '\0' || _staging.paused || WiFi.status() != WL_CONNECTED)
+        return UpdateOTAError::SUCCESS;
+    if (_stagingRetryAt != 0 && (int32_t)(millis() - _stagingRetryAt) < 0)
+        return UpdateOTAError::SUCCESS;
+
+    // Foreground operations share the session, reopen it at the saved offset when it is gone
     UpdateOTAError err = UpdateOTAError::SUCCESS;
+    bool complete = _staging.length > 0 && _staging.offset >= _staging.length;
+    if (!_stagingSession && !complete)
+        err = openStagingSession();
 
-    // Process the GET request
-    err = processGetRequest();
-    if (err != UpdateOTAError::SUCCESS)
+    if (err == UpdateOTAError::SUCCESS && _staging.offset < _staging.length)
     {
-        Log_Error(_logger, "UpdateOTA startUpdate error: Failed to process GET request, ErrorCode=%d", err);
-        return err;
-    }
+        // Take only what already arrived, loop() never waits for the network
+        size_t length = _staging.length - _staging.offset < BLOCK_SIZE_P ? _staging.length - _staging.offset : BLOCK_SIZE_P;
+        int available = _wifiClient->available();
+        if (available > 0)
+        {
+            if (_stagingFill == 0)
+                _stagingBlockStart = millis();
+            size_t chunk = length - _stagingFill < (size_t)available ? length - _stagingFill : available;
+            int readed = _wifiClient->read((uint8_t *)_stagingBuffer + _stagingFill, chunk);
+            if (readed > 0)
+            {
+                _stagingFill += readed;
+                _stagingLastData = millis();
+            }
+        }
+        else if (!_wifiClient->connected() || millis() - _stagingLastData > _tlsProfile.streamTimeoutMs)
+        {
+            err = UpdateOTAError::UPDATE_PROGRESS_ERROR;
+        }
+        if (err == UpdateOTAError::SUCCESS && _stagingFill < length)
+            return UpdateOTAError::SUCCESS;
 
-    // Check if there is enough space for the firmware
-    uint64_t maxSketchSpace = ESP.getFreeSketchSpace() - (ESP.getFreeSketchSpace() % BLOCK_SIZE_P);
-    if (_httpClient->getSize() > maxSketchSpace)
-        return UpdateOTAError::NO_ENOUGH_SPACE;
+        if (err == UpdateOTAError::SUCCESS && _staging.offset == 0 &&
+            checkImageHeader((const uint8_t *)_stagingBuffer, length) != UpdateOTAError::SUCCESS)
+        {
+            cancelBackgroundStaging();
+            return recordResult(UpdateOTAError::INVALID_IMAGE);
+        }
+        if (err == UpdateOTAError::SUCCESS)
+        {
+            esp_err_t flashErr = _staging.offset + BLOCK_SIZE_P <= _stagingBlankEnd ? ESP_OK : esp_partition_erase_range(_stagingPartition, _staging.offset, BLOCK_SIZE_P);
+            if (flashErr == ESP_OK)
+                flashErr = esp_partition_write(_stagingPartition, _staging.offset, _stagingBuffer, length);
+            if (flashErr != ESP_OK)
+            {
+                Log_Error(_logger, "UpdateOTA handleBackgroundStaging error: Flash operation failed at offset=%u", _staging.offset);
+                cancelBackgroundStaging();
+                return UpdateOTAError::FLASH_ERROR;
+            }
+            _staging.offset += length;
+            _stagingFill = 0;
+            _stagingAttempts = 0;
 
-    // Get the next updatable partition and check if there is a partition available for update
-    err = selectPartition();
-    if (err != UpdateOTAError::SUCCESS)
-    {
-        Log_Error(_logger, "UpdateOTA startUpdate error: Insufficient space for update");
-        return err;
+            // Saved in steps to spare the NVS, blocks after the saved offset are fetched again
+            if (++_stagingUnsaved >= STAGING_SAVE_INTERVAL)
+            {
+                UpdateOTAStagingRecord::save(_staging);
+                _stagingUnsaved = 0;
+            }
+        }
     }
 
-    // Update the firmware
-    err = updateFirmware();
     if (err != UpdateOTAError::SUCCESS)
     {
-        Log_Error(_logger, "UpdateOTA startUpdate error: Failed to update firmware, ErrorCode=%d", err);
-        return err;
-    }
+        endSession();
+        recordResult(err);
+        if (!_lastResult.transient)
+        {
+            Log_Error(_logger, "UpdateOTA handleBackgroundStaging error: Staging failed, ErrorCode=%d", err);
+            cancelBackgroundStaging();
+            return err;
+        }
 
-    // If the update is not for the firmware, then return
-    if (!_isFirmware)
-    {
-        Log_Verbose(_logger, "UpdateOTA startUpdate: Update completed successfully (not firmware)");
+        UpdateOTAStagingRecord::save(_staging);
+        _stagingUnsaved = 0;
+        uint32_t retryDelay = retryDelayMs(++_stagingAttempts);
+        _stagingRetryAt = (millis() + retryDelay) | 1;
+        Log_Verbose(_logger, "UpdateOTA handleBackgroundStaging: Request failed, ErrorCode=%d, retrying in %ums", err, retryDelay);
         return UpdateOTAError::SUCCESS;
     }
 
-    // Change the boot partition to the new partition
-    err = changeBootPartition();
-    if (err != UpdateOTAError::SUCCESS)
+    if (_staging.offset < _staging.length)
     {
-        Log_Error(_logger, "UpdateOTA startUpdate error: Failed to change boot partition, ErrorCode=%d", err);
-        return err;
+        // The QoS pause defers the next block instead of sleeping in loop()
+        uint32_t pauseMs = qosPauseMs(BLOCK_SIZE_P, _stagingBlockStart);
+        _stagingRetryAt = pauseMs > 0 ? (millis() + pauseMs) | 1 : 0;
+        return UpdateOTAError::SUCCESS;
     }
 
-    // Restart the ESP
-    ESP.restart();
-
-    // Never reached
-    return UpdateOTAError::SUCCESS;
+    endSession();
+    return recordResult(finishStaging());
 }
 
-UpdateOTAError UpdateOTA::getVersionNumber(const char *uRL, char *buffer, uint8_t bufferSize)
+UpdateOTAError UpdateOTA::openStagingSession()
 {
-    Log_Verbose(_logger, "UpdateOTA getVersionNumber: URL='%s', BufferSize=%u", uRL, bufferSize);
+    _stagingPartition = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, _staging.partition);
+    if (_stagingPartition == nullptr || _stagingPartition != esp_ota_get_next_update_partition(nullptr))
+    {
+        Log_Error(_logger, "UpdateOTA openStagingSession error: Slot '%s' is no longer the update slot", _staging.partition);
+        return UpdateOTAError::NO_PARTITION_AVAILABLE;
+    }
 
-    // Check if the device is connected to the internet
-    if (WiFi.status() != WL_CONNECTED)
+    // Foreground operations use _buffer between two calls, the staging keeps its block apart
+    if (_stagingBuffer == nullptr)
+        _stagingBuffer = new (std::nothrow) char[BLOCK_SIZE_P];
+    if (_stagingBuffer == nullptr)
     {
-        Log_Error(_logger, "UpdateOTA getVersionNumber error: No internet connection");
-        return UpdateOTAError::NO_INTERNET;
+        Log_Error(_logger, "UpdateOTA openStagingSession error: Not enough memory for the staging block");
+        return UpdateOTAError::NO_ENOUGH_SPACE;
     }
+    _stagingFill = 0; // A partial block of the previous session is fetched again.
+    _stagingLastData = millis();
 
-    // Set member variables based on input parameters
-    _uRL = uRL;
-    _wifiClientSecure = new WiFiClientSecure();
-    _httpClient = new HTTPClient();
-    UpdateOTAError err = UpdateOTAError::SUCCESS;
-    // Process the GET request
-    err = processGetRequest();
+    _uRL = _staging.uRL;
+    beginSession();
+    _stagingSession = true;
 
+    // Resume only when the image did not change, If-Range turns the answer into a full 200 otherwise
+    char range[24];
+    snprintf(range, sizeof(range), "bytes=%u-", _staging.offset);
+    bool resume = _staging.offset > 0;
+    UpdateOTAError err = processGetRequest(resume ? range : nullptr, resume && _staging.eTag[0] != '\0' ? _staging.eTag : nullptr);
     if (err != UpdateOTAError::SUCCESS)
-    {
-        Log_Error(_logger, "UpdateOTA getVersionNumber error: Failed to process GET request, ErrorCode=%d", err);
         return err;
+
+    int size = _httpClient->getSize();
+    if (resume && _httpCode == HTTP_CODE_PARTIAL_CONTENT && (uint32_t)size == _staging.length - _staging.offset)
+    {
+        Log_Verbose(_logger, "UpdateOTA openStagingSession: Resuming at offset=%u of %u", _staging.offset, _staging.length);
+        return UpdateOTAError::SUCCESS;
     }
+    if (_httpCode != HTTP_CODE_OK)
+        return UpdateOTAError::UPDATE_PROGRESS_ERROR;
 
-    // Check if there is enough space for the firmware
-    if (_httpClient->getSize() > bufferSize)
+    // New or changed image, start over
+    if (size <= 0 || (uint32_t)size > _stagingPartition->size)
     {
-        Log_Error(_logger, "UpdateOTA getVersionNumber error: Insufficient space for update");
+        Log_Error(_logger, "UpdateOTA openStagingSession error: Image size %d does not fit slot '%s'", size, _stagingPartition->label);
         return UpdateOTAError::NO_ENOUGH_SPACE;
     }
-
-    // Read bytes directly into the buffer and null-terminate it
-    _wifiClientSecure->readBytes(buffer, _httpClient->getSize());
-    buffer[_httpClient->getSize()] = '\0'; // Null-terminate the string
-
-    Log_Verbose(_logger, "UpdateOTA getVersionNumber: Version retrieved successfully");
+    _staging.offset = 0;
+    _staging.length = size;
+    strncpy(_staging.eTag, _httpClient->header("ETag").c_str(), sizeof(_staging.eTag) - 1);
+    _staging.eTag[sizeof(_staging.eTag) - 1] = '\0';
+    _stagingBlankEnd = UpdateOTAImageRecord::loadBlankEnd(_stagingPartition);
+    UpdateOTAImageRecord::clear(_stagingPartition);
+    UpdateOTAStagingRecord::save(_staging);
+    _stagingUnsaved = 0;
+    Log_Verbose(_logger, "UpdateOTA openStagingSession: Staging %u bytes into slot '%s'", _staging.length, _stagingPartition->label);
     return UpdateOTAError::SUCCESS;
 }
 
-void UpdateOTA::errorToString(UpdateOTAError error, char *buffer, uint8_t bufferSize)
+UpdateOTAError UpdateOTA::finishStaging()
 {
-    if (buffer == nullptr || bufferSize < 50)
-    {
-        Log_Error(_logger, "Invalid error string buffer");
-        return;
-    }
-    // Convert an update OTA error to a human-readable string and store it in the provided buffer
-    switch (error)
+    _newPartition = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, _staging.partition);
+    _isFirmware = true;
+
+    // The image was written over many sessions, so the signature is checked on the image in flash
+    bool verifySignature = _signature.hasPublicKey();
+    if (verifySignature)
     {
-    case UpdateOTAError::SUCCESS:
-        strncpy(buffer, "No error occurred.", bufferSize);
-        break;
-    case UpdateOTAError::NO_INTERNET:
-        strncpy(buffer, "No internet connection.", bufferSize);
-        break;
-    case UpdateOTAError::BAD_REQUEST:
-        strncpy(buffer, "Bad request received.", bufferSize);
-        break;
-    case UpdateOTAError::UNAUTHORIZED:
-        strncpy(buffer, "Unauthorized access.", bufferSize);
-        break;
-    case UpdateOTAError::PAGE_NOT_FOUND:
-        strncpy(buffer, "Page(URL) not found.", bufferSize);
-        break;
-    case UpdateOTAError::NO_PARTITION_AVAILABLE:
-        strncpy(buffer, "No partition available for update.", bufferSize);
-        break;
-    case UpdateOTAError::PARTITION_NOT_BOOTABLE:
-        strncpy(buffer, "Selected partition is not bootable.", bufferSize);
-        break;
-    case UpdateOTAError::UPDATE_PROGRESS_ERROR:
-        strncpy(buffer, "Error in update progress.", bufferSize);
-        break;
-    case UpdateOTAError::NO_ENOUGH_SPACE:
-        strncpy(buffer, "Insufficient space for update.", bufferSize);
-        break;
-    default:
-        strncpy(buffer, "Unknown error.", bufferSize);
-        break;
+        _uRL = _staging.uRL;
+        UpdateOTAError err = fetchSignature();
+        if (err != UpdateOTAError::SUCCESS)
+        {
+            // Retried by the next handleBackgroundStaging() call
+            Log_Error(_logger, "UpdateOTA finishStaging error: Failed to fetch signature, ErrorCode=%d", err);
+            _stagingRetryAt = (millis() + retryDelayMs(++_stagingAttempts)) | 1;
+            return err;
+        }
+        err = hashPartition(_staging.length);
+        if (err != UpdateOTAError::SUCCESS)
+        {
+            cancelBackgroundStaging();
+            return err;
+        }
     }
-}
-
-UpdateOTAError UpdateOTA::processGetRequest()
-{
-    // Process a GET request for the update version
-    _wifiClientSecure->setCACert(ca_cert);
-    _wifiClientSecure->setTimeout(30000); // Set the timeout for the input stream to 30 seconds.
-
-    _httpClient->begin(*_wifiClientSecure, _uRL);
-    _httpClient->setTimeout(10000);
-    _httpClient->setFollowRedirects(followRedirects_t::HTTPC_DISABLE_FOLLOW_REDIRECTS);
-    _httpClient->setUserAgent("RonnyAgend"); // TODO: change this to your own user agent
-    _httpClient->addHeader("Cache-Control", "no-cache");
-
-    _httpCode = _httpClient->GET();
 
-    Log_Verbose(_logger, "UpdateOTA processGetRequest: HTTP Code=%d", _httpCode);
+    uint32_t imageLength = _staging.length;
+    cancelBackgroundStaging();
+    UpdateOTAError err = verifyImage(imageLength, verifySignature);
+    if (err != UpdateOTAError::SUCCESS)
+        return err;
 
-    switch (_httpCode)
-    {
-    case HTTP_CODE_OK:
-        Log_Verbose(_logger, "UpdateOTA processGetRequest: Success");
-        return UpdateOTAError::SUCCESS;
-    case HTTP_CODE_NOT_FOUND:
-        Log_Error(_logger, "UpdateOTA processGetRequest error: Page not found");
-        return UpdateOTAError::PAGE_NOT_FOUND;
-    case HTTP_CODE_UNAUTHORIZED:
-        Log_Error(_logger, "UpdateOTA processGetRequest error: Unauthorized access");
-        return UpdateOTAError::UNAUTHORIZED;
-    case HTTP_CODE_BAD_REQUEST:
-        Log_Error(_logger, "UpdateOTA processGetRequest error: Bad request received");
-        return UpdateOTAError::BAD_REQUEST;
-    default:
-        Log_Error(_logger, "UpdateOTA processGetRequest error: Unknown HTTP Code=%d", _httpCode);
-        return UpdateOTAError::UNKNOWN;
-    }
+    // Set the boot partition without rebooting, activateStagedUpdate() does the rest
+    bool stageOnly = _stageOnly;
+    _stageOnly = true;
+    err = activateImage();
+    _stageOnly = stageOnly;
+    Log_Verbose(_logger, "UpdateOTA finishStaging: Firmware staged, ErrorCode=%d", err);
+    return err;
 }
 
-UpdateOTAError UpdateOTA::updateFirmware()
+void UpdateOTA::loadStagingState()
 {
-    Log_Verbose(_logger, "Updating firmware");
-    // Update the firmware
-    if (_relayModule != nullptr)
-        _relayModule->setState(true);
-
-    size_t written = 0; // Variable to keep track of the number of bytes written.
-    size_t toWrite = 0; // Variable to keep track of the number of bytes to write.
-    uint32_t _streamLength = _httpClient->getSize();
+    if (_stagingLoaded)
+        return;
+    UpdateOTAStagingRecord::load(&_staging);
+    _stagingLoaded = true;
+}
+#endif
 
-    while (written < _streamLength) // Loop until all the bytes are written.
-    {
-        printProgress(written, _streamLength); // Print the progress.
+void UpdateOTA::printTrace()
+{
+    UpdateOTATraceRecord record;
+    uint32_t start = UpdateOTATrace::get(0, &record) ? record.timeMs : 0;
+    for (uint16_t i = 0; UpdateOTATrace::get(i, &record); i++)
+        Log_Verbose(_logger, "UpdateOTA printTrace: +%ums %s Code=%u Value=%u", record.timeMs - start,
+                    UpdateOTATrace::eventName(record.event), record.code, record.value);
+    Log_Verbose(_logger, "UpdateOTA printTrace: Records=%u, RebootGap=%ums", UpdateOTATrace::count(), UpdateOTATrace::rebootGapMs());
+}
 
-        resetBuffer(); // Clear the buffer to prepare for the next block.
+void UpdateOTA::markServiceStopped()
+{
+    UpdateOTATrace::record(UpdateOTATraceEvent::SERVICE_STOPPED);
+}
 
-        toggleLed(); // Toggle the LED.
+void UpdateOTA::markServiceReady()
+{
+    UpdateOTATrace::record(UpdateOTATraceEvent::SERVICE_READY);
 
-        toWrite = readBlockFromClientToBuffer(written, BLOCK_SIZE_P); // Read the next block from the input stream.
+    UpdateOTADowntime downtime;
+    if (getDowntime(&downtime))
+        Log_Verbose(_logger, "UpdateOTA markServiceReady: Downtime=%ums (Shutdown=%ums, Boot=%ums, Init=%ums)",
+                    downtime.totalMs, downtime.shutdownMs, downtime.bootMs, downtime.initMs);
+}
 
-        resetPartitionRange(written, BLOCK_SIZE_P); // Clear the partition range to prepare for the next block.
+bool UpdateOTA::getDowntime(UpdateOTADowntime *downtime)
+{
+    return UpdateOTATrace::downtime(downtime);
+}
 
-        toggleLed(); // Toggle the LED.
+bool UpdateOTA::preEraseStep()
+{
+    // The slot holds the rollback image until the running firmware is confirmed, a staged one, or one being staged
+    const esp_partition_t *slot = esp_ota_get_next_update_partition(nullptr);
+    esp_ota_img_states_t state;
+#if UPDATE_OTA_BACKGROUND_STAGING
+    loadStagingState();
+    if (_staging.uRL[0] != '\0')
+        return false;
+#endif
+    if (slot == nullptr || hasStagedUpdate() ||
+        (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+         (state == ESP_OTA_IMG_NEW || state == ESP_OTA_IMG_PENDING_VERIFY)))
+        return false;
 
-        writeBlockBufferToPartition(written, toWrite); // Write the block from the buffer to the partition.
+    // The watermark is read every time, any update of the slot clears it
+    uint32_t blankEnd = UpdateOTAImageRecord::loadBlankEnd(slot);
+    if (blankEnd >= slot->size)
+        return false;
+    if (blankEnd == 0)
+        UpdateOTAImageRecord::clear(slot);
 
-        written += toWrite; // Update the number of bytes written.
+    if (esp_partition_erase_range(slot, blankEnd, BLOCK_SIZE_P) != ESP_OK)
+    {
+        Log_Error(_logger, "UpdateOTA preEraseStep error: Failed to erase partition '%s' at offset=%u", slot->label, blankEnd);
+        return false;
     }
+    blankEnd += BLOCK_SIZE_P;
+    UpdateOTAImageRecord::saveBlankEnd(slot, blankEnd);
 
-    printProgress(written, _streamLength); // Print the progress.
-    _httpClient->end();                    // Close the input stream.
-
-    if (_relayModule != nullptr)
-        _relayModule->setState(false);
-
-    if (_streamLength != written)
-        return UpdateOTAError::UPDATE_PROGRESS_ERROR; // Check if the number of bytes written is equal to the stream length. If not return an error.
+    if (blankEnd >= slot->size)
+    {
+        Log_Verbose(_logger, "UpdateOTA preEraseStep: Partition '%s' erased", slot->label);
+        return false;
+    }
+    return true;
+}
 
-    return UpdateOTAError::SUCCESS;
+#if UPDATE_OTA_PIPELINE
+void UpdateOTA::setPipelineMode(bool pipeline)
+{
+    _pipeline = pipeline;
 }
+#endif
 
 void UpdateOTA::resetBuffer()
 {
@@ -268,32 +2565,235 @@ void UpdateOTA::resetBuffer()
     }
 }
 
-void UpdateOTA::resetPartitionRange(size_t offset, size_t length)
+esp_err_t UpdateOTA::resetPartitionRange(size_t offset, size_t length)
 {
     // Reset the partition range
-    esp_partition_erase_range(_newPartition, offset, length);
+    return esp_partition_erase_range(_newPartition, offset, length);
 }
 
-void UpdateOTA::writeBlockBufferToPartition(size_t offset, size_t length)
+esp_err_t UpdateOTA::writeBlockBufferToPartition(size_t offset, size_t length)
 {
     // Write the block buffer to the partition
-    esp_partition_write(_newPartition, offset, _buffer, length);
+    return esp_partition_write(_newPartition, offset, _buffer, length);
+}
+
+bool UpdateOTA::verifyBlock(size_t offset, size_t length, uint32_t crc)
+{
+    // Read through the cache, the flash driver invalidates it for written ranges
+    const void *mapped = nullptr;
+    spi_flash_mmap_handle_t handle;
+    bool match = false;
+    if (esp_partition_mmap(_newPartition, offset, length, ESP_PARTITION_MMAP_DATA, &mapped, &handle) == ESP_OK)
+    {
+        match = esp_rom_crc32_le(0, (const uint8_t *)mapped, length) == crc;
+        spi_flash_munmap(handle);
+    }
+    if (match)
+        return true;
+
+    Log_Error(_logger, "UpdateOTA verifyBlock error: Sector at offset=0x%x does not match", (unsigned)offset);
+    if (_lastResult.mismatchedSectors < MAX_MISMATCHED_SECTORS)
+        _lastResult.mismatchedOffsets[_lastResult.mismatchedSectors] = offset;
+    _lastResult.mismatchedSectors++;
+    return false;
 }
 
-size_t UpdateOTA::readBlockFromClientToBuffer(size_t offset, size_t length)
+size_t UpdateOTA::readBlockFromClientToBuffer(size_t offset, size_t length, char *buffer)
 {
     // Read a block from the client to the buffer
-    if (_httpClient->getSize() < offset + length)
+    if (_streamLength < offset + length)
     {
-        length = _httpClient->getSize() - offset;
+        length = _streamLength - offset;
     }
 
     size_t readed = 0;                                      // Variable to keep track of the number of bytes readed.
-    readed = _wifiClientSecure->readBytes(_buffer, length); // Read the next block from the input stream.
+    readed = _wifiClient->readBytes(buffer, length); // Read the next block from the input stream.
 
     return readed;
 }
 
+#if UPDATE_OTA_FILE_SYNC
+static uint32_t pathHash(const char *path)
+{
+    // FNV-1a, enough to look up a few hundred paths
+    uint32_t hash = 2166136261u;
+    while (*path != '\0')
+        hash = (hash ^ (uint8_t)*path++) * 16777619u;
+    return hash;
+}
+
+UpdateOTAError UpdateOTA::downloadFile(fs::File &file, uint8_t *digest, bool verifySignature)
+{
+    beginSession();
+    UpdateOTAError err = processGetRequest();
+    int size = _httpClient->getSize();
+    if (err == UpdateOTAError::SUCCESS && size < 0)
+    {
+        Log_Error(_logger, "UpdateOTA downloadFile error: Response without length");
+        err = UpdateOTAError::UPDATE_PROGRESS_ERROR;
+    }
+    if (err != UpdateOTAError::SUCCESS)
+    {
+        endSession();
+        return err;
+    }
+
+    mbedtls_sha256_context context;
+    mbedtls_sha256_init(&context);
+    mbedtls_sha256_starts(&context, 0);
+
+    size_t remaining = size;
+    while (remaining > 0)
+    {
+        size_t length = remaining < BLOCK_SIZE_P ? remaining : BLOCK_SIZE_P;
+        size_t readed = _wifiClient->readBytes(_buffer, length);
+        if (readed != length)
+        {
+            err = UpdateOTAError::UPDATE_PROGRESS_ERROR;
+            break;
+        }
+        if (file.write((const uint8_t *)_buffer, length) != length)
+        {
+            err = UpdateOTAError::NO_ENOUGH_SPACE;
+            break;
+        }
+        mbedtls_sha256_update(&context, (const uint8_t *)_buffer, length);
+        if (verifySignature)
+            _signature.update((const uint8_t *)_buffer, length);
+        remaining -= length;
+    }
+
+    mbedtls_sha256_finish(&context, digest);
+    mbedtls_sha256_free(&context);
+    endSession();
+    return err;
+}
+
+void UpdateOTA::hashFile(fs::File &file, uint8_t *digest)
+{
+    mbedtls_sha256_context context;
+    mbedtls_sha256_init(&context);
+    mbedtls_sha256_starts(&context, 0);
+
+    size_t readed;
+    while ((readed = file.read((uint8_t *)_buffer, BLOCK_SIZE_P)) > 0)
+        mbedtls_sha256_update(&context, (const uint8_t *)_buffer, readed);
+
+    mbedtls_sha256_finish(&context, digest);
+    mbedtls_sha256_free(&context);
+}
+
+bool UpdateOTA::replaceFile(fs::FS &fs, const String &temporaryPath, const char *path)
+{
+    // LittleFS renames over an existing file in one step
+    if (fs.rename(temporaryPath, path))
+        return true;
+
+    // SPIFFS refuses, keep the old file as a backup until the new one is in place
+    String backupPath = String(path) + FILE_SYNC_BACKUP_SUFFIX;
+    fs.remove(backupPath);
+    if (!fs.rename(path, backupPath))
+        return false;
+    if (!fs.rename(temporaryPath, path))
+    {
+        fs.rename(backupPath, path);
+        return false;
+    }
+    fs.remove(backupPath);
+    return true;
+}
+
+void UpdateOTA::restoreBackups(fs::FS &fs, const char *directory)
+{
+    fs::File root = fs.open(directory, FILE_READ);
+    if (!root || !root.isDirectory())
+        return;
+
+    size_t suffixLength = strlen(FILE_SYNC_BACKUP_SUFFIX);
+    fs::File file = root.openNextFile();
+    while (file)
+    {
+        String path = file.path();
+        bool isDirectory = file.isDirectory();
+        file.close();
+
+        if (isDirectory)
+        {
+            restoreBackups(fs, path.c_str());
+        }
+        else if (path.endsWith(FILE_SYNC_BACKUP_SUFFIX))
+        {
+            // Without the original the swap did not finish, otherwise only the removal of the backup
+            String originalPath = path.substring(0, path.length() - suffixLength);
+            if (fs.exists(originalPath))
+            {
+                fs.remove(path);
+            }
+            else if (fs.rename(path, originalPath))
+            {
+                Log_Verbose(_logger, "UpdateOTA restoreBackups: Restored '%s'", originalPath.c_str());
+            }
+        }
+        file = root.openNextFile();
+    }
+    root.close();
+}
+
+uint16_t UpdateOTA::removeStaleFiles(fs::FS &fs, const String &manifestPath, uint16_t listed)
+{
+    // Without the manifest of the last sync no file is known to come from it
+    if (!fs.exists(FILE_SYNC_MANIFEST))
+        return 0;
+
+    // Hash the paths of the new manifest once, a collision only keeps a stale file
+    uint32_t *listedHashes = new (std::nothrow) uint32_t[listed];
+    if (listedHashes == nullptr)
+    {
+        Log_Error(_logger, "UpdateOTA removeStaleFiles error: Not enough memory for %u paths", listed);
+        return 0;
+    }
+    uint16_t count = 0;
+    UpdateOTAFileEntry entry;
+    fs::File manifest = fs.open(manifestPath, FILE_READ);
+    while (count < listed && manifest.available())
+    {
+        String line = manifest.readStringUntil('\n');
+        if (UpdateOTAFileManifest::parseLine(line.c_str(), &entry))
+            listedHashes[count++] = pathHash(entry.path);
+    }
+    manifest.close();
+    std::sort(listedHashes, listedHashes + count);
+
+    // Delete what the last sync installed and the new manifest no longer lists, files the
+    // application created itself were in neither
+    uint16_t removed = 0;
+    manifest = fs.open(FILE_SYNC_MANIFEST, FILE_READ);
+    while (manifest.available())
+    {
+        String line = manifest.readStringUntil('\n');
+        if (!UpdateOTAFileManifest::parseLine(line.c_str(), &entry) ||
+            std::binary_search(listedHashes, listedHashes + count, pathHash(entry.path)))
+            continue;
+        if (fs.remove(entry.path))
+        {
+            removed++;
+            Log_Verbose(_logger, "UpdateOTA removeStaleFiles: Removed '%s'", entry.path);
+        }
+    }
+    manifest.close();
+    delete[] listedHashes;
+    return removed;
+}
+#endif
+
+void UpdateOTA::restart()
+{
+    endSession();
+    Log_Verbose(_logger, "UpdateOTA restart: Rebooting into partition '%s'", esp_ota_get_boot_partition()->label);
+    UpdateOTATrace::record(UpdateOTATraceEvent::RESTART);
+    ESP.restart();
+}
+
 UpdateOTAError UpdateOTA::changeBootPartition()
 {
     // Change the boot partition
@@ -313,6 +2813,9 @@ UpdateOTAError UpdateOTA::selectPartition()
     if (_isFirmware)
     {
         _newPartition = esp_ota_get_next_update_partition(nullptr);
+#if UPDATE_OTA_BACKGROUND_STAGING
+        cancelBackgroundStaging(); // The slot is about to be overwritten.
+#endif
     }
     else
     {
@@ -334,14 +2837,26 @@ UpdateOTAError UpdateOTA::selectPartition()
 
 void UpdateOTA::printProgress(size_t written, size_t total)
 {
+#if UPDATE_OTA_PROGRESS_LOG
     // Print the progress
     float progress = (float)written / (float)total * 100;
     Log_Verbose(_logger, "UpdateOTA printProgress: Progress=%.2f%%", progress);
+#endif
+}
+
+void UpdateOTA::setIndicator(bool on)
+{
+#if UPDATE_OTA_INDICATOR
+    if (_relayModule != nullptr)
+        _relayModule->setState(on);
+#endif
 }
 
 void UpdateOTA::toggleLed()
 {
+#if UPDATE_OTA_INDICATOR
     // Toggle the LED
     if (_relayModule != nullptr)
         _relayModule->toggle();
+#endif
 }
@@ -0,0 +1,63 @@
+#include "UpdateOTABlockRing.hpp"
+
+#include <new> // std::nothrow
+
+UpdateOTABlockRing::~UpdateOTABlockRing()
+{
+    end();
+}
+
+bool UpdateOTABlockRing::begin(uint8_t slots, size_t slotSize)
+{
+    end();
+    if (slots == 0 || slots > BLOCK_RING_MAX_SLOTS)
+        return false;
+
+    _data = new (std::nothrow) uint8_t[slots * slotSize];
+    if (_data == nullptr)
+        return false;
+
+    _slots = slots;
+    _slotSize = slotSize;
+    _head.store(0, std::memory_order_relaxed);
+    _tail.store(0, std::memory_order_relaxed);
+    return true;
+}
+
+void UpdateOTABlockRing::end()
+{
+    delete[] _data;
+    _data = nullptr;
+    _slots = 0;
+}
+
+uint8_t *UpdateOTABlockRing::producerSlot()
+{
+    uint32_t head = _head.load(std::memory_order_relaxed);
+    if (head - _tail.load(std::memory_order_acquire) >= _slots)
+        return nullptr;
+    return _data + (head % _slots) * _slotSize;
+}
+
+void UpdateOTABlockRing::push(size_t offset, size_t length)
+{
+    uint32_t head = _head.load(std::memory_order_relaxed);
+    _offsets[head % _slots] = offset;
+    _lengths[head % _slots] = length;
+    _head.store(head + 1, std::memory_order_release);
+}
+
+uint8_t *UpdateOTABlockRing::consumerSlot(size_t *offset, size_t *length)
+{
+    uint32_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail == _head.load(std::memory_order_acquire))
+        return nullptr;
+    *offset = _offsets[tail % _slots];
+    *length = _lengths[tail % _slots];
+    return _data + (tail % _slots) * _slotSize;
+}
+
+void UpdateOTABlockRing::pop()
+{
+    _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
@@ -0,0 +1,59 @@
+#include "UpdateOTAFileManifest.hpp"
+
+#include <stdlib.h> // strtoul
+#include <string.h> // strcspn
+
+/**
+ * @brief Value of a hex digit, -1 if the character is not one
+ */
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+bool UpdateOTAFileManifest::parseLine(const char *line, UpdateOTAFileEntry *entry)
+{
+    if (line == nullptr || line[0] == '#')
+        return false;
+
+    // Hash
+    for (uint8_t i = 0; i < sizeof(entry->sha256); i++)
+    {
+        int high = hexValue(line[2 * i]);
+        int low = high < 0 ? -1 : hexValue(line[2 * i + 1]);
+        if (low < 0)
+            return false;
+        entry->sha256[i] = (high << 4) | low;
+    }
+    line += 2 * sizeof(entry->sha256);
+    if (*line != ' ')
+        return false;
+
+    // Size
+    char *end;
+    entry->size = strtoul(line + 1, &end, 10);
+    if (end == line + 1 || *end != ' ')
+        return false;
+
+    // Path, absolute and without parent references
+    const char *path = end + 1;
+    size_t length = strcspn(path, "\r\n");
+    if (path[0] != '/' || length >= sizeof(entry->path))
+        return false;
+    for (const char *segment = path + 1; segment <= path + length; segment++)
+    {
+        size_t segmentLength = strcspn(segment, "/\r\n");
+        if (segmentLength == 2 && segment[0] == '.' && segment[1] == '.')
+            return false;
+        segment += segmentLength;
+    }
+    memcpy(entry->path, path, length);
+    entry->path[length] = '\0';
+    return true;
+}
@@ -0,0 +1,152 @@
+#include "UpdateOTAFountainDecoder.hpp"
+
+#include <new>      // std::nothrow
+#include <string.h> // memset, memcpy
+
+UpdateOTAFountainDecoder::UpdateOTAFountainDecoder()
+{
+    memset(_slots, 0, sizeof(_slots));
+}
+
+UpdateOTAFountainDecoder::~UpdateOTAFountainDecoder()
+{
+    delete[] _decoded;
+}
+
+bool UpdateOTAFountainDecoder::begin(uint32_t imageSize)
+{
+    delete[] _decoded;
+    memset(_slots, 0, sizeof(_slots));
+    _blockCount = (imageSize + BLOCK_SIZE_P - 1) / BLOCK_SIZE_P;
+    _decodedCount = 0;
+    _symbolCounter = 0;
+
+    _decoded = new (std::nothrow) uint8_t[(_blockCount + 7) / 8];
+    if (_decoded == nullptr)
+        return false;
+    memset(_decoded, 0, (_blockCount + 7) / 8);
+    return true;
+}
+
+bool UpdateOTAFountainDecoder::addSymbol(uint32_t blockIndex, uint32_t seed, uint8_t *payload, const uint8_t **block)
+{
+    if (blockIndex >= _blockCount || isDecoded(blockIndex))
+        return false;
+
+    Slot *slot = slotForBlock(blockIndex);
+    slot->lastUsed = ++_symbolCounter;
+
+    // Reduce the new symbol against the existing rows
+    uint8_t coefficients = coefficientsForSeed(seed);
+    for (uint8_t pivot = 0; pivot < FOUNTAIN_SYMBOLS_PER_BLOCK; pivot++)
+    {
+        if ((slot->pivots & (1 << pivot)) && (coefficients & (1 << pivot)))
+        {
+            coefficients ^= slot->rows[pivot];
+            xorSymbol(payload, slot->data[pivot]);
+        }
+    }
+
+    if (coefficients == 0)
+        return false; // Linearly dependent, carries no new information.
+
+    // The lowest remaining bit becomes the pivot, clear it from the other rows
+    uint8_t pivot = __builtin_ctz(coefficients);
+    for (uint8_t row = 0; row < FOUNTAIN_SYMBOLS_PER_BLOCK; row++)
+    {
+        if ((slot->pivots & (1 << row)) && (slot->rows[row] & (1 << pivot)))
+        {
+            slot->rows[row] ^= coefficients;
+            xorSymbol(slot->data[row], payload);
+        }
+    }
+    slot->rows[pivot] = coefficients;
+    memcpy(slot->data[pivot], payload, FOUNTAIN_SYMBOL_SIZE);
+    slot->pivots |= 1 << pivot;
+    slot->rank++;
+
+    if (slot->rank < FOUNTAIN_SYMBOLS_PER_BLOCK)
+        return false;
+
+    // Full rank in reduced form: row i is source symbol i, so data is the block in order
+    *block = &slot->data[0][0];
+    return true;
+}
+
+void UpdateOTAFountainDecoder::releaseBlock(uint32_t blockIndex)
+{
+    for (uint8_t i = 0; i < FOUNTAIN_SLOTS; i++)
+    {
+        if (_slots[i].inUse && _slots[i].blockIndex == blockIndex)
+            _slots[i].inUse = false;
+    }
+
+    if (blockIndex < _blockCount && !isDecoded(blockIndex))
+    {
+        _decoded[blockIndex / 8] |= 1 << (blockIndex % 8);
+        _decodedCount++;
+    }
+}
+
+bool UpdateOTAFountainDecoder::isDecoded(uint32_t blockIndex) const
+{
+    return (_decoded[blockIndex / 8] >> (blockIndex % 8)) & 1;
+}
+
+uint32_t UpdateOTAFountainDecoder::blockCount() const
+{
+    return _blockCount;
+}
+
+uint32_t UpdateOTAFountainDecoder::decodedCount() const
+{
+    return _decodedCount;
+}
+
+uint8_t UpdateOTAFountainDecoder::coefficientsForSeed(uint32_t seed)
+{
+    // Systematic part: the first seeds carry the source symbols unmodified
+    if (seed < FOUNTAIN_SYMBOLS_PER_BLOCK)
+        return 1 << seed;
+
+    // Repair part: the murmur3 finalizer of the seed selects a non-empty combination
+    uint32_t x = seed;
+    x ^= x >> 16;
+    x *= 0x85EBCA6B;
+    x ^= x >> 13;
+    x *= 0xC2B2AE35;
+    x ^= x >> 16;
+    uint8_t coefficients = x & ((1 << FOUNTAIN_SYMBOLS_PER_BLOCK) - 1);
+    return coefficients != 0 ? coefficients : 1 << (seed % FOUNTAIN_SYMBOLS_PER_BLOCK);
+}
+
+UpdateOTAFountainDecoder::Slot *UpdateOTAFountainDecoder::slotForBlock(uint32_t blockIndex)
+{
+    Slot *candidate = nullptr;
+    for (uint8_t i = 0; i < FOUNTAIN_SLOTS; i++)
+    {
+        Slot *slot = &_slots[i];
+        if (slot->inUse && slot->blockIndex == blockIndex)
+            return slot;
+
+        // Prefer a free slot, otherwise the one that has not progressed for the longest time
+        if (candidate == nullptr || (!slot->inUse && candidate->inUse) ||
+            (slot->inUse == candidate->inUse && slot->lastUsed < candidate->lastUsed))
+            candidate = slot;
+    }
+
+    candidate->blockIndex = blockIndex;
+    candidate->pivots = 0;
+    candidate->rank = 0;
+    candidate->inUse = true;
+    return candidate;
+}
+
+void UpdateOTAFountainDecoder::xorSymbol(uint8_t *destination, const uint8_t *source)
+{
+    // Symbols are word aligned inside the slots and the packet buffer
+    uint32_t *destinationWords = (uint32_t *)destination;
+    const uint32_t *sourceWords = (const uint32_t *)source;
+    for (size_t i = 0; i < FOUNTAIN_SYMBOL_SIZE / sizeof(uint32_t); i++)
+        destinationWords[i] ^= sourceWords[i];
+}
@@ -0,0 +1,157 @@
+#include "UpdateOTAImageRecord.hpp"
+
+#include <Preferences.h>
+#include <stdio.h>  // snprintf
+#include <string.h> // strlen
+
+#define IMAGE_RECORD_NAMESPACE "updateota" // NVS namespace shared by all UpdateOTA records.
+
+/**
+ * @brief Build an NVS key ("<prefix>_<label>", at most 15 characters) for a partition
+ */
+static void recordKey(char *key, size_t keySize, const char *prefix, const esp_partition_t *partition)
+{
+    snprintf(key, keySize, "%s_%.10s", prefix, partition->label);
+}
+
+bool UpdateOTAImageRecord::save(const esp_partition_t *partition, uint32_t length, const uint8_t *signature, size_t signatureLength)
+{
+    if (partition == nullptr)
+        return false;
+
+    char lengthKey[16];
+    char signatureKey[16];
+    recordKey(lengthKey, sizeof(lengthKey), "len", partition);
+    recordKey(signatureKey, sizeof(signatureKey), "sig", partition);
+
+    Preferences preferences;
+    if (!preferences.begin(IMAGE_RECORD_NAMESPACE, false))
+        return false;
+
+    // Write the signature first, the length marks the record as complete
+    bool saved = preferences.putBytes(signatureKey, signature, signatureLength) == signatureLength &&
+                 preferences.putUInt(lengthKey, length) == sizeof(uint32_t);
+    preferences.end();
+    return saved;
+}
+
+bool UpdateOTAImageRecord::load(const esp_partition_t *partition, uint32_t *length, uint8_t *signature, size_t *signatureLength)
+{
+    if (partition == nullptr)
+        return false;
+
+    char lengthKey[16];
+    char signatureKey[16];
+    recordKey(lengthKey, sizeof(lengthKey), "len", partition);
+    recordKey(signatureKey, sizeof(signatureKey), "sig", partition);
+
+    Preferences preferences;
+    if (!preferences.begin(IMAGE_RECORD_NAMESPACE, true))
+        return false;
+
+    *length = preferences.getUInt(lengthKey, 0);
+    if (signature != nullptr && signatureLength != nullptr)
+        *signatureLength = preferences.getBytes(signatureKey, signature, *signatureLength);
+    preferences.end();
+
+    return *length != 0;
+}
+
+void UpdateOTAImageRecord::clear(const esp_partition_t *partition)
+{
+    if (partition == nullptr)
+        return;
+
+    char lengthKey[16];
+    char signatureKey[16];
+    char blankKey[16];
+    char tagKey[16];
+    recordKey(lengthKey, sizeof(lengthKey), "len", partition);
+    recordKey(signatureKey, sizeof(signatureKey), "sig", partition);
+    recordKey(blankKey, sizeof(blankKey), "blk", partition);
+    recordKey(tagKey, sizeof(tagKey), "tag", partition);
+
+    Preferences preferences;
+    if (!preferences.begin(IMAGE_RECORD_NAMESPACE, false))
+        return;
+
+    // Remove the length first so an interrupted clear never leaves a valid record
+    if (preferences.isKey(lengthKey))
+        preferences.remove(lengthKey);
+    if (preferences.isKey(signatureKey))
+        preferences.remove(signatureKey);
+    if (preferences.isKey(blankKey))
+        preferences.remove(blankKey);
+    if (preferences.isKey(tagKey))
+        preferences.remove(tagKey);
+    preferences.end();
+}
+
+bool UpdateOTAImageRecord::saveBlankEnd(const esp_partition_t *partition, uint32_t blankEnd)
+{
+    if (partition == nullptr)
+        return false;
+
+    char blankKey[16];
+    recordKey(blankKey, sizeof(blankKey), "blk", partition);
+
+    Preferences preferences;
+    if (!preferences.begin(IMAGE_RECORD_NAMESPACE, false))
+        return false;
+
+    bool saved = preferences.putUInt(blankKey, blankEnd) == sizeof(uint32_t);
+    preferences.end();
+    return saved;
+}
+
+uint32_t UpdateOTAImageRecord::loadBlankEnd(const esp_partition_t *partition)
+{
+    if (partition == nullptr)
+        return 0;
+
+    char blankKey[16];
+    recordKey(blankKey, sizeof(blankKey), "blk", partition);
+
+    Preferences preferences;
+    if (!preferences.begin(IMAGE_RECORD_NAMESPACE, true))
+        return 0;
+
+    uint32_t blankEnd = preferences.getUInt(blankKey, 0);
+    preferences.end();
+    return blankEnd;
+}
+
+bool UpdateOTAImageRecord::saveETag(const esp_partition_t *partition, const char *eTag)
+{
+    if (partition == nullptr || eTag == nullptr || eTag[0] == '\0')
+        return false;
+
+    char tagKey[16];
+    recordKey(tagKey, sizeof(tagKey), "tag", partition);
+
+    Preferences preferences;
+    if (!preferences.begin(IMAGE_RECORD_NAMESPACE, false))
+        return false;
+
+    bool saved = preferences.putString(tagKey, eTag) == strlen(eTag);
+    preferences.end();
+    return saved;
+}
+
+bool UpdateOTAImageRecord::loadETag(const esp_partition_t *partition, char *eTag, size_t eTagSize)
+{
+    eTag[0] = '\0';
+    if (partition == nullptr)
+        return false;
+
+    char tagKey[16];
+    recordKey(tagKey, sizeof(tagKey), "tag", partition);
+
+    Preferences preferences;
+    if (!preferences.begin(IMAGE_RECORD_NAMESPACE, true))
+        return false;
+
+    size_t length = preferences.isKey(tagKey) ? preferences.getString(tagKey, eTag, eTagSize) : 0;
+    preferences.end();
+    return length > 0;
+}
@@ -0,0 +1,55 @@
+#include "UpdateOTAPartitionWriter.hpp"
+
+#include "UpdateOTAInterface.hpp" // BLOCK_SIZE_P
+
+void UpdateOTAPartitionWriter::begin(const esp_partition_t *partition)
+{
+    _partition = partition;
+    _offset = 0;
+    _erasedEnd = 0;
+}
+
+bool UpdateOTAPartitionWriter::write(const void *data, size_t length)
+{
+    if (_partition == nullptr || _offset + length > _partition->size)
+        return false;
+
+    if (!eraseUpTo(_offset + length))
+        return false;
+    if (esp_partition_write(_partition, _offset, data, length) != ESP_OK)
+        return false;
+
+    _offset += length;
+    return true;
+}
+
+bool UpdateOTAPartitionWriter::skipTo(size_t offset)
+{
+    if (_partition == nullptr || offset < _offset || offset > _partition->size)
+        return false;
+
+    if (!eraseUpTo(offset))
+        return false;
+
+    _offset = offset;
+    return true;
+}
+
+size_t UpdateOTAPartitionWriter::offset() const
+{
+    return _offset;
+}
+
+bool UpdateOTAPartitionWriter::eraseUpTo(size_t end)
+{
+    if (end <= _erasedEnd)
+        return true;
+
+    // Whole sectors, the partition size is a multiple of the sector size
+    size_t alignedEnd = (end + BLOCK_SIZE_P - 1) / BLOCK_SIZE_P * BLOCK_SIZE_P;
+    if (esp_partition_erase_range(_partition, _erasedEnd, alignedEnd - _erasedEnd) != ESP_OK)
+        return false;
+
+    _erasedEnd = alignedEnd;
+    return true;
+}
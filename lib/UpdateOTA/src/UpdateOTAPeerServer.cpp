@@ -0,0 +1,191 @@
+#include "UpdateOTAPeerServer.hpp"
+#include "UpdateOTAImageRecord.hpp"
+
+UpdateOTAPeerServer::UpdateOTAPeerServer(uint16_t port, MultiPrinterLoggerInterface *logger)
+    : _logger(logger),
+      _server(port),
+      _port(port)
+{
+    Log_Debug(_logger, "UpdateOTAPeerServer created");
+}
+
+UpdateOTAPeerServer::~UpdateOTAPeerServer()
+{
+    Log_Debug(_logger, "UpdateOTAPeerServer destroyed");
+    end();
+}
+
+UpdateOTAError UpdateOTAPeerServer::begin()
+{
+    if (WiFi.status() != WL_CONNECTED)
+    {
+        Log_Error(_logger, "UpdateOTAPeerServer begin error: No internet connection");
+        return UpdateOTAError::NO_INTERNET;
+    }
+
+    // A staged update waiting for a reboot is newer than the running image
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    const esp_partition_t *boot = esp_ota_get_boot_partition();
+    _partition = (boot != nullptr && boot != running) ? boot : running;
+
+    _signatureLength = sizeof(_signature);
+    if (!UpdateOTAImageRecord::load(_partition, &_imageLength, _signature, &_signatureLength) || _signatureLength == 0)
+    {
+        Log_Error(_logger, "UpdateOTAPeerServer begin error: No verified image in partition '%s'", _partition->label);
+        _partition = nullptr;
+        return UpdateOTAError::NO_PARTITION_AVAILABLE;
+    }
+
+    _server.begin();
+    Log_Verbose(_logger, "UpdateOTAPeerServer begin: Sharing partition '%s', Size=%u, Port=%u", _partition->label, _imageLength, _port);
+    return UpdateOTAError::SUCCESS;
+}
+
+void UpdateOTAPeerServer::end()
+{
+    if (_client)
+        _client.stop();
+    _server.end();
+    _partition = nullptr;
+}
+
+void UpdateOTAPeerServer::handleClient()
+{
+    if (_partition == nullptr)
+        return;
+
+    // Accept a new client when idle
+    if (!_client || !_client.connected())
+    {
+        _client = _server.available();
+        if (!_client)
+            return;
+        beginResponse();
+        return;
+    }
+
+    if (_offset >= _end)
+    {
+        _client.stop();
+        return;
+    }
+
+    // Send the next block of the requested range
+    size_t length = _end - _offset;
+    if (length > BLOCK_SIZE_P)
+        length = BLOCK_SIZE_P;
+
+    if (esp_partition_read(_partition, _offset, _buffer, length) != ESP_OK ||
+        _client.write((const uint8_t *)_buffer, length) != length)
+    {
+        Log_Error(_logger, "UpdateOTAPeerServer handleClient error: Transfer aborted at offset=%u", _offset);
+        _client.stop();
+        return;
+    }
+    _offset += length;
+}
+
+void UpdateOTAPeerServer::getURL(char *buffer, uint8_t bufferSize)
+{
+    snprintf(buffer, bufferSize, "http://%s:%u/firmware.bin", WiFi.localIP().toString().c_str(), _port);
+}
+
+void UpdateOTAPeerServer::beginResponse()
+{
+    // One deadline for the whole header, a client dripping lines cannot stall the loop any longer
+    uint32_t deadline = millis() + PEER_HEADER_TIMEOUT_MS;
+    _offset = 0;
+    _end = 0;
+
+    // Request line: "GET /path HTTP/1.1"
+    String requestLine;
+    if (!readLine(requestLine, deadline))
+    {
+        sendStatus("408 Request Timeout");
+        return;
+    }
+    bool isSignature = requestLine.startsWith("GET /firmware.bin.sig ");
+    bool isImage = requestLine.startsWith("GET /firmware.bin ");
+    if (!isSignature && !isImage)
+    {
+        sendStatus("404 Not Found");
+        return;
+    }
+
+    // Headers, only Range is of interest
+    size_t rangeStart = 0;
+    size_t rangeEnd = _imageLength; // Exclusive
+    bool hasRange = false;
+    String header;
+    for (;;)
+    {
+        if (!readLine(header, deadline))
+        {
+            sendStatus("408 Request Timeout");
+            return;
+        }
+        header.trim();
+        if (header.length() == 0)
+            break;
+
+        if (header.startsWith("Range: bytes=") || header.startsWith("range: bytes="))
+        {
+            long first = 0;
+            long last = -1;
+            if (sscanf(header.c_str() + 13, "%ld-%ld", &first, &last) < 1)
+                first = -1;
+            if (first < 0 || (size_t)first >= _imageLength || (last >= 0 && last < first))
+            {
+                sendStatus("416 Range Not Satisfiable");
+                return;
+            }
+            rangeStart = first;
+            if (last >= 0 && (size_t)last < _imageLength)
+                rangeEnd = last + 1;
+            hasRange = true;
+        }
+    }
+
+    if (isSignature)
+    {
+        _client.printf("HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", _signatureLength);
+        _client.write(_signature, _signatureLength);
+        _client.stop();
+        return;
+    }
+
+    if (hasRange)
+        _client.printf("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %u-%u/%u\r\n", rangeStart, rangeEnd - 1, _imageLength);
+    else
+        _client.print("HTTP/1.1 200 OK\r\n");
+    _client.printf("Content-Type: application/octet-stream\r\nContent-Length: %u\r\nAccept-Ranges: bytes\r\nConnection: close\r\n\r\n", rangeEnd - rangeStart);
+
+    _offset = rangeStart;
+    _end = rangeEnd;
+    Log_Verbose(_logger, "UpdateOTAPeerServer beginResponse: Serving bytes %u-%u", rangeStart, rangeEnd - 1);
+}
+
+bool UpdateOTAPeerServer::readLine(String &line, uint32_t deadline)
+{
+    line = "";
+    while ((int32_t)(millis() - deadline) < 0 && _client.connected())
+    {
+        int c = _client.read();
+        if (c < 0)
+        {
+            delay(1); // Let the network stack run.
+            continue;
+        }
+        if (c == '\n')
+            return true;
+        if (line.length() < PEER_HEADER_LINE_MAX)
+            line += (char)c;
+    }
+    return false;
+}
+
+void UpdateOTAPeerServer::sendStatus(const char *status)
+{
+    _client.printf("HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+    _client.stop();
+}
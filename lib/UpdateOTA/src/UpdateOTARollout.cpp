@@ -0,0 +1,66 @@
+#include "UpdateOTARollout.hpp"
+
+#include <stdlib.h> // strtoul
+#include <string.h> // strncmp, strcspn
+
+/**
+ * @brief Copy a value up to the end of its line
+ */
+static void copyLine(char *destination, size_t destinationSize, const char *source, size_t length)
+{
+    if (length >= destinationSize)
+        length = destinationSize - 1;
+    memcpy(destination, source, length);
+    destination[length] = '\0';
+}
+
+bool UpdateOTARollout::parseManifest(const char *text, UpdateOTAManifest *manifest)
+{
+    memset(manifest, 0, sizeof(UpdateOTAManifest));
+    if (text == nullptr)
+        return false;
+
+    // First line: version, surrounding whitespace removed
+    while (*text == ' ' || *text == '\t')
+        text++;
+    size_t length = strcspn(text, "\r\n");
+    while (length > 0 && (text[length - 1] == ' ' || text[length - 1] == '\t'))
+        length--;
+    copyLine(manifest->version, sizeof(manifest->version), text, length);
+
+    // Remaining lines: key=value, unknown keys are ignored
+    const char *line = text + strcspn(text, "\r\n");
+    while (*line != '\0')
+    {
+        line += strspn(line, "\r\n");
+        length = strcspn(line, "\r\n");
+        if (strncmp(line, "rollout=", 8) == 0)
+            copyLine(manifest->rolloutId, sizeof(manifest->rolloutId), line + 8, length - 8);
+        else if (strncmp(line, "window=", 7) == 0)
+            manifest->windowSec = strtoul(line + 7, nullptr, 10);
+        else if (strncmp(line, "start=", 6) == 0)
+            manifest->startEpoch = strtoul(line + 6, nullptr, 10);
+        line += length;
+    }
+
+    return manifest->version[0] != '\0';
+}
+
+uint32_t UpdateOTARollout::slotOffsetSec(const uint8_t *mac, const char *rolloutId, uint32_t windowSec)
+{
+    // FNV-1a over the MAC and the rollout id, a new rollout reshuffles the fleet
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < 6; i++)
+        hash = (hash ^ mac[i]) * 16777619u;
+    for (const char *c = rolloutId; *c != '\0'; c++)
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+
+    // Murmur3 finalizer for a uniform spread over the window
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6B;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35;
+    hash ^= hash >> 16;
+
+    return ((uint64_t)hash * windowSec) >> 32;
+}
@@ -0,0 +1,82 @@
+#include "UpdateOTASignature.hpp"
+
+#include <string.h> // strlen, memcpy
+
+UpdateOTASignature::UpdateOTASignature()
+{
+    mbedtls_pk_init(&_publicKey);
+    mbedtls_sha256_init(&_sha256);
+}
+
+UpdateOTASignature::~UpdateOTASignature()
+{
+    mbedtls_pk_free(&_publicKey);
+    mbedtls_sha256_free(&_sha256);
+}
+
+bool UpdateOTASignature::setPublicKey(const char *publicKeyPem)
+{
+    // Drop the previous key before parsing the new one
+    mbedtls_pk_free(&_publicKey);
+    mbedtls_pk_init(&_publicKey);
+    _hasPublicKey = false;
+
+    if (publicKeyPem == nullptr)
+        return true;
+
+    // The PEM parser expects the length to include the null terminator
+    if (mbedtls_pk_parse_public_key(&_publicKey, (const unsigned char *)publicKeyPem, strlen(publicKeyPem) + 1) != 0)
+        return false;
+
+    _hasPublicKey = true;
+    return true;
+}
+
+bool UpdateOTASignature::hasPublicKey() const
+{
+    return _hasPublicKey;
+}
+
+bool UpdateOTASignature::setSignature(const uint8_t *signature, size_t length)
+{
+    if (length > SIGNATURE_MAX_SIZE)
+        return false;
+
+    if (signature != _signature)
+        memcpy(_signature, signature, length);
+    _signatureLength = length;
+    return true;
+}
+
+uint8_t *UpdateOTASignature::signatureBuffer()
+{
+    return _signature;
+}
+
+size_t UpdateOTASignature::signatureLength() const
+{
+    return _signatureLength;
+}
+
+void UpdateOTASignature::begin()
+{
+    mbedtls_sha256_free(&_sha256);
+    mbedtls_sha256_init(&_sha256);
+    mbedtls_sha256_starts(&_sha256, 0); // 0 selects SHA-256 rather than SHA-224
+}
+
+void UpdateOTASignature::update(const uint8_t *data, size_t length)
+{
+    mbedtls_sha256_update(&_sha256, data, length);
+}
+
+bool UpdateOTASignature::verify()
+{
+    uint8_t hash[32];
+    mbedtls_sha256_finish(&_sha256, hash);
+
+    if (!_hasPublicKey || _signatureLength == 0)
+        return false;
+
+    return mbedtls_pk_verify(&_publicKey, MBEDTLS_MD_SHA256, hash, sizeof(hash), _signature, _signatureLength) == 0;
+}
@@ -0,0 +1,50 @@
+#include "UpdateOTAStagingRecord.hpp"
+
+#include <Preferences.h>
+#include <string.h> // memset
+
+#define STAGING_RECORD_NAMESPACE "updateota" // NVS namespace shared by all UpdateOTA records.
+#define STAGING_RECORD_KEY "staging"         // Key of the staging state blob.
+
+bool UpdateOTAStagingRecord::save(const UpdateOTAStagingState &state)
+{
+    Preferences preferences;
+    if (!preferences.begin(STAGING_RECORD_NAMESPACE, false))
+        return false;
+
+    bool saved = preferences.putBytes(STAGING_RECORD_KEY, &state, sizeof(state)) == sizeof(state);
+    preferences.end();
+    return saved;
+}
+
+bool UpdateOTAStagingRecord::load(UpdateOTAStagingState *state)
+{
+    memset(state, 0, sizeof(UpdateOTAStagingState));
+
+    Preferences preferences;
+    if (!preferences.begin(STAGING_RECORD_NAMESPACE, true))
+        return false;
+
+    // A blob of another size comes from an older layout and is ignored
+    bool loaded = preferences.getBytesLength(STAGING_RECORD_KEY) == sizeof(UpdateOTAStagingState) &&
+                  preferences.getBytes(STAGING_RECORD_KEY, state, sizeof(UpdateOTAStagingState)) == sizeof(UpdateOTAStagingState);
+    preferences.end();
+
+    if (!loaded)
+        memset(state, 0, sizeof(UpdateOTAStagingState));
+    state->uRL[sizeof(state->uRL) - 1] = '\0';
+    state->eTag[sizeof(state->eTag) - 1] = '\0';
+    state->partition[sizeof(state->partition) - 1] = '\0';
+    return state->uRL[0] != '\0';
+}
+
+void UpdateOTAStagingRecord::clear()
+{
+    Preferences preferences;
+    if (!preferences.begin(STAGING_RECORD_NAMESPACE, false))
+        return;
+
+    if (preferences.isKey(STAGING_RECORD_KEY))
+        preferences.remove(STAGING_RECORD_KEY);
+    preferences.end();
+}
@@ -0,0 +1,142 @@
+#include "UpdateOTATrace.hpp"
+
+#include <esp_attr.h>   // RTC_NOINIT_ATTR
+#include <esp_system.h> // esp_reset_reason
+#include <string.h>     // memset
+#include <sys/time.h>   // gettimeofday
+
+RTC_NOINIT_ATTR UpdateOTATraceBuffer UpdateOTATrace::_buffer;
+uint32_t UpdateOTATrace::_bootOffsetMs = 0;
+bool UpdateOTATrace::_begun = false;
+
+void UpdateOTATrace::begin()
+{
+    if (_begun)
+        return;
+    _begun = true;
+
+    // System time is kept in RTC memory and survives software resets, esp_timer restarts at boot
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    uint32_t systemMs = (uint32_t)((uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000);
+    _bootOffsetMs = systemMs - (uint32_t)(esp_timer_get_time() / 1000);
+
+    // RTC memory holds random data after power-on
+    esp_reset_reason_t reason = esp_reset_reason();
+    if (_buffer.magic != TRACE_MAGIC || reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT)
+        clear();
+
+    // The value dates the app start back from now, in front of it are reset, bootloader and image checks
+    uint32_t sinceStartMs = esp_timer_get_time() / 1000;
+    record(UpdateOTATraceEvent::BOOT, reason, sinceStartMs < UINT16_MAX ? sinceStartMs : UINT16_MAX);
+}
+
+void UpdateOTATrace::clear()
+{
+    memset(&_buffer, 0, sizeof(_buffer));
+    _buffer.magic = TRACE_MAGIC;
+}
+
+uint16_t UpdateOTATrace::count()
+{
+    return _buffer.head < TRACE_CAPACITY ? _buffer.head : TRACE_CAPACITY;
+}
+
+bool UpdateOTATrace::get(uint16_t index, UpdateOTATraceRecord *record)
+{
+    uint16_t available = count();
+    if (index >= available)
+        return false;
+    *record = _buffer.records[(_buffer.head - available + index) % TRACE_CAPACITY];
+    return true;
+}
+
+uint32_t UpdateOTATrace::rebootGapMs()
+{
+    // The newest BOOT preceded directly by a RESTART
+    UpdateOTATraceRecord previous;
+    UpdateOTATraceRecord current;
+    for (uint16_t i = count(); i > 1; i--)
+    {
+        get(i - 1, &current);
+        get(i - 2, &previous);
+        if (current.event == UpdateOTATraceEvent::BOOT && previous.event == UpdateOTATraceEvent::RESTART)
+            return current.timeMs - previous.timeMs;
+    }
+    return 0;
+}
+
+bool UpdateOTATrace::downtime(UpdateOTADowntime *downtime)
+{
+    // The newest BOOT preceded directly by a RESTART, and the first SERVICE_READY after it
+    UpdateOTATraceRecord record;
+    UpdateOTATraceRecord restart;
+    uint16_t total = count();
+    uint16_t boot = total;
+    for (uint16_t i = total; i > 1 && boot == total; i--)
+    {
+        get(i - 1, &record);
+        get(i - 2, &restart);
+        if (record.event == UpdateOTATraceEvent::BOOT && restart.event == UpdateOTATraceEvent::RESTART)
+            boot = i - 1;
+    }
+    if (boot == total)
+        return false;
+
+    UpdateOTATraceRecord ready;
+    uint16_t i = boot + 1;
+    while (get(i, &ready) && ready.event != UpdateOTATraceEvent::SERVICE_READY)
+        i++;
+    if (i >= total)
+        return false;
+
+    // SERVICE_STOPPED of the same update, if the application marked it
+    UpdateOTATraceRecord stopped;
+    downtime->shutdownMs = 0;
+    for (uint16_t j = boot - 1; j > 0; j--)
+    {
+        get(j - 1, &stopped);
+        if (stopped.event == UpdateOTATraceEvent::SERVICE_STOPPED)
+            downtime->shutdownMs = restart.timeMs - stopped.timeMs;
+        if (stopped.event == UpdateOTATraceEvent::SERVICE_STOPPED || stopped.event == UpdateOTATraceEvent::BOOT)
+            break;
+    }
+
+    get(boot, &record);
+    uint32_t appStartMs = record.timeMs - record.value;
+    downtime->bootMs = appStartMs - restart.timeMs;
+    downtime->initMs = ready.timeMs - appStartMs;
+    downtime->totalMs = downtime->shutdownMs + downtime->bootMs + downtime->initMs;
+    return true;
+}
+
+const char *UpdateOTATrace::eventName(UpdateOTATraceEvent event)
+{
+    switch (event)
+    {
+    case UpdateOTATraceEvent::BOOT:
+        return "BOOT";
+    case UpdateOTATraceEvent::UPDATE_START:
+        return "UPDATE_START";
+    case UpdateOTATraceEvent::DOWNLOAD_START:
+        return "DOWNLOAD_START";
+    case UpdateOTATraceEvent::BLOCK:
+        return "BLOCK";
+    case UpdateOTATraceEvent::MIRROR_SWITCH:
+        return "MIRROR_SWITCH";
+    case UpdateOTATraceEvent::VERIFY:
+        return "VERIFY";
+    case UpdateOTATraceEvent::ACTIVATE:
+        return "ACTIVATE";
+    case UpdateOTATraceEvent::RESTART:
+        return "RESTART";
+    case UpdateOTATraceEvent::ERROR:
+        return "ERROR";
+    case UpdateOTATraceEvent::SERVICE_STOPPED:
+        return "SERVICE_STOPPED";
+    case UpdateOTATraceEvent::SERVICE_READY:
+        return "SERVICE_READY";
+    default:
+        return "UNKNOWN";
+    }
+}
@@ -0,0 +1,118 @@
+#include "UpdateOTAVersion.hpp"
+
+#include <string.h> // strcspn
+
+/**
+ * @brief Parse a decimal number, advancing the text
+ * @return false if the text does not start with a digit
+ */
+static bool parseNumber(const char **text, uint32_t *number)
+{
+    if (**text < '0' || **text > '9')
+        return false;
+    *number = 0;
+    while (**text >= '0' && **text <= '9')
+        *number = *number * 10 + (*(*text)++ - '0');
+    return true;
+}
+
+/**
+ * @brief Check if a pre-release identifier is all digits
+ */
+static bool isNumeric(const char *identifier, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        if (identifier[i] < '0' || identifier[i] > '9')
+            return false;
+    return length > 0;
+}
+
+bool UpdateOTAVersion::parse(const char *text, UpdateOTASemver *version)
+{
+    *version = {};
+    if (text == nullptr)
+        return false;
+
+    while (*text == ' ' || *text == '\t')
+        text++;
+    if (*text == 'v' || *text == 'V')
+        text++;
+
+    // Missing minor and patch count as zero, "5.1" is "5.1.0"
+    if (!parseNumber(&text, &version->major))
+        return false;
+    if (*text == '.' && (text++, !parseNumber(&text, &version->minor)))
+        return false;
+    if (*text == '.' && (text++, !parseNumber(&text, &version->patch)))
+        return false;
+
+    if (*text == '-')
+    {
+        text++;
+        size_t length = strcspn(text, "+ \t\r\n");
+        if (length == 0 || length > UINT8_MAX)
+            return false;
+        version->preRelease = text;
+        version->preReleaseLength = length;
+    }
+    return true;
+}
+
+int8_t UpdateOTAVersion::compare(const UpdateOTASemver &a, const UpdateOTASemver &b)
+{
+    if (a.major != b.major)
+        return a.major < b.major ? -1 : 1;
+    if (a.minor != b.minor)
+        return a.minor < b.minor ? -1 : 1;
+    if (a.patch != b.patch)
+        return a.patch < b.patch ? -1 : 1;
+
+    // A release is newer than any of its pre-releases
+    if (a.preReleaseLength == 0 || b.preReleaseLength == 0)
+        return (a.preReleaseLength == 0) - (b.preReleaseLength == 0);
+    return comparePreRelease(a, b);
+}
+
+int8_t UpdateOTAVersion::comparePreRelease(const UpdateOTASemver &a, const UpdateOTASemver &b)
+{
+    const char *x = a.preRelease, *xEnd = a.preRelease + a.preReleaseLength;
+    const char *y = b.preRelease, *yEnd = b.preRelease + b.preReleaseLength;
+    while (x < xEnd && y < yEnd)
+    {
+        size_t xLength = 0, yLength = 0;
+        while (x + xLength < xEnd && x[xLength] != '.')
+            xLength++;
+        while (y + yLength < yEnd && y[yLength] != '.')
+            yLength++;
+
+        // Numeric identifiers compare by value and are lower than alphanumeric ones
+        bool xNumeric = isNumeric(x, xLength), yNumeric = isNumeric(y, yLength);
+        int result;
+        if (xNumeric && yNumeric)
+        {
+            while (xLength > 1 && *x == '0')
+                x++, xLength--;
+            while (yLength > 1 && *y == '0')
+                y++, yLength--;
+            result = xLength != yLength ? (int)xLength - (int)yLength : strncmp(x, y, xLength);
+        }
+        else if (xNumeric != yNumeric)
+        {
+            result = xNumeric ? -1 : 1;
+        }
+        else
+        {
+            result = strncmp(x, y, xLength < yLength ? xLength : yLength);
+            if (result == 0)
+                result = (int)xLength - (int)yLength;
+        }
+        if (result != 0)
+            return result < 0 ? -1 : 1;
+
+        x += xLength + (x + xLength < xEnd);
+        y += yLength + (y + yLength < yEnd);
+    }
+
+    // More identifiers win when all before are equal, "rc.1" is newer than "rc"
+    return (x < xEnd) - (y < yEnd);
+}
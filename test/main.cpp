@@ -3,6 +3,11 @@
 #include <gtest/gtest.h>
 #include "loggme.hpp"
 #include "test_UpdateOTA.hpp"
+#include "test_UpdateOTAFileManifest.hpp"
+#include "test_UpdateOTAFountainDecoder.hpp"
+#include "test_UpdateOTARollout.hpp"
+#include "test_UpdateOTATrace.hpp"
+#include "test_UpdateOTAVersion.hpp"
 
 void setup()
 {
@@ -87,6 +87,16 @@ TEST_F(UpdateOTATest, startUpdate_NO_INTERNET)
     EXPECT_EQ(err, UpdateOTAError::NO_INTERNET);
 }
 
+// startUpdate no internet is reported as transient
+TEST_F(UpdateOTATest, getLastResult_NO_INTERNET)
+{
+    UpdateOTAError err = _updateOTA->startUpdate(_uRL, true);
+    EXPECT_EQ(err, UpdateOTAError::NO_INTERNET);
+    EXPECT_EQ(_updateOTA->getLastResult().error, UpdateOTAError::NO_INTERNET);
+    EXPECT_TRUE(_updateOTA->getLastResult().transient);
+    EXPECT_EQ(_updateOTA->getLastResult().bytesCompleted, 0);
+}
+
 // startUpdate page not found
 TEST_F(UpdateOTATest, startUpdate_PAGE_NOT_FOUND)
 {
@@ -106,6 +116,40 @@ TEST_F(UpdateOTATest, startUpdate_PAGE_NOT_FOUND)
     WiFi.mode(WIFI_OFF);
 }
 
+// startUpdate plain HTTP without signing key
+TEST_F(UpdateOTATest, startUpdate_HTTP_SIGNATURE_INVALID)
+{
+    WiFi.mode(WIFI_STA);
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD, WIFI_CHANNEL);
+    int timeOut = 5;
+    while (WiFi.status() != WL_CONNECTED && timeOut > 0)
+    {
+        delay(500);
+        timeOut--;
+    }
+
+    UpdateOTAError err = _updateOTA->startUpdate("http://raw.githubusercontent.com/ronny-antoon/UpdateOTA/main/examples/firmware.bin", true);
+    EXPECT_EQ(err, UpdateOTAError::SIGNATURE_INVALID);
+
+    WiFi.disconnect(true);
+    WiFi.mode(WIFI_OFF);
+}
+
+// validateBootedImage on an image that is not pending verification
+TEST_F(UpdateOTATest, validateBootedImage_NOT_PENDING)
+{
+    UpdateOTAError err = _updateOTA->validateBootedImage([]() { return false; }, 0);
+    EXPECT_EQ(err, UpdateOTAError::SUCCESS);
+    EXPECT_EQ(_updateOTA->getValidationTimeMs(), 0);
+}
+
+// activateStagedUpdate without a staged firmware
+TEST_F(UpdateOTATest, activateStagedUpdate_NO_STAGED_UPDATE)
+{
+    EXPECT_FALSE(_updateOTA->hasStagedUpdate());
+    EXPECT_EQ(_updateOTA->activateStagedUpdate(), UpdateOTAError::NO_STAGED_UPDATE);
+}
+
 // startUpdate success
 TEST_F(UpdateOTATest, startUpdate_SUCCESS)
 {
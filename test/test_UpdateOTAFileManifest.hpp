@@ -0,0 +1,42 @@
+#ifndef TEST_UPDATE_OTA_FILE_MANIFEST_HPP
+#define TEST_UPDATE_OTA_FILE_MANIFEST_HPP
+
+#include <gtest/gtest.h>
+#include "UpdateOTAFileManifest.hpp"
+
+// Valid file entry
+TEST(UpdateOTAFileManifestTest, parseLine_ENTRY)
+{
+    UpdateOTAFileEntry entry;
+    EXPECT_TRUE(UpdateOTAFileManifest::parseLine("9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08 2048 /www/index.html\r", &entry));
+    EXPECT_EQ(entry.sha256[0], 0x9f);
+    EXPECT_EQ(entry.sha256[31], 0x08);
+    EXPECT_EQ(entry.size, 2048);
+    EXPECT_STREQ(entry.path, "/www/index.html");
+}
+
+// Comments, bad hashes and relative paths are rejected
+TEST(UpdateOTAFileManifestTest, parseLine_INVALID)
+{
+    UpdateOTAFileEntry entry;
+    EXPECT_FALSE(UpdateOTAFileManifest::parseLine("# generated", &entry));
+    EXPECT_FALSE(UpdateOTAFileManifest::parseLine("", &entry));
+    EXPECT_FALSE(UpdateOTAFileManifest::parseLine("9f86d0 2048 /www/index.html", &entry));
+    EXPECT_FALSE(UpdateOTAFileManifest::parseLine("9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08 2048 www/index.html", &entry));
+    EXPECT_FALSE(UpdateOTAFileManifest::parseLine("9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08 2048 /www/../nvs", &entry));
+}
+
+// ".." is rejected as any path component, names that only contain dots are kept
+TEST(UpdateOTAFileManifestTest, parseLine_PARENT)
+{
+    UpdateOTAFileEntry entry;
+    EXPECT_FALSE(UpdateOTAFileManifest::parseLine("9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08 2048 /www/..", &entry));
+    EXPECT_FALSE(UpdateOTAFileManifest::parseLine("9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08 2048 /www/..\r", &entry));
+    EXPECT_FALSE(UpdateOTAFileManifest::parseLine("9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08 2048 /..", &entry));
+    EXPECT_FALSE(UpdateOTAFileManifest::parseLine("9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08 2048 /../nvs", &entry));
+    EXPECT_TRUE(UpdateOTAFileManifest::parseLine("9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08 2048 /www/..config", &entry));
+    EXPECT_STREQ(entry.path, "/www/..config");
+    EXPECT_TRUE(UpdateOTAFileManifest::parseLine("9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08 2048 /a../b", &entry));
+}
+
+#endif // TEST_UPDATE_OTA_FILE_MANIFEST_HPP
@@ -0,0 +1,70 @@
+#ifndef TEST_UPDATE_OTA_FOUNTAIN_DECODER_HPP
+#define TEST_UPDATE_OTA_FOUNTAIN_DECODER_HPP
+
+#include <gtest/gtest.h>
+#include "UpdateOTAFountainDecoder.hpp"
+
+class UpdateOTAFountainDecoderTest : public ::testing::Test
+{
+protected:
+    UpdateOTAFountainDecoder *_decoder;
+    uint8_t _block[BLOCK_SIZE_P];
+    uint32_t _payload[FOUNTAIN_SYMBOL_SIZE / sizeof(uint32_t)];
+
+    void SetUp() override
+    {
+        _decoder = new UpdateOTAFountainDecoder();
+        for (uint32_t i = 0; i < BLOCK_SIZE_P; i++)
+            _block[i] = (uint8_t)(i * 7 + 3);
+    }
+
+    void TearDown() override
+    {
+        delete _decoder;
+    }
+
+    // Build the encoded symbol of _block for a seed, as the sender does
+    uint8_t *encode(uint32_t seed)
+    {
+        uint8_t coefficients = UpdateOTAFountainDecoder::coefficientsForSeed(seed);
+        uint8_t *payload = (uint8_t *)_payload;
+        memset(payload, 0, FOUNTAIN_SYMBOL_SIZE);
+        for (uint8_t symbol = 0; symbol < FOUNTAIN_SYMBOLS_PER_BLOCK; symbol++)
+            if (coefficients & (1 << symbol))
+                for (uint32_t i = 0; i < FOUNTAIN_SYMBOL_SIZE; i++)
+                    payload[i] ^= _block[symbol * FOUNTAIN_SYMBOL_SIZE + i];
+        return payload;
+    }
+};
+
+// Source symbols alone decode the block
+TEST_F(UpdateOTAFountainDecoderTest, addSymbol_SYSTEMATIC)
+{
+    ASSERT_TRUE(_decoder->begin(BLOCK_SIZE_P));
+    const uint8_t *block = nullptr;
+    bool complete = false;
+    for (uint32_t seed = 0; seed < FOUNTAIN_SYMBOLS_PER_BLOCK; seed++)
+        complete = _decoder->addSymbol(0, seed, encode(seed), &block);
+
+    ASSERT_TRUE(complete);
+    EXPECT_EQ(memcmp(block, _block, BLOCK_SIZE_P), 0);
+}
+
+// Repair symbols replace lost source symbols
+TEST_F(UpdateOTAFountainDecoderTest, addSymbol_REPAIR)
+{
+    ASSERT_TRUE(_decoder->begin(BLOCK_SIZE_P));
+    const uint8_t *block = nullptr;
+    bool complete = false;
+    for (uint32_t seed = 3; seed < 64 && !complete; seed += 2) // Every other symbol is lost
+        complete = _decoder->addSymbol(0, seed, encode(seed), &block);
+
+    ASSERT_TRUE(complete);
+    EXPECT_EQ(memcmp(block, _block, BLOCK_SIZE_P), 0);
+
+    _decoder->releaseBlock(0);
+    EXPECT_TRUE(_decoder->isDecoded(0));
+    EXPECT_EQ(_decoder->decodedCount(), _decoder->blockCount());
+}
+
+#endif // TEST_UPDATE_OTA_FOUNTAIN_DECODER_HPP
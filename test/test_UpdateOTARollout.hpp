@@ -0,0 +1,48 @@
+#ifndef TEST_UPDATE_OTA_ROLLOUT_HPP
+#define TEST_UPDATE_OTA_ROLLOUT_HPP
+
+#include <gtest/gtest.h>
+#include "UpdateOTARollout.hpp"
+
+// Plain version file
+TEST(UpdateOTARolloutTest, parseManifest_VERSION_ONLY)
+{
+    UpdateOTAManifest manifest;
+    EXPECT_TRUE(UpdateOTARollout::parseManifest("5.1.1\n", &manifest));
+    EXPECT_STREQ(manifest.version, "5.1.1");
+    EXPECT_STREQ(manifest.rolloutId, "");
+    EXPECT_EQ(manifest.windowSec, 0);
+}
+
+// Version file with rollout lines
+TEST(UpdateOTARolloutTest, parseManifest_ROLLOUT)
+{
+    UpdateOTAManifest manifest;
+    EXPECT_TRUE(UpdateOTARollout::parseManifest("5.2.0\r\nrollout=r42\r\nwindow=3600\r\nstart=1710000000\r\n", &manifest));
+    EXPECT_STREQ(manifest.version, "5.2.0");
+    EXPECT_STREQ(manifest.rolloutId, "r42");
+    EXPECT_EQ(manifest.windowSec, 3600);
+    EXPECT_EQ(manifest.startEpoch, 1710000000);
+}
+
+// Empty manifest
+TEST(UpdateOTARolloutTest, parseManifest_EMPTY)
+{
+    UpdateOTAManifest manifest;
+    EXPECT_FALSE(UpdateOTARollout::parseManifest("\n", &manifest));
+}
+
+// Slots stay inside the window and scale with it
+TEST(UpdateOTARolloutTest, slotOffsetSec_WINDOW)
+{
+    const uint8_t mac[6] = {0x24, 0x0A, 0xC4, 0x12, 0x34, 0x56};
+    uint32_t narrow = UpdateOTARollout::slotOffsetSec(mac, "r42", 600);
+    uint32_t wide = UpdateOTARollout::slotOffsetSec(mac, "r42", 6000);
+    EXPECT_LT(narrow, 600);
+    EXPECT_LT(wide, 6000);
+    EXPECT_LE(narrow * 10, wide);
+    EXPECT_GT(narrow * 10 + 10, wide);
+    EXPECT_EQ(UpdateOTARollout::slotOffsetSec(mac, "r42", 600), narrow);
+}
+
+#endif // TEST_UPDATE_OTA_ROLLOUT_HPP
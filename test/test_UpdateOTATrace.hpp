@@ -0,0 +1,66 @@
+#ifndef TEST_UPDATE_OTA_TRACE_HPP
+#define TEST_UPDATE_OTA_TRACE_HPP
+
+#include <gtest/gtest.h>
+#include "UpdateOTATrace.hpp"
+
+// Records come back oldest first
+TEST(UpdateOTATraceTest, record_ORDER)
+{
+    UpdateOTATrace::begin();
+    UpdateOTATrace::clear();
+    UpdateOTATrace::record(UpdateOTATraceEvent::UPDATE_START, 1);
+    UpdateOTATrace::record(UpdateOTATraceEvent::BLOCK, 0, 42);
+
+    UpdateOTATraceRecord record;
+    EXPECT_EQ(UpdateOTATrace::count(), 2);
+    EXPECT_TRUE(UpdateOTATrace::get(0, &record));
+    EXPECT_EQ(record.event, UpdateOTATraceEvent::UPDATE_START);
+    EXPECT_EQ(record.code, 1);
+    EXPECT_TRUE(UpdateOTATrace::get(1, &record));
+    EXPECT_EQ(record.value, 42);
+    EXPECT_FALSE(UpdateOTATrace::get(2, &record));
+}
+
+// The oldest records are overwritten when the ring is full
+TEST(UpdateOTATraceTest, record_WRAP)
+{
+    UpdateOTATrace::clear();
+    for (uint16_t i = 0; i < TRACE_CAPACITY + 10; i++)
+        UpdateOTATrace::record(UpdateOTATraceEvent::BLOCK, 0, i);
+
+    UpdateOTATraceRecord record;
+    EXPECT_EQ(UpdateOTATrace::count(), TRACE_CAPACITY);
+    EXPECT_TRUE(UpdateOTATrace::get(0, &record));
+    EXPECT_EQ(record.value, 10);
+    EXPECT_TRUE(UpdateOTATrace::get(TRACE_CAPACITY - 1, &record));
+    EXPECT_EQ(record.value, TRACE_CAPACITY + 9);
+}
+
+// A gap needs a BOOT right after a RESTART
+TEST(UpdateOTATraceTest, rebootGapMs_RESTART_BOOT)
+{
+    UpdateOTATrace::clear();
+    UpdateOTATrace::record(UpdateOTATraceEvent::RESTART);
+    EXPECT_EQ(UpdateOTATrace::rebootGapMs(), 0);
+    UpdateOTATrace::record(UpdateOTATraceEvent::BOOT);
+    EXPECT_LT(UpdateOTATrace::rebootGapMs(), 1000);
+}
+
+// Downtime needs a reboot followed by SERVICE_READY
+TEST(UpdateOTATraceTest, downtime_PHASES)
+{
+    UpdateOTADowntime downtime;
+    UpdateOTATrace::clear();
+    UpdateOTATrace::record(UpdateOTATraceEvent::SERVICE_STOPPED);
+    UpdateOTATrace::record(UpdateOTATraceEvent::RESTART);
+    UpdateOTATrace::record(UpdateOTATraceEvent::BOOT, 0, 0);
+    EXPECT_FALSE(UpdateOTATrace::downtime(&downtime));
+
+    UpdateOTATrace::record(UpdateOTATraceEvent::SERVICE_READY);
+    EXPECT_TRUE(UpdateOTATrace::downtime(&downtime));
+    EXPECT_EQ(downtime.totalMs, downtime.shutdownMs + downtime.bootMs + downtime.initMs);
+    EXPECT_LT(downtime.totalMs, 1000);
+}
+
+#endif // TEST_UPDATE_OTA_TRACE_HPP
@@ -0,0 +1,60 @@
+#ifndef TEST_UPDATE_OTA_VERSION_HPP
+#define TEST_UPDATE_OTA_VERSION_HPP
+
+#include <gtest/gtest.h>
+#include "UpdateOTAVersion.hpp"
+
+/**
+ * @brief Compare two version strings
+ */
+static int8_t compareVersions(const char *a, const char *b)
+{
+    UpdateOTASemver x, y;
+    EXPECT_TRUE(UpdateOTAVersion::parse(a, &x));
+    EXPECT_TRUE(UpdateOTAVersion::parse(b, &y));
+    return UpdateOTAVersion::compare(x, y);
+}
+
+// Full version with pre-release and build metadata
+TEST(UpdateOTAVersionTest, parse_FULL)
+{
+    UpdateOTASemver version;
+    EXPECT_TRUE(UpdateOTAVersion::parse(" v5.12.3-rc.1+build.7\n", &version));
+    EXPECT_EQ(version.major, 5);
+    EXPECT_EQ(version.minor, 12);
+    EXPECT_EQ(version.patch, 3);
+    EXPECT_EQ(version.preReleaseLength, 4);
+    EXPECT_EQ(strncmp(version.preRelease, "rc.1", 4), 0);
+}
+
+// Text that is no version
+TEST(UpdateOTAVersionTest, parse_INVALID)
+{
+    UpdateOTASemver version;
+    EXPECT_FALSE(UpdateOTAVersion::parse("", &version));
+    EXPECT_FALSE(UpdateOTAVersion::parse("release", &version));
+    EXPECT_FALSE(UpdateOTAVersion::parse("5.", &version));
+    EXPECT_FALSE(UpdateOTAVersion::parse("5.1.0-", &version));
+}
+
+// Numeric parts compare by value, missing parts are zero
+TEST(UpdateOTAVersionTest, compare_NUMERIC)
+{
+    EXPECT_LT(compareVersions("5.9.0", "5.10.0"), 0);
+    EXPECT_GT(compareVersions("6.0.0", "5.99.99"), 0);
+    EXPECT_EQ(compareVersions("v5.1", "5.1.0"), 0);
+    EXPECT_EQ(compareVersions("5.1.0+a", "5.1.0+b"), 0);
+}
+
+// Pre-release order of semver 2.0.0
+TEST(UpdateOTAVersionTest, compare_PRE_RELEASE)
+{
+    EXPECT_LT(compareVersions("1.0.0-alpha", "1.0.0-alpha.1"), 0);
+    EXPECT_LT(compareVersions("1.0.0-alpha.1", "1.0.0-alpha.beta"), 0);
+    EXPECT_LT(compareVersions("1.0.0-alpha.beta", "1.0.0-beta"), 0);
+    EXPECT_LT(compareVersions("1.0.0-beta.2", "1.0.0-beta.11"), 0);
+    EXPECT_LT(compareVersions("1.0.0-rc.1", "1.0.0"), 0);
+    EXPECT_EQ(compareVersions("1.0.0-rc.1", "1.0.0-rc.1"), 0);
+}
+
+#endif // TEST_UPDATE_OTA_VERSION_HPP
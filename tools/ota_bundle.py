@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+"""Bundle builder for UpdateOTA::startBundleUpdate().
+
+Bundle layout (little-endian), must match UpdateOTABundle.hpp:
+    uint32 magic ("UOBN"), uint32 count
+    count x (char label[16], uint8 type, uint8 subtype, uint16 reserved, uint32 length)
+    payloads in the order of the entries, the app payload first
+
+Each payload is given as TARGET=FILE where TARGET is
+    app         the next OTA app slot
+    spiffs      the first SPIFFS/LittleFS data partition
+    <label>     the data partition with that label in partitions.csv
+
+    ota_bundle.py build -o bundle.bin app=firmware.bin spiffs=spiffs.bin config=config.bin
+    ota_bundle.py list bundle.bin
+    openssl dgst -sha256 -sign private.pem -out bundle.bin.sig bundle.bin
+"""
+
+import argparse
+import struct
+
+MAGIC = 0x4E424F55
+HEADER = struct.Struct("<II")
+ENTRY = struct.Struct("<16sBBHI")
+TYPE_APP = 0x00
+TYPE_DATA = 0x01
+SUBTYPE_SPIFFS = 0x82
+SUBTYPE_ANY = 0xFF
+MAX_TARGETS = 8
+
+
+def target_entry(target, length):
+    """Index entry of a payload for the given target name."""
+    if target == "app":
+        return ENTRY.pack(b"", TYPE_APP, SUBTYPE_ANY, 0, length)
+    if target == "spiffs":
+        return ENTRY.pack(b"", TYPE_DATA, SUBTYPE_SPIFFS, 0, length)
+    label = target.encode()
+    if len(label) > 16:
+        raise ValueError("partition label longer than 16 characters: %s" % target)
+    return ENTRY.pack(label, TYPE_DATA, SUBTYPE_ANY, 0, length)
+
+
+def build(args):
+    payloads = []
+    for item in args.payloads:
+        target, separator, path = item.partition("=")
+        if not separator:
+            raise SystemExit("expected TARGET=FILE, got %s" % item)
+        with open(path, "rb") as f:
+            payloads.append((target, f.read()))
+    if not 0 < len(payloads) <= MAX_TARGETS:
+        raise SystemExit("a bundle holds 1 to %d payloads" % MAX_TARGETS)
+    if len({target for target, _ in payloads}) != len(payloads):
+        raise SystemExit("each target may appear only once")
+    # The device checks the app header before any data partition is overwritten
+    payloads.sort(key=lambda payload: payload[0] != "app")
+
+    with open(args.output, "wb") as f:
+        f.write(HEADER.pack(MAGIC, len(payloads)))
+        for target, data in payloads:
+            f.write(target_entry(target, len(data)))
+        for _, data in payloads:
+            f.write(data)
+    total = HEADER.size + ENTRY.size * len(payloads) + sum(len(data) for _, data in payloads)
+    print("%s: %d payloads, %d bytes" % (args.output, len(payloads), total))
+
+
+def list_bundle(args):
+    with open(args.bundle, "rb") as f:
+        data = f.read()
+    magic, count = HEADER.unpack_from(data, 0)
+    if magic != MAGIC or not 0 < count <= MAX_TARGETS:
+        raise SystemExit("not a bundle")
+    offset = HEADER.size + ENTRY.size * count
+    for i in range(count):
+        label, type_, subtype, _, length = ENTRY.unpack_from(data, HEADER.size + ENTRY.size * i)
+        label = label.rstrip(b"\0").decode() or "-"
+        print("%u: type=0x%02x subtype=0x%02x label=%s offset=%u length=%u" % (i, type_, subtype, label, offset, length))
+        offset += length
+    if offset != len(data):
+        raise SystemExit("bundle length %d does not match its index (%d)" % (len(data), offset))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    build_parser = commands.add_parser("build", help="build a bundle")
+    build_parser.add_argument("-o", "--output", required=True, help="bundle file to write")
+    build_parser.add_argument("payloads", nargs="+", metavar="TARGET=FILE")
+    build_parser.set_defaults(func=build)
+
+    list_parser = commands.add_parser("list", help="print the index of a bundle")
+    list_parser.add_argument("bundle")
+    list_parser.set_defaults(func=list_bundle)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,300 @@
+#!/usr/bin/env python3
+"""Fleet update simulator for studying origin load and rollout time of UpdateOTA.
+
+Every device is an asyncio task that runs the same steps as the engine:
+    getUpdateManifest() -> isRolloutDue() -> startUpdate() with retries -> verify -> reboot
+(or a single conditional request with `--conditional`, see setConditionalDownload()).
+The rollout slot is UpdateOTARollout::slotOffsetSec() and the retry delay is the exponential
+backoff with full jitter of UpdateOTA::retryDelayMs(), Retry-After included.
+
+The origin is a local server model with an egress bandwidth shared fairly by the running
+transfers and a connection limit; requests beyond it get 503 with Retry-After. Devices have
+their own Wi-Fi throughput (log-normal around `--wifi-kbps`), round-trip time and flash
+timing per 4096 byte block. Transfers drop with `--drop-rate` per block and resume with a
+Range request. Time is virtual: the event loop jumps to the next timer, so hours of rollout
+run in seconds and a `--seed` reproduces a run.
+
+    ota_fleet_sim.py --devices 10000 --window 7200 --image-size 1600000
+    ota_fleet_sim.py --devices 10000 --window 0 --origin-mbps 200 --origin-max-conn 500
+    ota_fleet_sim.py --devices 2000 --window 3600 --conditional --csv load.csv
+"""
+
+import argparse
+import asyncio
+import math
+import random
+import selectors
+import struct
+
+BLOCK_SIZE = 4096
+MASK32 = 0xFFFFFFFF
+MANIFEST_SIZE = 64
+SIGNATURE_SIZE = 72
+HTTP_OVERHEAD = 400
+
+
+def slot_offset_sec(mac, rollout_id, window_sec):
+    """Slot of a device inside the rollout window, same as UpdateOTARollout::slotOffsetSec()."""
+    h = 2166136261
+    for byte in mac + rollout_id.encode():
+        h = ((h ^ byte) * 16777619) & MASK32
+    h ^= h >> 16
+    h = (h * 0x85EBCA6B) & MASK32
+    h ^= h >> 13
+    h = (h * 0xC2B2AE35) & MASK32
+    h ^= h >> 16
+    return (h * window_sec) >> 32
+
+
+def retry_delay_ms(rng, attempt, base_ms, max_ms, retry_after_ms):
+    """Backoff of UpdateOTA::retryDelayMs(): full jitter under a doubling cap, Retry-After wins."""
+    cap = base_ms
+    for _ in range(1, attempt):
+        if cap >= max_ms:
+            break
+        cap *= 2
+    cap = min(cap, max_ms)
+    return max(rng.randint(0, cap), retry_after_ms)
+
+
+class VirtualTimeLoop(asyncio.SelectorEventLoop):
+    """Event loop whose clock jumps to the next timer instead of sleeping."""
+
+    def __init__(self):
+        self._now = 0.0
+        super().__init__(selector=_VirtualSelector(self))
+
+    def time(self):
+        return self._now
+
+
+class _VirtualSelector(selectors.DefaultSelector):
+    def __init__(self, loop):
+        super().__init__()
+        self._loop = loop
+
+    def select(self, timeout=None):
+        if timeout:
+            self._loop._now += timeout
+        return super().select(0)
+
+
+class Origin:
+    """Local server model: shared egress bandwidth, connection limit, load statistics."""
+
+    def __init__(self, args):
+        self.bandwidth = args.origin_mbps * 1e6 / 8
+        self.max_connections = args.origin_max_conn
+        self.retry_after_ms = args.retry_after * 1000
+        self.bucket = args.bucket
+        self.connections = 0
+        self.transfers = 0
+        self.requests = 0
+        self.rejected = 0
+        self.bytes = 0
+        self.sent = {}
+        self.peak_connections = {}
+        self.retries = {}
+
+    def _index(self, now):
+        return int(now // self.bucket)
+
+    def connect(self, now):
+        """Open a connection, False when the server answers 503."""
+        self.requests += 1
+        if self.connections >= self.max_connections:
+            self.rejected += 1
+            return False
+        self.connections += 1
+        index = self._index(now)
+        self.peak_connections[index] = max(self.peak_connections.get(index, 0), self.connections)
+        return True
+
+    def close(self):
+        self.connections -= 1
+
+    def share(self):
+        """Fair share of the egress bandwidth of one running transfer, bytes per second."""
+        return self.bandwidth / max(self.transfers, 1)
+
+    def send(self, now, length):
+        self.bytes += length
+        index = self._index(now)
+        self.sent[index] = self.sent.get(index, 0) + length
+
+    def retry(self, now):
+        index = self._index(now)
+        self.retries[index] = self.retries.get(index, 0) + 1
+
+
+class Device:
+    def __init__(self, index, args, rng):
+        self.mac = struct.pack(">HI", 0x240A, 0xC4000000 + index)
+        self.args = args
+        self.rng = rng
+        self.wifi = args.wifi_kbps * 1000 / 8 * math.exp(rng.gauss(0, args.wifi_spread))
+        self.rtt = args.latency_ms / 1000 * math.exp(rng.gauss(0, 0.3))
+        self.poll_at = rng.uniform(0, args.poll_interval)
+        self.completed = 0
+        self.attempts = 0
+        self.retries = 0
+        self.finished_at = None
+
+    async def request(self, origin, length, first=None):
+        """One HTTP exchange, streams the image from `first` if given; None when rejected."""
+        loop = asyncio.get_running_loop()
+        handshake = self.rtt * (3 if self.args.tls else 1)
+        await asyncio.sleep(handshake)
+        if not origin.connect(loop.time()):
+            await asyncio.sleep(self.rtt)
+            return None
+        try:
+            await asyncio.sleep(self.rtt)
+            origin.send(loop.time(), HTTP_OVERHEAD)
+            if first is None:
+                origin.send(loop.time(), length)
+                return length
+            return await self.transfer(origin, first, length)
+        finally:
+            origin.close()
+
+    async def transfer(self, origin, first, length):
+        """Stream blocks from `first`, a drop ends the transfer early."""
+        loop = asyncio.get_running_loop()
+        flash = self.args.flash_ms / 1000
+        origin.transfers += 1
+        try:
+            offset = first
+            while offset < length:
+                block = min(BLOCK_SIZE, length - offset)
+                network = block / min(self.wifi, origin.share())
+                # The pipeline overlaps flash with the network, otherwise they add up
+                await asyncio.sleep(max(network, flash) if self.args.pipeline else network + flash)
+                if self.rng.random() < self.args.drop_rate:
+                    return offset
+                origin.send(loop.time(), block)
+                offset += block
+            return offset
+        finally:
+            origin.transfers -= 1
+
+    async def run(self, origin):
+        args = self.args
+        loop = asyncio.get_running_loop()
+        await asyncio.sleep(self.poll_at)
+
+        # Poll until the rollout slot arrived: a manifest request, or in conditional mode the
+        # image request the origin answers with 304 before the slot
+        slot = slot_offset_sec(self.mac, args.rollout_id, args.window) if args.window > 0 else 0
+        while True:
+            if args.conditional and loop.time() >= slot:
+                break  # The image request is the check
+            answered = await self.request(origin, 0 if args.conditional else MANIFEST_SIZE) is not None
+            if answered and loop.time() >= slot:
+                break
+            if not answered:
+                origin.retry(loop.time())
+            await asyncio.sleep(args.poll_interval)
+
+        if args.signed:
+            while await self.request(origin, SIGNATURE_SIZE) is None:
+                origin.retry(loop.time())
+                await asyncio.sleep(retry_delay_ms(self.rng, 1, args.base_delay_ms, args.max_delay_ms, origin.retry_after_ms) / 1000)
+
+        # startUpdate(): resume from the completed blocks, back off between attempts
+        while self.completed < args.image_size:
+            self.attempts += 1
+            retry_after = 0
+            received = await self.request(origin, args.image_size, first=self.completed)
+            if received is None:
+                retry_after = origin.retry_after_ms
+            else:
+                self.completed = received
+            if self.completed >= args.image_size:
+                break
+            if self.attempts >= args.max_attempts:
+                # The application tries again at its next poll
+                self.attempts = 0
+                await asyncio.sleep(args.poll_interval)
+                continue
+            self.retries += 1
+            origin.retry(loop.time())
+            await asyncio.sleep(retry_delay_ms(self.rng, self.attempts, args.base_delay_ms, args.max_delay_ms, retry_after) / 1000)
+
+        await asyncio.sleep(args.reboot_ms / 1000)
+        self.finished_at = loop.time()
+
+
+def percentile(values, fraction):
+    if not values:
+        return float("nan")
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+def report(args, origin, devices, csv_path):
+    done = [d.finished_at for d in devices if d.finished_at is not None]
+    buckets = sorted(set(origin.sent) | set(origin.peak_connections) | set(origin.retries))
+    rates = [origin.sent.get(b, 0) * 8 / args.bucket / 1e6 for b in buckets]
+    connections = [origin.peak_connections.get(b, 0) for b in buckets]
+    retries = [origin.retries.get(b, 0) for b in buckets]
+
+    print("devices            %d, completed %d" % (len(devices), len(done)))
+    print("completion time    p50 %.0fs, p99 %.0fs, last %.0fs" % (percentile(done, 0.5), percentile(done, 0.99), max(done or [0])))
+    print("origin traffic     %.1f MB, %d requests, %d rejected (503)" % (origin.bytes / 1e6, origin.requests, origin.rejected))
+    print("origin bandwidth   peak %.1f Mbit/s, mean %.1f Mbit/s (per %gs)" % (max(rates or [0]), sum(rates) / max(len(rates), 1), args.bucket))
+    print("connections        peak %d, p50 %d, p99 %d" % (max(connections or [0]), percentile(connections, 0.5) if connections else 0, percentile(connections, 0.99) if connections else 0))
+    print("retries            %d total, peak %d per %gs" % (sum(d.retries for d in devices), max(retries or [0]), args.bucket))
+
+    if csv_path:
+        with open(csv_path, "w") as f:
+            f.write("time_s,origin_mbps,peak_connections,retries\n")
+            for b, rate, connection, retry in zip(buckets, rates, connections, retries):
+                f.write("%g,%.3f,%d,%d\n" % (b * args.bucket, rate, connection, retry))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--devices", type=int, default=1000)
+    parser.add_argument("--image-size", type=int, default=1600000, help="image length in bytes")
+    parser.add_argument("--rollout-id", default="r1")
+    parser.add_argument("--window", type=int, default=3600, help="rollout window in seconds, 0 for all at once")
+    parser.add_argument("--poll-interval", type=float, default=900.0, help="seconds between version checks")
+    parser.add_argument("--conditional", action="store_true", help="check and download in one request")
+    parser.add_argument("--signed", action="store_true", help="fetch a detached signature")
+    parser.add_argument("--no-tls", dest="tls", action="store_false", help="plain HTTP, 1 RTT instead of 3 to connect")
+    parser.add_argument("--pipeline", action="store_true", help="overlap flash and network (setPipelineMode)")
+    parser.add_argument("--wifi-kbps", type=float, default=4000.0, help="median device throughput in kbit/s")
+    parser.add_argument("--wifi-spread", type=float, default=0.5, help="sigma of the log-normal throughput")
+    parser.add_argument("--latency-ms", type=float, default=60.0, help="median round-trip time")
+    parser.add_argument("--flash-ms", type=float, default=50.0, help="erase and write time per 4096 byte block")
+    parser.add_argument("--drop-rate", type=float, default=0.0005, help="probability of a dropped transfer per block")
+    parser.add_argument("--reboot-ms", type=float, default=1500.0)
+    parser.add_argument("--origin-mbps", type=float, default=1000.0, help="origin egress in Mbit/s")
+    parser.add_argument("--origin-max-conn", type=int, default=1000, help="connections before the origin answers 503")
+    parser.add_argument("--retry-after", type=int, default=30, help="Retry-After of a 503 in seconds")
+    parser.add_argument("--max-attempts", type=int, default=3, help="UpdateOTARetryPolicy::maxAttempts")
+    parser.add_argument("--base-delay-ms", type=int, default=1000, help="UpdateOTARetryPolicy::baseDelayMs")
+    parser.add_argument("--max-delay-ms", type=int, default=60000, help="UpdateOTARetryPolicy::maxDelayMs")
+    parser.add_argument("--bucket", type=float, default=60.0, help="statistics interval in seconds")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--csv", help="write the load per interval to a CSV file")
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    origin = Origin(args)
+    devices = [Device(i, args, random.Random(rng.getrandbits(32))) for i in range(args.devices)]
+
+    async def fleet():
+        await asyncio.gather(*(device.run(origin) for device in devices))
+
+    loop = VirtualTimeLoop()
+    try:
+        loop.run_until_complete(fleet())
+    finally:
+        loop.close()
+    report(args, origin, devices, args.csv)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,264 @@
+#!/usr/bin/env python3
+"""Fountain coded UDP multicast sender for UpdateOTA::startMulticastUpdate().
+
+Packet layout (little-endian), must match UpdateOTAFountainDecoder.hpp:
+    uint32 magic ("UOFC"), uint32 imageSize, uint32 blockIndex, uint32 seed, 512 byte payload
+
+Every 4096 byte block is split into 8 source symbols. Seeds 0..7 are the source symbols,
+higher seeds are XOR combinations selected by coefficients_for_seed(). Blocks are sent in a
+carousel, each round carrying `--overhead` extra repair symbols per block, until `--rounds`
+is reached.
+
+    ota_multicast.py send firmware.bin --sig firmware.bin.sig --group 239.255.0.1 --port 5007
+    ota_multicast.py simulate firmware.bin --receivers 20 --loss 0.1
+"""
+
+import argparse
+import math
+import random
+import socket
+import struct
+import threading
+import time
+
+MAGIC = 0x43464F55
+BLOCK_SIZE = 4096
+SYMBOL_SIZE = 512
+SYMBOLS_PER_BLOCK = BLOCK_SIZE // SYMBOL_SIZE
+SLOTS = 4
+SIGNATURE_BLOCK = 0xFFFFFFFF
+HEADER = struct.Struct("<IIII")
+MASK32 = 0xFFFFFFFF
+
+
+def coefficients_for_seed(seed):
+    """Source symbols combined by an encoded symbol, same as the device decoder."""
+    if seed < SYMBOLS_PER_BLOCK:
+        return 1 << seed
+    x = seed
+    x ^= x >> 16
+    x = (x * 0x85EBCA6B) & MASK32
+    x ^= x >> 13
+    x = (x * 0xC2B2AE35) & MASK32
+    x ^= x >> 16
+    coefficients = x & ((1 << SYMBOLS_PER_BLOCK) - 1)
+    return coefficients if coefficients else 1 << (seed % SYMBOLS_PER_BLOCK)
+
+
+class Encoder:
+    def __init__(self, image):
+        self.image = image
+        self.block_count = (len(image) + BLOCK_SIZE - 1) // BLOCK_SIZE
+        padded = image + b"\xff" * (self.block_count * BLOCK_SIZE - len(image))
+        self.symbols = [
+            int.from_bytes(padded[offset:offset + SYMBOL_SIZE], "little")
+            for offset in range(0, len(padded), SYMBOL_SIZE)
+        ]
+
+    def packet(self, block, seed):
+        coefficients = coefficients_for_seed(seed)
+        value = 0
+        for i in range(SYMBOLS_PER_BLOCK):
+            if coefficients & (1 << i):
+                value ^= self.symbols[block * SYMBOLS_PER_BLOCK + i]
+        return HEADER.pack(MAGIC, len(self.image), block, seed) + value.to_bytes(SYMBOL_SIZE, "little")
+
+    def rounds(self, overhead):
+        """Yield packets round after round, forever."""
+        repair = max(1, math.ceil(SYMBOLS_PER_BLOCK * overhead))
+        round_index = 0
+        while True:
+            for block in range(self.block_count):
+                if round_index == 0:
+                    seeds = list(range(SYMBOLS_PER_BLOCK)) + [SYMBOLS_PER_BLOCK + j for j in range(repair)]
+                else:
+                    first = SYMBOLS_PER_BLOCK + round_index * (SYMBOLS_PER_BLOCK + repair)
+                    seeds = [first + j for j in range(SYMBOLS_PER_BLOCK + repair)]
+                for seed in seeds:
+                    yield round_index, self.packet(block, seed)
+            round_index += 1
+
+
+def signature_packet(signature, image_size):
+    return HEADER.pack(MAGIC, image_size, SIGNATURE_BLOCK, len(signature)) + signature
+
+
+class Decoder:
+    """Python twin of UpdateOTAFountainDecoder, used by the receiver simulator."""
+
+    def __init__(self):
+        self.image_size = 0
+        self.blocks = {}
+        self.slots = {}
+        self.counter = 0
+
+    def add(self, packet):
+        magic, image_size, block, seed = HEADER.unpack_from(packet)
+        if magic != MAGIC or block == SIGNATURE_BLOCK:
+            return
+        if self.image_size == 0:
+            self.image_size = image_size
+        if block in self.blocks:
+            return
+        self.counter += 1
+        slot = self.slots.get(block)
+        if slot is None:
+            if len(self.slots) >= SLOTS:
+                stale = min(self.slots, key=lambda b: self.slots[b]["used"])
+                del self.slots[stale]
+            slot = self.slots[block] = {"rows": {}, "used": 0}
+        slot["used"] = self.counter
+        coefficients = coefficients_for_seed(seed)
+        value = int.from_bytes(packet[HEADER.size:], "little")
+        rows = slot["rows"]
+        for pivot in sorted(rows):
+            if coefficients & (1 << pivot):
+                row_coefficients, row_value = rows[pivot]
+                coefficients ^= row_coefficients
+                value ^= row_value
+        if coefficients == 0:
+            return
+        pivot = (coefficients & -coefficients).bit_length() - 1
+        for row in list(rows):
+            row_coefficients, row_value = rows[row]
+            if row_coefficients & (1 << pivot):
+                rows[row] = (row_coefficients ^ coefficients, row_value ^ value)
+        rows[pivot] = (coefficients, value)
+        if len(rows) == SYMBOLS_PER_BLOCK:
+            self.blocks[block] = b"".join(rows[i][1].to_bytes(SYMBOL_SIZE, "little") for i in range(SYMBOLS_PER_BLOCK))
+            del self.slots[block]
+
+    def complete(self):
+        return self.image_size and len(self.blocks) == (self.image_size + BLOCK_SIZE - 1) // BLOCK_SIZE
+
+    def image(self):
+        return b"".join(self.blocks[i] for i in sorted(self.blocks))[:self.image_size]
+
+
+def sender_socket(ttl, interface):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, ttl)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+    if interface:
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(interface))
+    return sock
+
+
+def receiver_socket(group, port, interface):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    if hasattr(socket, "SO_REUSEPORT"):
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 * 1024 * 1024)
+    sock.bind(("", port))
+    membership = socket.inet_aton(group) + socket.inet_aton(interface or "0.0.0.0")
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+    sock.settimeout(0.5)
+    return sock
+
+
+def send(image, signature, args, stop=None):
+    sock = sender_socket(args.ttl, args.interface)
+    encoder = Encoder(image)
+    interval = (HEADER.size + SYMBOL_SIZE) * 8 / (args.rate_kbps * 1000.0)
+    sent = 0
+    next_send = time.monotonic()
+    for round_index, packet in encoder.rounds(args.overhead):
+        if round_index >= args.rounds or (stop is not None and stop.is_set()):
+            break
+        if signature and sent % (encoder.block_count * 4) == 0:
+            sock.sendto(signature_packet(signature, len(image)), (args.group, args.port))
+        sock.sendto(packet, (args.group, args.port))
+        sent += 1
+        next_send += interval
+        delay = next_send - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+    sock.close()
+    return sent
+
+
+def receive(index, image, args, start, results):
+    sock = receiver_socket(args.group, args.port, args.interface)
+    decoder = Decoder()
+    loss = random.Random(index)
+    received = 0
+    while not decoder.complete() and time.monotonic() - start < args.timeout:
+        try:
+            packet = sock.recv(2048)
+        except socket.timeout:
+            continue
+        if loss.random() < args.loss:
+            continue
+        received += 1
+        decoder.add(packet)
+    sock.close()
+    done = decoder.complete() and decoder.image() == image
+    results[index] = (time.monotonic() - start if done else None, received)
+
+
+def percentile(values, fraction):
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(math.ceil(fraction * len(ordered))) - 1)]
+
+
+def simulate(image, signature, args):
+    results = {}
+    start = time.monotonic()
+    receivers = [threading.Thread(target=receive, args=(i, image, args, start, results)) for i in range(args.receivers)]
+    for receiver in receivers:
+        receiver.start()
+    time.sleep(0.2)  # Let every receiver join the group.
+
+    stop = threading.Event()
+    sender = threading.Thread(target=lambda: results.setdefault("sent", send(image, signature, args, stop)))
+    sender.start()
+    for receiver in receivers:
+        receiver.join()
+    stop.set()
+    sender.join()
+
+    times = [results[i][0] for i in range(args.receivers) if results[i][0] is not None]
+    symbols = len(Encoder(image).symbols)
+    print("image: %d bytes, %d source symbols, loss %.1f%%, overhead %.0f%%" % (len(image), symbols, args.loss * 100, args.overhead * 100))
+    print("receivers completed: %d/%d" % (len(times), args.receivers))
+    if times:
+        print("completion p50 %.2fs  p99 %.2fs  max %.2fs" % (percentile(times, 0.5), percentile(times, 0.99), max(times)))
+    print("packets sent: %d (%.2fx source symbols)" % (results.get("sent", 0), results.get("sent", 0) / float(symbols)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("mode", choices=["send", "simulate"])
+    parser.add_argument("image", help="firmware or filesystem image")
+    parser.add_argument("--sig", help="detached signature sent along the image")
+    parser.add_argument("--group", default="239.255.0.1")
+    parser.add_argument("--port", type=int, default=5007)
+    parser.add_argument("--interface", default="", help="local address of the multicast interface")
+    parser.add_argument("--ttl", type=int, default=1)
+    parser.add_argument("--rate-kbps", type=float, default=8000.0, help="send rate in kbit/s")
+    parser.add_argument("--overhead", type=float, default=0.5, help="repair symbols per block, fraction of 8")
+    parser.add_argument("--rounds", type=int, default=5, help="carousel rounds before stopping")
+    parser.add_argument("--receivers", type=int, default=10, help="simulate: number of receivers")
+    parser.add_argument("--loss", type=float, default=0.05, help="simulate: packet loss probability")
+    parser.add_argument("--timeout", type=float, default=600.0, help="simulate: receiver timeout in seconds")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as image_file:
+        image = image_file.read()
+    signature = b""
+    if args.sig:
+        with open(args.sig, "rb") as signature_file:
+            signature = signature_file.read()
+
+    if args.mode == "send":
+        sent = send(image, signature, args)
+        print("sent %d packets" % sent)
+    else:
+        if not args.interface:
+            args.interface = "127.0.0.1"
+        simulate(image, signature, args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""Sparse image builder for UpdateOTA::startSparseUpdate().
+
+Sparse layout (little-endian), must match UpdateOTASparse.hpp:
+    uint32 magic ("UOSP"), uint32 imageSize
+    extents until the end: uint32 offset, uint32 length, length bytes of data
+
+Runs of 0xFF of at least `--min-gap` bytes are left out, the device erases them without
+downloading or writing. The signature of the plain image also signs the sparse one.
+
+    ota_sparse.py build spiffs.bin -o spiffs.sparse
+    ota_sparse.py expand spiffs.sparse -o spiffs.check.bin
+    cp spiffs.bin.sig spiffs.sparse.sig
+"""
+
+import argparse
+import re
+import struct
+
+MAGIC = 0x50534F55
+HEADER = struct.Struct("<II")
+EXTENT = struct.Struct("<II")
+
+
+def extents(image, min_gap):
+    """(offset, length) of the data between 0xFF runs of at least min_gap bytes."""
+    result = []
+    start = 0
+    for blank in re.finditer(b"\xff{%d,}" % min_gap, image):
+        if blank.start() > start:
+            result.append((start, blank.start() - start))
+        start = blank.end()
+    if start < len(image):
+        result.append((start, len(image) - start))
+    return result
+
+
+def build(args):
+    with open(args.image, "rb") as f:
+        image = f.read()
+
+    parts = [HEADER.pack(MAGIC, len(image))]
+    for offset, length in extents(image, args.min_gap):
+        parts.append(EXTENT.pack(offset, length))
+        parts.append(image[offset:offset + length])
+    sparse = b"".join(parts)
+
+    with open(args.output, "wb") as f:
+        f.write(sparse)
+    print("%s: %d extents, %d of %d bytes (%.1f%%)" % (
+        args.output, (len(parts) - 1) // 2, len(sparse), len(image), 100.0 * len(sparse) / max(len(image), 1)))
+
+
+def expand(args):
+    with open(args.sparse, "rb") as f:
+        sparse = f.read()
+
+    magic, image_size = HEADER.unpack_from(sparse, 0)
+    if magic != MAGIC:
+        raise SystemExit("not a sparse image")
+    image = bytearray(b"\xff" * image_size)
+    position = HEADER.size
+    previous_end = 0
+    while position < len(sparse):
+        offset, length = EXTENT.unpack_from(sparse, position)
+        position += EXTENT.size
+        if offset < previous_end or offset + length > image_size or position + length > len(sparse):
+            raise SystemExit("invalid extent at offset %d" % offset)
+        image[offset:offset + length] = sparse[position:position + length]
+        position += length
+        previous_end = offset + length
+
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print("%s: %d bytes" % (args.output, image_size))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    build_parser = commands.add_parser("build", help="build a sparse image")
+    build_parser.add_argument("image")
+    build_parser.add_argument("-o", "--output", required=True, help="sparse file to write")
+    build_parser.add_argument("--min-gap", type=int, default=256, help="shortest 0xFF run left out (bytes)")
+    build_parser.set_defaults(func=build)
+
+    expand_parser = commands.add_parser("expand", help="expand a sparse image, to check it")
+    expand_parser.add_argument("sparse")
+    expand_parser.add_argument("-o", "--output", required=True, help="image file to write")
+    expand_parser.set_defaults(func=expand)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()